@@ -362,7 +362,8 @@ void aux_jack_init(void) {
 
   adcStart(&ADCD3, &adccfg3);
 
-  const char* s = getConfigSetting("sGjack2 ");
+  char s[8];
+  getConfigSetting("sGjack2 ", s);
   if (cmp8(s, "pedal_ex")) {
     aux_jack_switch_mode_setting(JACK2_MODE_PEDAL_EXPRESSION);
   } else if (cmp8(s, "pedal_sw")) {
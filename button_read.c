@@ -29,6 +29,8 @@
 #include "led.h"
 
 #include "messaging.h"
+#include "pconnection.h"
+#include "timer_wheel.h"
 #ifdef STM32F4XX
 #include "adc_multi.h"
 #endif
@@ -186,6 +188,8 @@ struct struct_button {
   int timer;
   int but_id;
   int src_id;
+  wheel_timer_t note_off_retry; // scheduled while a note off waits for room in the queue
+  int note_off_velo;
 };
 
 #ifdef USE_BAS
@@ -212,6 +216,7 @@ static button_t buttons_bas[N_BUTTONS_BAS];
 #endif
 static int buttons_pressed[2] = {0};
 static int col_pressed[2][17] = {0};
+static timer_wheel_t note_off_retries;
 
 #ifdef USE_AUX_BUTTONS
 // #define LINE_BUTTON_PORT   PAL_LINE(GPIOI,  2U)
@@ -627,6 +632,44 @@ int32_t calibrate(int32_t s, button_t* but) {
 #define max(x,y) ((x)>(y)?(x):(y))
 #define min(x,y) ((x)<(y)?(x):(y))
 
+static int send_note_off(button_t* but) {
+  int msg[6] = {but->src_id, but->but_id, 0, but->note_off_velo, 0, 0};
+  return msgSend(6, msg) == 0;
+}
+
+/*
+ * Note off messages are more important than the others, when the queue is
+ * full they are retried every tick instead of dropped. Other messages of the
+ * button wait until the note off is sent, the other buttons keep scanning.
+ */
+static void note_off(button_t* but, int velo) {
+  but->note_off_velo = velo;
+  if (tw_pending(&but->note_off_retry) || !send_note_off(but)) {
+    tw_schedule(&note_off_retries, &but->note_off_retry, chVTGetSystemTime() + 1);
+  }
+}
+
+static bool note_off_waiting(button_t* but) {
+  if (tw_pending(&but->note_off_retry)) {
+    if (!send_note_off(but))
+      return true;
+    tw_cancel(&note_off_retries, &but->note_off_retry);
+  }
+  return false;
+}
+
+static void note_off_retry(void* arg, timer_wheel_t* w, wheel_timer_t* t) {
+  (void)arg;
+#ifdef USE_BAS
+  button_t* but = t->id >= N_BUTTONS ? &buttons_bas[t->id - N_BUTTONS] : &buttons[t->id];
+#else
+  button_t* but = &buttons[t->id];
+#endif
+  if (!send_note_off(but)) {
+    tw_schedule(w, t, w->now + 1);
+  }
+}
+
 void update_button(button_t* but) {
   int but_id = but->but_id;
   int32_t s_new;
@@ -691,14 +734,7 @@ void update_button(button_t* but) {
       buttons_pressed[but->src_id]--;
       but->timer = INTEGRATED_PRES_TRESHOLD;
 
-      msg[1] = but_id;
-      msg[2] = 0;
-      msg[3] = min(but->velo, 0) / MSGFACT_VELO;
-      msg[4] = 0;
-      msg[5] = 0;
-      while (msgSend(6, msg)) { // note off messages are more important so keep trying
-        chThdSleep(1);
-      }
+      note_off(but, min(but->velo, 0) / MSGFACT_VELO);
     }
     // if integration is succesful and interval is ready send note message
     if (--but->timer <= 0) {
@@ -732,20 +768,15 @@ void update_button(button_t* but) {
       msg[3] = but->velo / MSGFACT_VELO; // but->on;// s_new / MSGFACT; //
       msg[4] = but_x / MSGFACT;
       msg[5] = but_y / MSGFACT;
-      msgSend(6, msg);
+      if (!note_off_waiting(but)) {
+        msgSend(6, msg);
+      }
       but->timer = (buttons_pressed[0] + buttons_pressed[1]) * SENDFACT;
     }
   }
   else if (but->status) {
     if (but->status == ON) {
-      msg[1] = but_id;
-      msg[2] = 0;
-      msg[3] = min(but->velo, 0) / MSGFACT_VELO;
-      msg[4] = 0;
-      msg[5] = 0;
-      while (msgSend(6, msg)) { // note off messages are more important so keep trying
-        chThdSleep(1);
-      }
+      note_off(but, min(but->velo, 0) / MSGFACT_VELO);
       buttons_pressed[but->src_id]--;
     }
     but->status = OFF;
@@ -956,10 +987,55 @@ void update_slider(void) {
 }
 #endif
 
+#ifdef USE_USB
 /*
- * Read out buttons and create messages.
+ * Raw sensor stream, the signals of every measured column are sent each scan
+ * as a raw block in the framed protocol, directly from the button thread. The
+ * id is the column, the values p, s0, s1, s2 for each of the 4 rows, sums of
+ * MULTISAMPLE adc samples. A frame is sent after the last column of a scan
+ * or when it is full.
  */
-static THD_WORKING_AREA(waThreadReadButtons, 128);
+#define RAW_VALUES (4 * 4)
+
+static volatile bool raw_stream = false;
+static striso_frame_t raw_frame;
+
+static void raw_column(int col) {
+  int16_t values[RAW_VALUES];
+  bool measured = false;
+  for (int n = 0; n < 4; n++) {
+    button_t* but = &buttons[col + n * 17];
+    measured |= but->on > KEY_DETECT;
+    values[n*4 + 0] = but->p;
+    values[n*4 + 1] = but->s0;
+    values[n*4 + 2] = but->s1;
+    values[n*4 + 3] = but->s2;
+  }
+  if (measured && !striso_frame_add_raw(&raw_frame, col, RAW_VALUES, values)) {
+    PExSendFrame(&raw_frame);
+    striso_frame_begin(&raw_frame);
+    striso_frame_add_raw(&raw_frame, col, RAW_VALUES, values);
+  }
+  if (col == 16 && !striso_frame_empty(&raw_frame)) {
+    PExSendFrame(&raw_frame);
+    striso_frame_begin(&raw_frame);
+  }
+}
+
+void buttonSetRawStream(bool on) {
+  raw_stream = on;
+}
+#else
+void buttonSetRawStream(bool on) {
+  (void)on;
+}
+#endif
+
+/*
+ * Read out buttons and create messages. The stack has room for sending raw
+ * stream frames from this thread, check the unused stack with StcI.
+ */
+static THD_WORKING_AREA(waThreadReadButtons, 512);
 static void ThreadReadButtons(void *arg) {
   (void)arg;
 
@@ -995,8 +1071,18 @@ static void ThreadReadButtons(void *arg) {
   }
 #endif // DETECT_STUCK_NOTES
 
+#ifdef USE_USB
+  striso_frame_begin(&raw_frame);
+#endif
+
   while (TRUE) {
     while (note_id != next_note_id) {
+#ifdef USE_USB
+        // before update_button, it clears p of released buttons
+        if (raw_stream) {
+          raw_column(note_id);
+        }
+#endif
         // Update button in each octave/adc-channel
         for (int n = 0; n < 4; n++) {
           update_button(&buttons[note_id + n * 17]);
@@ -1053,6 +1139,7 @@ static void ThreadReadButtons(void *arg) {
         }
         // Once per cycle, after the last buttons
         if (note_id == 16) {
+          tw_advance(&note_off_retries, chVTGetSystemTime(), note_off_retry, NULL);
 #ifdef USE_AUX_BUTTONS
           int msg[8];
           for (int n = 0; n < 4; n++) {
@@ -1166,6 +1253,7 @@ void ButtonReadStart(void) {
     buttons[n].zero_time = 0;
     buttons[n].zero_max = 0;
     buttons[n].fact = 1.0f;
+    tw_timer_init(&buttons[n].note_off_retry, n);
   }
   // disable not existing buttons
   buttons[52].c_force = 0;
@@ -1181,8 +1269,10 @@ void ButtonReadStart(void) {
     buttons_bas[n].src_id = ID_BAS;
     buttons_bas[n].c_force = (ADCFACT>>6) / 6;//calib_bas[n];//(ADCFACT>>6) / 2;
     buttons_bas[n].c_offset = ADC_OFFSET;
+    tw_timer_init(&buttons_bas[n].note_off_retry, N_BUTTONS + n);
   }
 #endif
+  tw_init(&note_off_retries, chVTGetSystemTime());
 
   uint32_t* const UID = (uint32_t*)UID_BASE;
 
@@ -22,5 +22,6 @@
 
 void ButtonReadStart(void);
 void buttonSetCalibration(void);
+void buttonSetRawStream(bool on);
 
 #endif
@@ -23,13 +23,17 @@
 #include "config.h"
 
 // double buffers for DMA, interleaved stereo
-extern int32_t buf[PLAYBACK_BUFFER_SIZE];
-extern int32_t buf2[PLAYBACK_BUFFER_SIZE];
-extern int32_t rbuf[PLAYBACK_BUFFER_SIZE];
-extern int32_t rbuf2[PLAYBACK_BUFFER_SIZE];
+extern int32_t buf[MAX_PLAYBACK_BUFFER_SIZE];
+extern int32_t buf2[MAX_PLAYBACK_BUFFER_SIZE];
+extern int32_t rbuf[MAX_PLAYBACK_BUFFER_SIZE];
+extern int32_t rbuf2[MAX_PLAYBACK_BUFFER_SIZE];
+
+// samples per channel in the current DMA buffers
+extern volatile int codec_block_size;
 
 extern void codec_init(uint16_t samplerate);
 extern void codec_stop(void);
+extern int codec_set_block_size(int size);
 
 extern void computebufI(int32_t *inp, int32_t *outp);
 
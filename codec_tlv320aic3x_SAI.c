@@ -39,14 +39,16 @@ const stm32_dma_stream_t* sai_b_dma;
 
 //int codec_interrupt_timestamp;
 
-int32_t buf[PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
-int32_t buf2[PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
-int32_t rbuf[PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
-int32_t rbuf2[PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
+int32_t buf[MAX_PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
+int32_t buf2[MAX_PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
+int32_t rbuf[MAX_PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
+int32_t rbuf2[MAX_PLAYBACK_BUFFER_SIZE] __attribute__ ((section (".nocache")));
+
+volatile int codec_block_size = CHANNEL_BUFFER_SIZE;
 
 void codec_clearbuffer(void) {
   int i;
-  for (i = 0; i < PLAYBACK_BUFFER_SIZE; i++) {
+  for (i = 0; i < MAX_PLAYBACK_BUFFER_SIZE; i++) {
     buf[i] = 0;
     buf2[i] = 0;
   }
@@ -175,6 +177,8 @@ volatile SAI_Block_TypeDef *sai_b;
 const stm32_dma_stream_t* sai_a_dma;
 const stm32_dma_stream_t* sai_b_dma;
 
+static void codec_dma_start(void);
+
 void codec_i2s_init(uint16_t sampleRate) {
   sai_a = SAI1_Block_A;
   sai_b = SAI1_Block_B;
@@ -232,7 +236,6 @@ void codec_i2s_init(uint16_t sampleRate) {
   dmaStreamSetPeripheral(sai_a_dma, &(sai_a->DR));
   dmaStreamSetMemory0(sai_a_dma, buf);
   dmaStreamSetMemory1(sai_a_dma, buf2);
-  dmaStreamSetTransactionSize(sai_a_dma, PLAYBACK_BUFFER_SIZE);
   dmaStreamSetMode(sai_a_dma, sai_a_dma_mode | STM32_DMA_CR_MINC);
 
   sai_b_dma = dmaStreamAlloc(STM32_SAI_B_DMA_STREAM,
@@ -244,9 +247,18 @@ void codec_i2s_init(uint16_t sampleRate) {
   dmaStreamSetPeripheral(sai_b_dma, &(sai_b->DR));
   dmaStreamSetMemory0(sai_b_dma, rbuf);
   dmaStreamSetMemory1(sai_b_dma, rbuf2);
-  dmaStreamSetTransactionSize(sai_b_dma, PLAYBACK_BUFFER_SIZE);
   dmaStreamSetMode(sai_b_dma, sai_b_dma_mode | STM32_DMA_CR_MINC);
 
+  codec_dma_start();
+}
+
+/*
+ * Start the SAI with DMA transfers of codec_block_size stereo samples.
+ */
+static void codec_dma_start(void) {
+  dmaStreamSetTransactionSize(sai_a_dma, codec_block_size * 2);
+  dmaStreamSetTransactionSize(sai_b_dma, codec_block_size * 2);
+
   #if CODEC_ENABLE_INPUT
   dmaStreamClearInterrupt(sai_b_dma);
   #endif
@@ -268,6 +280,33 @@ void codec_i2s_init(uint16_t sampleRate) {
   chSysUnlock();
 }
 
+static void codec_dma_stop(void) {
+  SAI1_Block_A->CR1 &= ~SAI_xCR1_SAIEN;
+  SAI1_Block_B->CR1 &= ~SAI_xCR1_SAIEN;
+  while ((SAI1_Block_A->CR1 & SAI_xCR1_SAIEN) || (SAI1_Block_B->CR1 & SAI_xCR1_SAIEN)) {
+    chThdSleepMilliseconds(1);
+  }
+  dmaStreamDisable(sai_a_dma);
+  dmaStreamDisable(sai_b_dma);
+}
+
+/*
+ * Change the audio block size, this sets the latency and the interval at which
+ * the synth is computed. Audio stops for a few ms.
+ */
+int codec_set_block_size(int size) {
+  if (size != 16 && size != 32 && size != 64)
+    return -1;
+  if (size == codec_block_size)
+    return 0;
+
+  codec_dma_stop();
+  codec_clearbuffer();
+  codec_block_size = size;
+  codec_dma_start();
+  return 0;
+}
+
 void codec_init(uint16_t samplerate) {
   codec_i2s_init(samplerate);
   codec_aic3x_init(samplerate);
@@ -38,8 +38,9 @@
 // #define SAMPLERATE 48000
 #define SAMPLERATE 48828    // 48828.125 TODO: find clock settings to get 48000 Hz
 #define SAMPLINGFREQ SAMPLERATE
-#define CHANNEL_BUFFER_SIZE		32
-#define PLAYBACK_BUFFER_SIZE	(CHANNEL_BUFFER_SIZE*2)
+#define CHANNEL_BUFFER_SIZE		32  // default audio block size, 16, 32 or 64 can be set at runtime
+#define MAX_CHANNEL_BUFFER_SIZE	64
+#define MAX_PLAYBACK_BUFFER_SIZE	(MAX_CHANNEL_BUFFER_SIZE*2)
 #define CODEC_ENABLE_INPUT    TRUE
 
 // #define OLD_CONFIG_LAYOUT
@@ -65,6 +66,7 @@
 #define AUX_BUTTON_DEBOUNCE_TIME 5
 
 #define MAX_VOICECOUNT 15
+#define MIDI_VOICECOUNT 6 // default MPE voice count, the internal synth has VOICECOUNT
 
 typedef enum {
   MIDI_MODE_MPE,
@@ -91,6 +93,7 @@ typedef enum {
 typedef struct struct_config {
   int message_interval;
   int send_usb_bulk;
+  bool bulk_pacing;
   bool send_midi_monitor;
   int send_motion_interval;
   int send_motion_14bit;
@@ -121,7 +124,8 @@ extern config_t config;
 // default config
 config_t config = {
   .message_interval = 1,      // interval in ms
-  .send_usb_bulk = 0,         // send Striso binary protocol
+  .send_usb_bulk = 0,         // send Striso binary protocol, 1: messages, 2: frames
+  .bulk_pacing = 1,           // max 1 message per tick in the message protocol, for Axoloti
   .send_midi_monitor = 0,     // monitor MIDI in over Striso protocol
   .send_motion_interval = 127,// 0 = disable, 127 only internal, else x10ms
   .send_motion_14bit = 0,     // send 14 bit motion CC
@@ -172,6 +176,7 @@ const ConfigParam default_config[] = {
   {"iGoct   ", "0       "}, // default octave [-2..2]
   {"sGjack2 ", "auto    "}, // auto/midi/pedal_ex/pedal_sw/linein
   {"iGmotion", "127     "}, // motion message interval, 0=disable, 127=internal only
+  {"iGblock ", "32      "}, // synth audio block size, lower is less latency but more DSP load [16/32/64]
 
   // preset 1
   {"sP1name ", "preset1 "},
@@ -182,6 +187,7 @@ const ConfigParam default_config[] = {
   {"sP1Mmode", "mpe     "}, // MIDI mode [mpe/normal/mono]
   {"sP1Mnote", "default "}, // MIDI note mode [default/tuning/button]
   {"sP1jack2", "auto    "}, // jack2 mode [auto/midi/pedal_ex/pedal_sw/linein]
+  {"sP1synth", "synth   "}, // internal synth engine [synth]
   {"iP1tunin", "0       "}, // load tuning [0-8]
   {"fP1Toff ", "        "}, // additional tuning offset in cent
   {"iP1Mpres", "121     "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -208,6 +214,7 @@ const ConfigParam default_config[] = {
   {"sP2Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP2Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP2jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP2synth", "        "}, // internal synth engine [synth]
   {"iP2tunin", "        "}, // load tuning [0-8]
   {"fP2Toff ", "        "}, // additional tuning offset in cent
   {"iP2Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -234,6 +241,7 @@ const ConfigParam default_config[] = {
   {"sP3Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP3Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP3jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP3synth", "        "}, // internal synth engine [synth]
   {"iP3tunin", "        "}, // load tuning [0-8]
   {"fP3Toff ", "        "}, // additional tuning offset in cent
   {"iP3Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -260,6 +268,7 @@ const ConfigParam default_config[] = {
   {"sP4Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP4Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP4jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP4synth", "        "}, // internal synth engine [synth]
   {"iP4tunin", "        "}, // load tuning [0-8]
   {"fP4Toff ", "        "}, // additional tuning offset in cent
   {"iP4Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -286,6 +295,7 @@ const ConfigParam default_config[] = {
   {"sP5Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP5Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP5jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP5synth", "        "}, // internal synth engine [synth]
   {"iP5tunin", "        "}, // load tuning [0-8]
   {"fP5Toff ", "        "}, // additional tuning offset in cent
   {"iP5Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -312,6 +322,7 @@ const ConfigParam default_config[] = {
   {"sP6Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP6Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP6jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP6synth", "        "}, // internal synth engine [synth]
   {"iP6tunin", "        "}, // load tuning [0-8]
   {"fP6Toff ", "        "}, // additional tuning offset in cent
   {"iP6Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -338,6 +349,7 @@ const ConfigParam default_config[] = {
   {"sP7Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP7Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP7jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP7synth", "        "}, // internal synth engine [synth]
   {"iP7tunin", "        "}, // load tuning [0-8]
   {"fP7Toff ", "        "}, // additional tuning offset in cent
   {"iP7Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -364,6 +376,7 @@ const ConfigParam default_config[] = {
   {"sP8Mmode", "        "}, // MIDI mode [mpe/normal/mono]
   {"sP8Mnote", "        "}, // MIDI note mode [default/tuning/button]
   {"sP8jack2", "        "}, // jack2 mode [midi/pedal/linein]
+  {"sP8synth", "        "}, // internal synth engine [synth]
   {"iP8tunin", "        "}, // load tuning [0-8]
   {"fP8Toff ", "        "}, // additional tuning offset in cent
   {"iP8Mpres", "        "}, // MIDI CC for key pressure. Special values 127 = Disable, 120 = Polyphonic Pressure, 121 = Channel Pressure
@@ -1,5 +1,8 @@
+#include <string.h>
+
 #include "ch.h"
 #include "config.h"
+#include "settings_store.h"
 
 /* Button names */
 // key number = 17 * buttons[but].coord0 + 10 * buttons[but].coord1 + 30
@@ -120,37 +123,96 @@ unsigned int atox8(const char* str) {
   return value;
 }
 
+void itoa8(int value, char* str) {
+  char digits[10];
+  int i = 0, n = 0;
+  unsigned int v = value < 0 ? -value : value;
+
+  if (value < 0) {
+    str[i++] = '-';
+  }
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n && i < 8) {
+    str[i++] = digits[--n];
+  }
+  while (i < 8) {
+    str[i++] = ' ';
+  }
+}
+
+// 8 character float with up to 3 decimals
+void ftoa8(float value, char* str) {
+  char digits[8];
+  int i = 0, n = 0;
+
+  if (value < 0) {
+    str[i++] = '-';
+    value = -value;
+  }
+  int frac = (int)(value * 1000 + 0.5f);
+  itoa8(frac / 1000, digits);
+  while (n < 8 && digits[n] != ' ' && i < 8) {
+    str[i++] = digits[n++];
+  }
+  if (i < 7) {
+    str[i++] = '.';
+    for (int d = 100; d && i < 8; d /= 10) {
+      str[i++] = '0' + (frac / d) % 10;
+    }
+  }
+  while (i < 8) {
+    str[i++] = ' ';
+  }
+}
+
 inline
 bool cmp8(const char* a, const char* b) {
   return *((uint64_t *)a) == *((uint64_t *)b);
 }
 
-const char* getConfigSetting(const char* name) {
+void getConfigSetting(const char* name, char* value) {
+  // settings saved on the device take precedence
+  if (settingsStoreGet(name, value))
+    return;
+
   const ConfigParam* cfg = flash_config;
   while (!cmp8(cfg->key, "MCfgEnd ") && cfg->key[0] >= 32 && cfg->key[0] < 127) {
-    if (cmp8(cfg->key, name))
-      return cfg->value;
+    if (cmp8(cfg->key, name)) {
+      memcpy(value, cfg->value, 8);
+      return;
+    }
     cfg++;
   }
 
   cfg = default_config;
   while (!cmp8(cfg->key, "MCfgEnd ") && cfg->key[0] >= 32 && cfg->key[0] < 127) {
-    if (cmp8(cfg->key, name))
-      return cfg->value;
+    if (cmp8(cfg->key, name)) {
+      memcpy(value, cfg->value, 8);
+      return;
+    }
     cfg++;
   }
 
-  return "(ERROR!)";
+  memcpy(value, "(ERROR!)", 8);
 }
 
 float getConfigFloat(const char* name) {
-  return atof8(getConfigSetting(name));
+  char value[8];
+  getConfigSetting(name, value);
+  return atof8(value);
 }
 
 int getConfigInt(const char* name) {
-  return atoi8(getConfigSetting(name));
+  char value[8];
+  getConfigSetting(name, value);
+  return atoi8(value);
 }
 
 unsigned int getConfigHex(const char* name) {
-  return atox8(getConfigSetting(name));
+  char value[8];
+  getConfigSetting(name, value);
+  return atox8(value);
 }
@@ -13,11 +13,13 @@ extern const ConfigParam default_config[];
 // extern ConfigParam* const flash_config;
 #define flash_config ((ConfigParam*)0x08020000)
 
-const char* getConfigSetting(const char* name);
+void getConfigSetting(const char* name, char* value);
 float getConfigFloat(const char* name);
 int getConfigInt(const char* name);
 unsigned int getConfigHex(const char* name);
 void strset(char* key, unsigned int start, const char* str);
+void itoa8(int value, char* str);
+void ftoa8(float value, char* str);
 bool cmp8(const char* a, const char* b);
 
 extern const int button_number_map[61];
@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CURVE_LUT_H
+#define _CURVE_LUT_H
+
+/*
+ * Response curve x^exponent as a table of 256 segments from 0 to 1 with linear
+ * interpolation. The table is built when the curve changes, so evaluating it is
+ * a lookup instead of a powf. Above 1 the curve continues with the slope of the
+ * last segment. An exponent above 1 starts soft, below 1 starts steep, and an
+ * exponent of 1 skips the table and passes the value through.
+ *
+ * See utils/curve_bench.c for the interpolation error and the cost.
+ */
+
+#include <math.h>
+
+#define CURVE_LUT_SEGMENTS 256
+
+typedef struct {
+  float y[CURVE_LUT_SEGMENTS + 1];
+  float exponent;
+  int linear;
+} curve_lut_t;
+
+static inline void curve_lut_build(curve_lut_t* c, float exponent) {
+  c->exponent = exponent;
+  c->linear = exponent == 1.0f;
+  for (int n = 0; n <= CURVE_LUT_SEGMENTS; n++) {
+    c->y[n] = powf((float)n / CURVE_LUT_SEGMENTS, exponent);
+  }
+}
+
+/*
+ * Curve value for x from 0, 0 below that unless the curve is linear.
+ */
+static inline float curve_lut(const curve_lut_t* c, float x) {
+  if (c->linear)
+    return x;
+  float f = x * CURVE_LUT_SEGMENTS;
+  if (!(f > 0.0f)) // also NaN
+    return 0.0f;
+  int n = f < CURVE_LUT_SEGMENTS ? (int)f : CURVE_LUT_SEGMENTS - 1;
+  return c->y[n] + (f - n) * (c->y[n + 1] - c->y[n]);
+}
+
+/*
+ * Curve mirrored for negative x.
+ */
+static inline float curve_lut_signed(const curve_lut_t* c, float x) {
+  return x < 0.0f ? -curve_lut(c, -x) : curve_lut(c, x);
+}
+
+#endif
@@ -39,6 +39,7 @@
  *=====================================================================*/
 
 #ifndef __FASTPOW_H_
+#define __FASTPOW_H_
 
 #ifdef __cplusplus
 #define cast_uint32_t static_cast<uint32_t>
@@ -61,9 +62,19 @@ fastpow2 (float p)
   return v.f;
 }
 
+// Pade approximation of tan, relative error below 1e-6 for |x| < 1.1, which
+// covers filter frequencies up to 0.35 * samplerate
+static inline float
+fasttan (float x)
+{
+  float x2 = x * x;
+  return x * (945.0f - x2 * (105.0f - x2)) / (945.0f - x2 * (420.0f - 15.0f * x2));
+}
+
 #define idiv(a,b) (a)/(b)
 
-int32_t rand_hoaglin_state = -2014852483;
+#define RAND_HOAGLIN_SEED -2014852483
+int32_t rand_hoaglin_state = RAND_HOAGLIN_SEED;
 static inline int
 rand_hoaglin ()
 {
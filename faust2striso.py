@@ -2,92 +2,194 @@
 
 import re
 import subprocess
+import sys
 import os
 
 def touch(fname, times=None):
     with open(fname, 'a'):
         os.utime(fname, times)
 
+GLOBAL_ZONES = ('acc_abs','acc_x','acc_y','acc_z','rot_x','rot_y','rot_z','pedal')
+VOICE_ZONES = ('note','pres','vpres','but_x','but_y')
+
 def interface2embedded_interface(interface_cpp):
     v_re = re.compile(r'ui_interface->open\w*\("v(_bas|)(\d+)"\);')
     add_re = re.compile(r'ui_interface->add\w*\(("\w*", &\w*),')
     ch_lines = []
+    global_zones = []
     cur_voice = ''
-    cur_voice_type = ''
-    max_voice = -1
     for line in interface_cpp:
         line = line.strip()
         if line.startswith('ui_interface->open'):
             v = v_re.findall(line)
             if v:
-                cur_voice_type = v[0][0]
                 cur_voice = v[0][1]
-                if int(cur_voice) > max_voice:
-                    max_voice = int(cur_voice)
         elif line.startswith('ui_interface->add'):
             par = add_re.findall(line)[0].split(',')
             name = par[0].strip('"')
             loc = par[1].strip()
-            if name in ('acc_abs','acc_x','acc_y','acc_z','rot_x','rot_y','rot_z','pedal'):
-                ch_lines.append('synth_interface.{} = {};'.format(name, loc))
-            elif cur_voice and name in ('note','pres','vpres','but_x','but_y'):
-                ch_lines.append('synth_interface{}.{}[{}] = {};'.format(
-                    cur_voice_type, name, cur_voice, loc))
-
-    return ch_lines, max_voice
-
-def faust_postprocess(source):
+            if name in GLOBAL_ZONES:
+                ch_lines.append('zones->{} = {};'.format(name, loc))
+                global_zones.append(loc.lstrip('&'))
+            elif cur_voice and name in VOICE_ZONES:
+                ch_lines.append('zones->{}[voice + {}] = {};'.format(name, cur_voice, loc))
+
+    return ch_lines, global_zones
+
+def find(source, pattern, start=0):
+    # the passes below depend on the exact formatting of the faust output, stop
+    # instead of writing a synth.cpp that doesn't compile or silently differs
+    pos = source.find(pattern, start)
+    if pos < 0:
+        raise ValueError('unexpected faust output, not found: ' + repr(pattern))
+    return pos
+
+def replace(source, old, new):
+    find(source, old)
+    return source.replace(old, new)
+
+def make_zones_static(source, zones, classname):
+    # global controls are shared by all voice instances
+    definitions = []
+    for zone in zones:
+        source = replace(source, '\tFAUSTFLOAT \t{};'.format(zone),
+                         '\tstatic FAUSTFLOAT \t{};'.format(zone))
+        definitions.append('FAUSTFLOAT \t{}::{};'.format(classname, zone))
+    return source + '\n' + '\n'.join(definitions) + '\n'
+
+def fast_tan(source):
+    # filter coefficients are computed per sample with tanf(), use the Pade
+    # approximation in fastpow.h instead, it is accurate for the frequency
+    # range of the filters and much cheaper
+    start = find(source, 'virtual void compute (int count')
+    stop = find(source, '\n\t}\n', start)
+    compute = source[start:stop]
+    tan_re = re.compile(r'(?<![\w.])tanf\(')
+    return source[:start] + tan_re.sub('fasttan(', compute) + source[stop:]
+
+def wavetable_storage(source, classname):
+    # wave tables are filled once and only read by the voices, declare them
+    # with the type and memory section chosen in the template
+    tables = len(re.findall(r'^\t+static float \tftbl\d+\[', source, flags=re.M))
+    source = re.sub(r'^(\t+)static float \t(ftbl\d+)\[', r'\1static wavetable_t \t\2[', source, flags=re.M)
+    source, n = re.subn(r'^float \t{}::(ftbl\d+)\['.format(classname),
+                        r'WAVETABLE_SECTION wavetable_t \t{}::\1['.format(classname), source, flags=re.M)
+    if n != tables:
+        raise ValueError('unexpected faust output, {} wave tables but {} definitions'.format(tables, n))
+    if tables:
+        source = replace(source, 'void fill(int count, float output[]) {', 'void fill(int count, wavetable_t output[]) {')
+    return source
+
+def faust_postprocess(source, classname):
 
     # disable cmath, gives compile error since ubuntu 15.10
     source = source.replace('#include <cmath>', '//#include <cmath>')
 
     # remove clone method as it uses the unsupported new operator
-    source = source.replace('\tvirtual mydsp* clone() {\n\t\treturn new mydsp();\n\t}', '')
+    source = replace(source, '\tvirtual {0}* clone() {{\n\t\treturn new {0}();\n\t}}'.format(classname), '')
 
-    # replace interface function with simpler version without strings
-    start = source.find('virtual void buildUserInterface(UI* ui_interface) {')
-    stop = source.find('}',start)
-    interface_embedded, max_voice = interface2embedded_interface(source[start:stop].splitlines())
+    # the template uses the engines table instead of FAUSTCLASS
+    source, n = re.subn(r'#ifndef FAUSTCLASS \n#define FAUSTCLASS \w+\n#endif\n', '', source)
+    if n != 1:
+        raise ValueError('unexpected faust output, FAUSTCLASS definition not found')
+
+    # replace interface function with simpler version without strings, the
+    # zones of each engine are collected in its own synth_interface_t
+    start = find(source, 'virtual void buildUserInterface(UI* ui_interface) {')
+    stop = find(source, '}', start)
+    interface_embedded, global_zones = interface2embedded_interface(source[start:stop].splitlines())
 
     new_source = ''.join((
         source[:start],
-        'virtual void buildUserInterfaceEmbedded() {\n\t\t',
+        'virtual void buildUserInterfaceEmbedded(synth_interface_t* zones, int voice) {\n\t\t',
         '\n\t\t'.join(interface_embedded),
         '\n\t',
         source[stop:]))
 
-    return new_source, max_voice
+    new_source = fast_tan(new_source)
+    new_source = wavetable_storage(new_source, classname)
+
+    return make_zones_static(new_source, global_zones, classname)
+
+def faust_outputs(source):
+    # mono or stereo output stage
+    outputs = re.findall(r'virtual int getNumOutputs\(\) \{ return (\d+); \}', source)[-1]
+    if outputs not in ('1', '2'):
+        raise ValueError('synth engines should have 1 or 2 outputs, not ' + outputs)
+    return outputs
+
+def engine_table(names, classnames):
+    # the arena holds the voices of the largest engine
+    size = 'sizeof({})'.format(classnames[-1])
+    for classname in reversed(classnames[:-1]):
+        size = 'max(sizeof({}), {})'.format(classname, size)
+    lines = [
+        '#define ENGINECOUNT {}'.format(len(names)),
+        '#define ENGINE_VOICE_SIZE ({})'.format(size),
+        'static const engine_t engines[ENGINECOUNT] = {']
+    for name, classname in zip(names, classnames):
+        lines.append('\t{{{{{}}}, {}::classInit, create_voice<{}>}},'.format(
+            ', '.join("'{}'".format(c) for c in name.ljust(8)), classname, classname))
+    lines.append('};')
+    return '\n'.join(lines) + '\n'
 
 def faust_replace_fixed_sliders(faust_in):
     replace_slider = re.compile(r'hslider\(".*",([^,]*),[^)]*\)')
     return replace_slider.sub(r'\1',faust_in)
 
+def faust_voicecount(faust_in):
+    return int(re.search(r'^voicecount\s*=\s*(\d+)\s*;', faust_in, re.M).group(1))
+
 def main():
-    faust_source = 'synth.dsp'
+    # synth engines selectable by presets, the first one is the default
+    faust_sources = sys.argv[1:] or ['synth.dsp']
     faust_template = 'faust_synth_template.cpp'
-
-    tmp_file = faust_source + '.tmp'
-
-    # preprocess: replace hsliders with fixed values, useful for quick testing
-    # of settings on the pc but compiling the as fixed on embedded platform.
-    # vsliders stay variable.
-    with open(tmp_file,'w') as f:
-        f.write(faust_replace_fixed_sliders(open(faust_source).read()))
-
-    # run faust compiler
-    faust_cpp = subprocess.check_output(['faust','-a',faust_template,tmp_file,'-lang','ocpp']).decode()
-
-    # do some postprocessing for efficient embedded use
-    faust_cpp, max_voice = faust_postprocess(faust_cpp)
+    faust_engine_template = 'faust_engine_template.cpp'
+
+    names = []
+    classnames = []
+    engines_cpp = []
+    outputs = set()
+    for faust_source in faust_sources:
+        name = os.path.splitext(os.path.basename(faust_source))[0]
+        if not re.match(r'^[a-z_][a-z0-9_]{0,7}$', name):
+            raise ValueError('engine name should be a lower case identifier of up to 8 characters: ' + name)
+        classname = 'dsp_' + name
+        tmp_file = faust_source + '.tmp'
+
+        # preprocess: replace hsliders with fixed values, useful for quick testing
+        # of settings on the pc but compiling the as fixed on embedded platform.
+        # vsliders stay variable.
+        with open(tmp_file,'w') as f:
+            f.write(faust_replace_fixed_sliders(open(faust_source).read()))
+
+        # run faust compiler
+        faust_cpp = subprocess.check_output(['faust','-a',faust_engine_template,'-cn',classname,tmp_file,'-lang','ocpp']).decode()
+
+        # do some postprocessing for efficient embedded use
+        outputs.add(faust_outputs(faust_cpp))
+        engines_cpp.append(faust_postprocess(faust_cpp, classname))
+        names.append(name)
+        classnames.append(classname)
+
+    if len(outputs) != 1:
+        raise ValueError('all synth engines should have the same number of outputs')
+
+    synth_cpp = open(faust_template).read()
+    synth_cpp = replace(synth_cpp, '#define OUTPUTCOUNT 1 ', '#define OUTPUTCOUNT {} '.format(outputs.pop()))
+    synth_cpp = replace(synth_cpp, '// <<engines>>\n', '\n'.join(engines_cpp) + '\n' + engine_table(names, classnames))
     with open('synth.cpp','w') as f:
-        f.write(faust_cpp)
+        f.write(synth_cpp)
 
-    # change VOICECOUNT in 'synth.h' if different from voicecount in synth.dsp
+    # change VOICECOUNT in 'synth.h' if different from the largest voicecount
+    # in the dsp files, the generated classes are a single voice which is
+    # instantiated VOICECOUNT times
+    voicecount = max(faust_voicecount(open(faust_source).read()) for faust_source in faust_sources)
     synth_h = open('synth.h').readlines()
     vc_line = [n for n,line in enumerate(synth_h) if line.startswith('#define VOICECOUNT')][0]
     vc = int(synth_h[vc_line].split()[-1])
-    if vc != max_voice + 1:
-        synth_h[vc_line] = '#define VOICECOUNT {}\n'.format(max_voice+1)
+    if vc != voicecount:
+        synth_h[vc_line] = '#define VOICECOUNT {}\n'.format(voicecount)
         with open('synth.h', 'w') as f:
             f.writelines(synth_h)
         # make sure synth_contol gets compiled again
@@ -0,0 +1,8 @@
+// Architecture file for a single synth engine, faust2striso.py inserts the
+// generated classes in faust_synth_template.cpp
+
+// Intrinsics
+<<includeIntrinsic>>
+
+// Class
+<<includeclass>>
@@ -2,24 +2,95 @@
 extern "C" {
     #include "ch.h"
     #include "hal.h"
+    #include "ccportab.h"
     #include "synth.h"
 }
+#include <math.h>
+#include <string.h>
+#include <new>
+#include "fastpow.h" // fasttan() and rand_hoaglin() used by the engines
 
 #define max(x,y) (x>y?x:y)
 #define min(x,y) (x<y?x:y)
 
 #define MAX_VAL (1<<23)
 #define VOLUME_FILTER 0.99f
+#ifndef VOICE_GATE
+#define VOICE_GATE 0 // 1 stops released voices once silent, check with utils/synth_render first
+#endif
+#define VOICE_GATE_LEVEL 1e-5f // voice output level below which it can be stopped
+#define VOICE_GATE_HOLD 32 // silent blocks before a released voice is stopped
+#define LOAD_FILTER 0.99f
+#define VOICE_LOAD_FILTER 0.999f // release of the per voice load estimate
+#define VOICE_LOAD_TARGET 0.8f // load up to which voices are allowed
+#define ENGINE_FADE_TIME 0.05f // crossfade time in seconds when switching engines
+#define ENGINE_INIT_VOICES 2 // voices initialized per block when starting an engine
+#define OUTPUTCOUNT 1 // number of dsp outputs, set by faust2striso.py
+#ifndef WAVETABLE_INT16
+#define WAVETABLE_INT16 0 // store wave tables as 16 bit, halves their size
+#endif
+#ifndef WAVETABLE_DTCM
+#define WAVETABLE_DTCM 0 // 1 places wave tables in DTCM, zero wait state and not cached
+#endif
 
+/*
+ * Storage of the faust wave tables (ftbl), set by faust2striso.py. Reads
+ * convert to float so the generated code stays the same.
+ */
+#if WAVETABLE_INT16
+#define WAVETABLE_SCALE 16384.0f // the noise table range is -2..2
+struct wavetable_t {
+	int16_t v;
+	inline operator float() const { return v * (1.0f / WAVETABLE_SCALE); }
+	inline wavetable_t& operator=(float f) {
+		v = __SSAT((int32_t)(f * WAVETABLE_SCALE), 16);
+		return *this;
+	}
+};
+#else
+typedef float wavetable_t;
+#endif
+#if WAVETABLE_DTCM
+#define WAVETABLE_SECTION CC_SECTION(".ram5")
+#else
+#define WAVETABLE_SECTION
+#endif
+
+#ifndef FAUSTFLOAT
+#define FAUSTFLOAT float
+#endif
+
+/*
+ * Base of the generated engine classes, all engines are used through it.
+ */
 class dsp {
 	protected:
 		int fSamplingFreq;
+	public:
+		virtual void instanceInit(int) {}
+		virtual void instanceClear() {}
+		virtual void buildUserInterfaceEmbedded(synth_interface_t*, int) {}
+		virtual void compute(int, FAUSTFLOAT**, FAUSTFLOAT**) {}
 };
 
 struct Meta {
     virtual void declare(const char* key, const char* value) = 0;
 };
 
+/*
+ * A synth engine is one faust class, faust2striso.py generates the engines
+ * table from the dsp files it is given.
+ */
+typedef struct {
+	char name[8]; // name for presets, padded with spaces
+	void (*class_init)(int sample_rate); // fills the tables shared by all voices
+	dsp* (*create_voice)(void* mem);
+} engine_t;
+
+template <class T> static dsp* create_voice(void* mem) {
+	return new (mem) T();
+}
+
 // variables
 synth_interface_t synth_interface;
 
@@ -27,18 +98,405 @@ static float dump;
 float volume = 1.0f;
 
 static int32_t *outbuf;
-static int32_t *inbuf;
-static float output0[CHANNEL_BUFFER_SIZE] = {0.0};
-static float output1[CHANNEL_BUFFER_SIZE] = {0.0};
+// mix of all voices, the first active voice is computed directly into it
+static float output0[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
+static float voice_output0[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
+#if OUTPUTCOUNT == 2
+static float output1[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
+static float voice_output1[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
 static float* output[2] = {output0, output1};
+static float* voice_output[2] = {voice_output0, voice_output1};
+#else
+static float* output[1] = {output0};
+static float* voice_output[1] = {voice_output0};
+#endif
+
+/*
+ * Voice parameters from the control thread. synth_interface points the voice
+ * controls to voice_edit, synth_voice_publish() copies a voice to the buffer
+ * the synth thread is not reading and increments its sequence counter. Once
+ * per block the synth thread copies the published buffers to the faust zones,
+ * so a block never sees a half updated voice.
+ */
+typedef struct {
+	float note;
+	float pres;
+	float vpres;
+	float but_x;
+	float but_y;
+} voice_params_t;
+static voice_params_t voice_edit[VOICECOUNT];
+static voice_params_t voice_params[VOICECOUNT][2];
+static volatile uint32_t voice_seq[VOICECOUNT];
+static voice_params_t voice_now[VOICECOUNT]; // parameters of the current block
+
+// global controls, single values written directly by the control threads
+typedef struct {
+	float acc_abs;
+	float acc_x;
+	float acc_y;
+	float acc_z;
+	float rot_x;
+	float rot_y;
+	float rot_z;
+	float pedal;
+} global_params_t;
+static global_params_t global_edit;
+
+// DSP load, measured in cycles with the DWT cycle counter
+static volatile uint32_t block_start; // cycle count at the last buffer interrupt
+static volatile uint32_t block_period; // cycles between buffer interrupts
+static volatile bool synth_busy = false;
+static volatile uint32_t load_missed = 0;
+static float load_avg = 0.0f;
+static float load_peak = 0.0f;
+static float voice_load = 0.0f; // load of a single active voice
+static float other_load = 0.0f; // load of everything but the voices
+
+// <<engines>>
+
+/*
+ * Running engines. The voices of a slot are constructed in its part of the
+ * arena, which fits VOICECOUNT voices of the largest engine, so switching
+ * engines never allocates. While switching the old engine keeps playing in
+ * one slot until the new one is initialized in the other, then they
+ * crossfade. With a single engine there is only one slot.
+ */
+#define ENGINE_SLOTS min(2, ENGINECOUNT)
+
+typedef struct {
+	const engine_t* engine; // NULL when the slot is free
+	dsp* voices[VOICECOUNT];
+	int voice_hold[VOICECOUNT];
+	float voice_peak[VOICECOUNT]; // output level of the last block
+	int ready; // number of initialized voices
+	float gain;
+	synth_interface_t zones; // faust zones of the engine
+} engine_slot_t;
+
+static CC_ALIGN(8) uint8_t engine_arena[ENGINE_SLOTS][VOICECOUNT][(ENGINE_VOICE_SIZE + 7) & ~7];
+static engine_slot_t slots[ENGINE_SLOTS];
+#if ENGINE_SLOTS > 1
+// output of the second engine while crossfading
+static float engine_output0[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
+#if OUTPUTCOUNT == 2
+static float engine_output1[MAX_CHANNEL_BUFFER_SIZE] = {0.0};
+static float* engine_output[2] = {engine_output0, engine_output1};
+#else
+static float* engine_output[1] = {engine_output0};
+#endif
+#endif
+static int cur_slot = 0; // slot of the selected engine
+static bool engine_class_ready[ENGINECOUNT];
+static volatile int engine_request = -1;
+
+/*
+ * Initialize up to n voices of a slot. The engine tables are filled the
+ * first time an engine is used.
+ */
+static void init_slot_voices(engine_slot_t* s, int n) {
+	int e = s->engine - engines;
+	if (!engine_class_ready[e]) {
+		// noise tables are filled from rand_hoaglin(), restart it so an engine
+		// sounds the same whichever engines were used before
+		rand_hoaglin_state = RAND_HOAGLIN_SEED;
+		s->engine->class_init(SAMPLINGFREQ);
+		engine_class_ready[e] = true;
+	}
+	int slot = s - slots;
+	for (; n > 0 && s->ready < VOICECOUNT; n--) {
+		int v = s->ready;
+		s->voices[v] = s->engine->create_voice(engine_arena[slot][v]);
+		s->voices[v]->instanceInit(SAMPLINGFREQ);
+		s->voices[v]->buildUserInterfaceEmbedded(&s->zones, v);
+		s->voice_hold[v] = 0;
+		s->voice_peak[v] = 0.0f;
+		s->ready++;
+	}
+}
+
+static void start_slot(engine_slot_t* s, int engine) {
+	// unused controls of the engine point to dump
+	float** zones = (float**)&s->zones;
+	for (unsigned int k = 0; k < sizeof(synth_interface_t) / sizeof(float*); k++) {
+		zones[k] = &dump;
+	}
+	s->engine = &engines[engine];
+	s->ready = 0;
+	s->gain = 0.0f;
+}
+
+/*
+ * Handle engine requests, the new engine is started in the other slot and
+ * initialized a few voices per block to keep the load down. A request while
+ * the other slot is still fading out waits until it is silent.
+ */
+static void update_engines(void) {
+#if ENGINE_SLOTS > 1
+	int e = engine_request;
+	if (e >= 0) {
+		int other = 1 - cur_slot;
+		if (slots[cur_slot].engine == &engines[e]) {
+			engine_request = -1;
+		} else if (slots[other].engine == &engines[e]) {
+			// switch back while fading
+			cur_slot = other;
+			engine_request = -1;
+		} else if (slots[other].gain == 0.0f) {
+			start_slot(&slots[other], e);
+			cur_slot = other;
+			engine_request = -1;
+		}
+	}
+	engine_slot_t* other = &slots[1 - cur_slot];
+	if (other->engine != NULL && other->gain == 0.0f) {
+		// left before it was initialized
+		other->engine = NULL;
+	}
+#endif
+	if (slots[cur_slot].ready < VOICECOUNT) {
+		init_slot_voices(&slots[cur_slot], ENGINE_INIT_VOICES);
+	}
+}
 
-// Intrinsics
-<<includeIntrinsic>>
+/*
+ * Copy the published parameters of all voices and the global controls to the
+ * faust zones of the running engines.
+ */
+static void read_voice_params(void) {
+	for (int v = 0; v < VOICECOUNT; v++) {
+		uint32_t seq;
+		do {
+			// retry if the control thread published during the copy
+			seq = voice_seq[v];
+			__DMB();
+			voice_now[v] = voice_params[v][seq & 1];
+			__DMB();
+		} while (seq != voice_seq[v]);
+	}
+	for (int k = 0; k < ENGINE_SLOTS; k++) {
+		synth_interface_t* z = &slots[k].zones;
+		if (slots[k].engine == NULL) continue;
+		*z->acc_abs = global_edit.acc_abs;
+		*z->acc_x = global_edit.acc_x;
+		*z->acc_y = global_edit.acc_y;
+		*z->acc_z = global_edit.acc_z;
+		*z->rot_x = global_edit.rot_x;
+		*z->rot_y = global_edit.rot_y;
+		*z->rot_z = global_edit.rot_z;
+		*z->pedal = global_edit.pedal;
+		for (int v = 0; v < slots[k].ready; v++) {
+			*z->note[v] = voice_now[v].note;
+			*z->pres[v] = voice_now[v].pres;
+			*z->vpres[v] = voice_now[v].vpres;
+			*z->but_x[v] = voice_now[v].but_x;
+			*z->but_y[v] = voice_now[v].but_y;
+		}
+	}
+}
 
-// Class
-<<includeclass>>
+/*
+ * Number of voices that can be computed within VOICE_LOAD_TARGET, based on the
+ * measured load.
+ */
+static int voice_limit(void) {
+	if (voice_load <= 0.0f) {
+		// not measured yet
+		return VOICECOUNT;
+	}
+	int limit = (VOICE_LOAD_TARGET - other_load) / voice_load;
+	return limit < 1 ? 1 : (limit > VOICECOUNT ? VOICECOUNT : limit);
+}
 
-FAUSTCLASS dsp;
+/*
+ * Compute and sum all voices of an engine into out. Voices that are released
+ * and silent for VOICE_GATE_HOLD blocks are skipped until they get pressure
+ * again. When more voices sound than voice_limit() allows, the released ones
+ * with the lowest output and then the pressed ones with the lowest pressure
+ * are stopped, this doesn't change the voices used for MIDI. Returns the
+ * number of computed voices.
+ */
+static int compute_voices(engine_slot_t* s, float** out, int count) {
+	// priority of the sounding voices, pressed ones first, -1 when silent
+	float priority[VOICECOUNT];
+	bool fade[VOICECOUNT];
+	int sounding = 0;
+	for (int v = 0; v < VOICECOUNT; v++) {
+		bool pressed = voice_now[v].pres > 0.0f || voice_now[v].vpres != 0.0f;
+		fade[v] = false;
+		if (pressed) {
+			s->voice_hold[v] = VOICE_GATE_HOLD;
+			priority[v] = 2.0f + voice_now[v].pres;
+		} else if (s->voice_hold[v]) {
+			priority[v] = min(s->voice_peak[v], 1.0f);
+		} else {
+			priority[v] = -1.0f;
+			continue;
+		}
+		sounding++;
+	}
+	int limit = voice_limit();
+	if (sounding > limit) {
+		for (int v = 0; v < VOICECOUNT; v++) {
+			if (priority[v] < 0.0f) continue;
+			int rank = 0;
+			for (int w = 0; w < VOICECOUNT; w++) {
+				rank += priority[w] > priority[v] || (priority[w] == priority[v] && w < v);
+			}
+			if (rank >= limit) {
+				if (s->voice_peak[v] > 0.0f) {
+					// fade out within this block to avoid a click, stop after
+					fade[v] = true;
+				} else {
+					s->voice_hold[v] = 0;
+					s->voices[v]->instanceClear();
+					priority[v] = -1.0f;
+				}
+			}
+		}
+	}
+
+	int active = 0;
+	bool first = true;
+	for (int v = 0; v < VOICECOUNT; v++) {
+		if (priority[v] < 0.0f) continue;
+		bool pressed = priority[v] >= 2.0f;
+
+		active++;
+		if (fade[v]) {
+			s->voices[v]->compute(count, NULL, voice_output);
+			float step = 1.0f / count;
+			for (int c = 0; c < OUTPUTCOUNT; c++) {
+				float gain = 1.0f;
+				for (int n = 0; n < count; n++) {
+					gain -= step;
+					out[c][n] = (first ? 0.0f : out[c][n]) + voice_output[c][n] * gain;
+				}
+			}
+			first = false;
+			s->voice_hold[v] = 0;
+			s->voice_peak[v] = 0.0f;
+			s->voices[v]->instanceClear();
+			continue;
+		}
+		float peak = 0.0f;
+		if (first) {
+			s->voices[v]->compute(count, NULL, out);
+			for (int c = 0; c < OUTPUTCOUNT; c++) {
+				for (int n = 0; n < count; n++) {
+					peak = max(peak, fabsf(out[c][n]));
+				}
+			}
+			first = false;
+		} else {
+			s->voices[v]->compute(count, NULL, voice_output);
+			for (int c = 0; c < OUTPUTCOUNT; c++) {
+				for (int n = 0; n < count; n++) {
+					out[c][n] += voice_output[c][n];
+					peak = max(peak, fabsf(voice_output[c][n]));
+				}
+			}
+		}
+		s->voice_peak[v] = peak;
+		if (peak >= VOICE_GATE_LEVEL) {
+			s->voice_hold[v] = VOICE_GATE_HOLD;
+		} else if (VOICE_GATE && !pressed && --s->voice_hold[v] == 0) {
+			// start from silence when the voice is used again
+			s->voices[v]->instanceClear();
+		}
+	}
+	if (first) {
+		// no active voices
+		for (int c = 0; c < OUTPUTCOUNT; c++) {
+			for (int n = 0; n < count; n++) {
+				out[c][n] = 0.0f;
+			}
+		}
+	}
+	return active;
+}
+
+/*
+ * Compute the running engines into output. The selected engine fades in once
+ * all its voices are initialized, the other one fades out. Returns the number
+ * of computed voices.
+ */
+static int compute_engines(int count) {
+#if ENGINE_SLOTS == 1
+	return compute_voices(&slots[0], output, count);
+#else
+	engine_slot_t* cur = &slots[cur_slot];
+	engine_slot_t* other = &slots[1 - cur_slot];
+	if (cur->gain == 1.0f && other->engine == NULL) {
+		return compute_voices(cur, output, count);
+	}
+
+	int active = 0;
+	bool first = true;
+	float step = count * (1.0f / (ENGINE_FADE_TIME * SAMPLINGFREQ));
+	for (int k = 0; k < ENGINE_SLOTS; k++) {
+		engine_slot_t* s = &slots[k];
+		if (s->engine == NULL || s->ready < VOICECOUNT) continue;
+		float gain_start = s->gain;
+		if (s == cur) {
+			s->gain = min(s->gain + step, 1.0f);
+		} else if (cur->ready == VOICECOUNT) {
+			s->gain = max(s->gain - step, 0.0f);
+		}
+		float** out = first ? output : engine_output;
+		active += compute_voices(s, out, count);
+
+		// ramp the gain over the block
+		float gain = gain_start;
+		float gain_step = (s->gain - gain_start) / count;
+		for (int c = 0; c < OUTPUTCOUNT; c++) {
+			for (int n = 0; n < count; n++) {
+				gain += gain_step;
+				if (first) {
+					output[c][n] *= gain;
+				} else {
+					output[c][n] += engine_output[c][n] * gain;
+				}
+			}
+			gain = gain_start;
+		}
+		first = false;
+		if (s != cur && s->gain == 0.0f) {
+			// faded out
+			s->engine = NULL;
+		}
+	}
+	if (first) {
+		for (int c = 0; c < OUTPUTCOUNT; c++) {
+			for (int n = 0; n < count; n++) {
+				output[c][n] = 0.0f;
+			}
+		}
+	}
+	return active;
+#endif
+}
+
+/*
+ * Write the mix straight into the DMA buffer. The volume is ramped linearly
+ * over the block, samples are saturated to 24 bit and left aligned in the
+ * 32 bit slots. A mono synth is converted once and copied to both channels.
+ */
+static void write_output(int32_t* out, int count, float vol_start, float vol_end) {
+	float vol = vol_start * MAX_VAL;
+	float vol_step = (vol_end - vol_start) * MAX_VAL / count;
+	for (int n = 0; n < count; n++) {
+		vol += vol_step;
+		int32_t left = __SSAT((int32_t)(output0[n] * vol), 24) * (1<<8);
+#if OUTPUTCOUNT == 2
+		int32_t right = __SSAT((int32_t)(output1[n] * vol), 24) * (1<<8);
+#else
+		int32_t right = left;
+#endif
+		out[2*n] = left;
+		out[2*n+1] = right;
+	}
+}
 
 static THD_WORKING_AREA(waSynthThread, 1024);
 static thread_t* pThreadDSP = 0;
@@ -46,8 +504,8 @@ static void synthThread(void *arg) {  // THE SYNTH THREAD
 	(void)arg;
 	chRegSetThreadName("SYNTH");
 
-	int32_t tmp;
-	int count = CHANNEL_BUFFER_SIZE;
+	int count = 0;
+	float volume_filter = VOLUME_FILTER;
 	float volume_filtered = 0.0f;
 
 	//codec_pwrCtl(1);    // POWER ON
@@ -55,44 +513,79 @@ static void synthThread(void *arg) {  // THE SYNTH THREAD
 
 	chEvtAddEvents(1);
 
-	// initialize interface with dump, for when controls are not used
-	synth_interface.acc_abs = &dump;
-	synth_interface.acc_x = &dump;
-	synth_interface.acc_y = &dump;
-	synth_interface.acc_z = &dump;
-	synth_interface.rot_x = &dump;
-	synth_interface.rot_y = &dump;
-	synth_interface.rot_z = &dump;
-	synth_interface.pedal = &dump;
-
-	// initialization
-	dsp.init(SAMPLINGFREQ);
+	// start the default engine
+	for (int k = 0; k < ENGINE_SLOTS; k++) {
+		slots[k].engine = NULL;
+		slots[k].gain = 0.0f;
+	}
+	cur_slot = 0;
+	start_slot(&slots[0], 0);
+	init_slot_voices(&slots[0], VOICECOUNT);
+	slots[0].gain = 1.0f;
 
-	// initialize interface
-	dsp.buildUserInterfaceEmbedded();
+	// the control threads write to the parameter buffers, start from the
+	// faust defaults of the default engine
+	synth_interface_t* z = &slots[0].zones;
+	global_edit.acc_abs = *z->acc_abs;
+	global_edit.acc_x = *z->acc_x;
+	global_edit.acc_y = *z->acc_y;
+	global_edit.acc_z = *z->acc_z;
+	global_edit.rot_x = *z->rot_x;
+	global_edit.rot_y = *z->rot_y;
+	global_edit.rot_z = *z->rot_z;
+	global_edit.pedal = *z->pedal;
+	synth_interface.acc_abs = &global_edit.acc_abs;
+	synth_interface.acc_x = &global_edit.acc_x;
+	synth_interface.acc_y = &global_edit.acc_y;
+	synth_interface.acc_z = &global_edit.acc_z;
+	synth_interface.rot_x = &global_edit.rot_x;
+	synth_interface.rot_y = &global_edit.rot_y;
+	synth_interface.rot_z = &global_edit.rot_z;
+	synth_interface.pedal = &global_edit.pedal;
+	for (int v = 0; v < MAX_VOICECOUNT; v++) {
+		if (v >= VOICECOUNT) {
+			synth_interface.note[v] = &dump;
+			synth_interface.pres[v] = &dump;
+			synth_interface.vpres[v] = &dump;
+			synth_interface.but_x[v] = &dump;
+			synth_interface.but_y[v] = &dump;
+			continue;
+		}
+		voice_edit[v].note = *z->note[v];
+		voice_edit[v].pres = *z->pres[v];
+		voice_edit[v].vpres = *z->vpres[v];
+		voice_edit[v].but_x = *z->but_x[v];
+		voice_edit[v].but_y = *z->but_y[v];
+		voice_params[v][0] = voice_edit[v];
+		voice_params[v][1] = voice_edit[v];
+		synth_interface.note[v] = &voice_edit[v].note;
+		synth_interface.pres[v] = &voice_edit[v].pres;
+		synth_interface.vpres[v] = &voice_edit[v].vpres;
+		synth_interface.but_x[v] = &voice_edit[v].but_x;
+		synth_interface.but_y[v] = &voice_edit[v].but_y;
+	}
 
 	// computation loop
 	while (true) {
 		// palClearLine(LINE_LED_ALT);
 		chEvtWaitOne(1);
 		// palSetLine(LINE_LED_ALT);
+		synth_busy = true;
 
-		dsp.compute(count, NULL, output);
-
-		volume_filtered = VOLUME_FILTER * volume_filtered + (1 - VOLUME_FILTER) * volume;
-
-		// convert float to int with scale, clamp and round
-		for (int n = 0; n < CHANNEL_BUFFER_SIZE; n++) {
-			tmp = (int32_t)(output0[n] * volume_filtered * MAX_VAL);
-			// enable LED on clip
-			if (tmp <= -MAX_VAL) {
-				tmp = -(MAX_VAL-1);
-			} else if (tmp >= MAX_VAL) {
-				tmp = MAX_VAL-1;
-			}
-			// make both audio channels the same
-			outbuf[2*n] = outbuf[2*n+1] = tmp * (1<<8);
+		if (count != codec_block_size) {
+			count = codec_block_size;
+			// keep the volume ramp time independent of the block size
+			volume_filter = powf(VOLUME_FILTER, (float)count / CHANNEL_BUFFER_SIZE);
 		}
+		update_engines();
+		uint32_t voices_start = DWT->CYCCNT;
+		read_voice_params();
+		int active = compute_engines(count);
+		uint32_t voices_cycles = DWT->CYCCNT - voices_start;
+
+		float volume_start = volume_filtered;
+		volume_filtered = volume_filter * volume_filtered + (1 - volume_filter) * volume;
+		write_output(outbuf, count, volume_start, volume_filtered);
 
 		//if (--n <= 0) {
 		//	palToggleLine(LINE_LED1);       /* Orange.  */
@@ -102,6 +595,25 @@ static void synthThread(void *arg) {  // THE SYNTH THREAD
 		// TODO: synth_tick better called here or in main?
 		// synth_tick();
 
+		// load as fraction of the time until the next buffer interrupt
+		uint32_t period = block_period;
+		if (period) {
+			float load = (float)(DWT->CYCCNT - block_start) / period;
+			load_avg = LOAD_FILTER * load_avg + (1 - LOAD_FILTER) * load;
+			load_peak = max(load_peak, load);
+
+			// split the load in a part per voice and the rest for the voice
+			// limit, rising load is followed immediately to act before a dropout
+			float voices_part = (float)voices_cycles / period;
+			if (active > 0) {
+				float l = voices_part / active;
+				voice_load = l > voice_load ? l : VOICE_LOAD_FILTER * voice_load + (1 - VOICE_LOAD_FILTER) * l;
+			}
+			float rest = load - voices_part;
+			other_load = rest > other_load ? rest : VOICE_LOAD_FILTER * other_load + (1 - VOICE_LOAD_FILTER) * rest;
+		}
+		synth_busy = false;
+
 		if (chThdShouldTerminateX()) break;
 	}
 
@@ -116,22 +628,69 @@ void start_synth_thread(void) {
 	pThreadDSP = chThdCreateStatic(waSynthThread, sizeof(waSynthThread), NORMALPRIO+2, synthThread, NULL);
 }
 
+/*
+ * Get the DSP load in 0.1% since the last call, average and peak, and the
+ * number of blocks that were not finished in time.
+ */
+void synth_get_load(int* avg, int* peak, int* missed) {
+	*avg = load_avg * 1000;
+	*peak = load_peak * 1000;
+	*missed = load_missed;
+	load_peak = 0.0f;
+	load_missed = 0;
+}
+
+/*
+ * Make the voice parameters written through synth_interface visible to the
+ * synth thread, from the next block on.
+ */
+void synth_voice_publish(int voice) {
+	if (voice < 0 || voice >= VOICECOUNT) return;
+	uint32_t seq = voice_seq[voice];
+	voice_params[voice][(seq + 1) & 1] = voice_edit[voice];
+	__DMB();
+	voice_seq[voice] = seq + 1;
+}
+
+/*
+ * Find an engine by its 8 character name, returns -1 if there is none.
+ */
+int synth_find_engine(const char* name) {
+	for (int e = 0; e < ENGINECOUNT; e++) {
+		if (memcmp(engines[e].name, name, 8) == 0) return e;
+	}
+	return -1;
+}
+
+/*
+ * Switch to another engine, held notes continue on the new engine.
+ */
+void synth_select_engine(int engine) {
+	if (engine >= 0 && engine < ENGINECOUNT) {
+		engine_request = engine;
+	}
+}
+
 void computebufI(int32_t *inp, int32_t *outp) {
   int i;
-  //for (i = 0; i < 32; i++) {
-  //  inbuf[i] = inp[i];
-  //}
+  (void)inp;
+  uint32_t now = DWT->CYCCNT;
+  block_period = now - block_start;
+  block_start = now;
+  if (synth_busy) {
+    // previous block still computing, the codec plays an old buffer
+    load_missed++;
+  }
   outbuf = outp;
-  inbuf = inp;
   if (pThreadDSP) {
     chSysLockFromISR();
     chEvtSignalI(pThreadDSP, (eventmask_t)1);
     chSysUnlockFromISR();
   }
   else
-    for (i = 0; i < PLAYBACK_BUFFER_SIZE; i++) {
-      outp[i] = (i - PLAYBACK_BUFFER_SIZE / 2) * 1<<22;
-      // square wave 34952 * (1<<8) * 2 * ((i>PLAYBACK_BUFFER_SIZE/2)-0.5);
-      // saw ware (i - PLAYBACK_BUFFER_SIZE / 2) * 100000; // testing noise 0;
+    for (i = 0; i < codec_block_size * 2; i++) {
+      outp[i] = (i - codec_block_size) * 1<<22;
+      // square wave 34952 * (1<<8) * 2 * ((i>codec_block_size)-0.5);
+      // saw ware (i - codec_block_size) * 100000; // testing noise 0;
     }
 }
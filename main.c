@@ -24,6 +24,7 @@
 #include "config.h"
 #undef CONFIG_HERE
 #include "striso.h"
+#include "striso_frame.h"
 #include "usbcfg.h"
 // #include "exceptions.h"
 #include "pconnection.h"
@@ -37,6 +38,7 @@
 #include "led.h"
 #include "config_editor/config_editor.h"
 #include "aux_jack.h"
+#include "settings_store.h"
 
 /**
  *  Firmware version description on fixed flash address for bootloader
@@ -73,10 +75,40 @@ static SerialConfig ser_cfg = {
 };
 #endif
 
+#ifdef USE_USB
+/*
+ * Framed binary protocol (v2), messages are collected in a frame until the
+ * message queue is empty or the frame is full.
+ */
+static striso_frame_t frame;
+
+static void frame_flush(void) {
+  PExSendFrame(&frame);
+  striso_frame_begin(&frame);
+}
+#endif
+
+/*
+ * The control thread preempts the main loop, synth_lock keeps synth_tick and
+ * MIDI input handling from running in the middle of a message. The longest
+ * wait of the control thread for the lock is reported as ID_SYS_LOCK_WAIT.
+ */
+static mutex_t synth_lock;
+static volatile uint32_t synth_lock_wait_max = 0;
+
+/*
+ * Cycles of synth_message for button messages, for the cost per message in
+ * each MIDI mode, reported as ID_SYS_MSG_CYCLES.
+ */
+static volatile uint32_t button_msg_cycles = 0;
+static volatile uint32_t button_msg_cycles_max = 0;
+static volatile uint32_t button_msg_count = 0;
+
 /*
- * LED flash thread.
+ * LED flash thread, also reports the synth DSP load and dropped messages over
+ * the binary protocol.
  */
-static THD_WORKING_AREA(waThread1, 128);
+static THD_WORKING_AREA(waThread1, 256);
 static void Thread1(void *arg) {
 
   (void)arg;
@@ -91,6 +123,56 @@ static void Thread1(void *arg) {
     // msg[2] = underruns;
     //if (!msgSend(3,msg))
       palClearLine(LINE_LED1);
+#ifdef USE_INTERNAL_SYNTH
+    if (config.send_usb_bulk) {
+      int msg[6];
+      msg[0] = ID_SYS;
+      msg[1] = ID_SYS_DSP_LOAD;
+      synth_get_load(&msg[2], &msg[3], &msg[4]);
+      if (msg[4] > 0x1fff) msg[4] = 0x1fff;
+      msg[5] = codec_block_size;
+      msgSend(6, msg);
+    }
+#endif
+#ifdef USE_USB
+    if (config.send_usb_bulk == 2) {
+      static int last_underruns = 0;
+      static int last_frames_dropped = 0;
+      int msg[5];
+      msg[0] = ID_SYS;
+      msg[1] = ID_SYS_DROPPED;
+      msg[2] = underruns + underruns_bulk - last_underruns;
+      int frames_dropped = PExFramesDropped();
+      msg[3] = frames_dropped - last_frames_dropped;
+      if (msg[2] > 0x1fff) msg[2] = 0x1fff;
+      if (msg[3] > 0x1fff) msg[3] = 0x1fff;
+      last_underruns = underruns + underruns_bulk;
+      last_frames_dropped = frames_dropped;
+      msgSend(4, msg);
+
+      msg[1] = ID_SYS_LOCK_WAIT;
+      msg[2] = synth_lock_wait_max / (STM32_SYS_CK / 1000000);
+      synth_lock_wait_max = 0;
+      if (msg[2] > 0x3fff) msg[2] = 0x3fff;
+      msgSend(3, msg);
+
+      chSysLock();
+      uint32_t cycles = button_msg_cycles;
+      uint32_t count = button_msg_count;
+      msg[3] = button_msg_cycles_max;
+      button_msg_cycles = 0;
+      button_msg_cycles_max = 0;
+      button_msg_count = 0;
+      chSysUnlock();
+      msg[1] = ID_SYS_MSG_CYCLES;
+      msg[2] = count ? cycles / count : 0;
+      msg[4] = count;
+      if (msg[2] > 0x3fff) msg[2] = 0x3fff;
+      if (msg[3] > 0x3fff) msg[3] = 0x3fff;
+      if (msg[4] > 0x3fff) msg[4] = 0x3fff;
+      msgSend(5, msg);
+    }
+#endif
   }
 }
 
@@ -110,38 +192,111 @@ static void unpack(uint8_t *in, int *out, int n) {
 }
 
 /*
- * Message send thread
+ * Thread priorities:
+ * - synth dsp (NORMALPRIO+2): audio blocks must never be late.
+ * - control (NORMALPRIO+1): handles a message as soon as the button thread
+ *   queues it, so synth and MIDI output don't wait for the rest of the scan or
+ *   for the usb bulk stream.
+ * - button read, main loop (NORMALPRIO).
+ * - bulk writer (NORMALPRIO-1): a slow or paced host can't delay scanning or
+ *   MIDI, messages that don't fit in its queue are dropped and reported.
+ */
+
+/*
+ * Synth and MIDI control thread
+ */
+static THD_WORKING_AREA(waThreadControl, 512);
+static void ThreadControl(void *arg) {
+
+  (void)arg;
+  chRegSetThreadName("synth control");
+  int msg[9];
+  int size;
+  while (TRUE) {
+    size = msgGet(MSG_QUEUE_CONTROL, 9, msg);
+    if (size >= 2 && size <= 9) {
+      uint32_t start = DWT->CYCCNT;
+      chMtxLock(&synth_lock);
+      uint32_t wait = DWT->CYCCNT - start;
+      if (wait > synth_lock_wait_max)
+        synth_lock_wait_max = wait;
+      start = DWT->CYCCNT;
+      synth_message(size, msg);
+      uint32_t cycles = DWT->CYCCNT - start;
+      chMtxUnlock(&synth_lock);
+      if (msg[0] == ID_DIS) {
+        chSysLock();
+        button_msg_cycles += cycles;
+        button_msg_count++;
+        if (cycles > button_msg_cycles_max)
+          button_msg_cycles_max = cycles;
+        chSysUnlock();
+      }
+    }
+  }
+}
+
+/*
+ * Binary protocol writer thread, usb bulk and uart
  */
-static THD_WORKING_AREA(waThreadSend, 512);
-static void ThreadSend(void *arg) {
+static THD_WORKING_AREA(waThreadBulk, 512);
+static void ThreadBulk(void *arg) {
 
   (void)arg;
-  chRegSetThreadName("send messages");
+  chRegSetThreadName("bulk writer");
   int msg[9];
   uint8_t cmsg[16];
   int size;
+  bool sent;
   cmsg[0] = 0;
+#ifdef USE_USB
+  striso_frame_begin(&frame);
+#endif
   while (TRUE) {
-    size = msgGet(9, msg);
+    size = msgGet(MSG_QUEUE_BULK, 9, msg);
+    sent = false;
     if (size >= 2 && size <= 9) {
-      synth_message(size, msg);
-
       cmsg[0] = 0x80 | ((uint8_t)msg[0])<<3 | ((uint8_t)(size-2));
       cmsg[1] = 0x7f & (uint8_t)msg[1];
       pack(&msg[2], &cmsg[2], size - 2);
 #ifdef USE_UART
       chSequentialStreamWrite((BaseSequentialStream *)&SD1, cmsg, 2+(size-2)*2);
+      sent = true;
 #endif
 #ifdef USE_USB
-      if (config.send_usb_bulk) {
+      if (config.send_usb_bulk == 2) {
+        if (!striso_frame_add(&frame, size, msg)) {
+          frame_flush();
+          striso_frame_add(&frame, size, msg);
+        }
+      }
+      else if (config.send_usb_bulk) {
         //chSequentialStreamWrite((BaseSequentialStream *)&BDU1,cmsg, 2+(size-2)*2);
         obqWriteTimeout(&BDU1.obqueue, cmsg, 2+(size-2)*2, TIME_IMMEDIATE);
+        sent = true;
       }
 #endif
     }
-    // sleep to limit the output stream to 2 messages per millisecond (with CH_FREQUENCY = 2000)
-    // for compatibility with MIDI usb on Axoloti
-    chThdSleep(1);
+#ifdef USE_USB
+    if (config.send_usb_bulk == 2) {
+      // one frame per tick, the receiver of frames doesn't need pacing
+      if (msgPending(MSG_QUEUE_BULK) && !striso_frame_empty(&frame))
+        continue;
+      if (!striso_frame_empty(&frame))
+        frame_flush();
+      chThdSleep(1);
+      continue;
+    }
+    else if (!striso_frame_empty(&frame)) {
+      // framing switched off
+      striso_frame_begin(&frame);
+    }
+#endif
+    if (sent && config.bulk_pacing) {
+      // sleep to limit the output stream to 2 messages per millisecond (with CH_FREQUENCY = 2000)
+      // for compatibility with MIDI usb on Axoloti
+      chThdSleep(1);
+    }
   }
 }
 
@@ -184,11 +339,14 @@ int main(void) {
 #endif
 
   MessagingInit();
+  settingsStoreInit();
 
   /*
-   * Creates the message send thread.
+   * Creates the message handling threads.
    */
-  chThdCreateStatic(waThreadSend, sizeof(waThreadSend), NORMALPRIO, ThreadSend, NULL);
+  chMtxObjectInit(&synth_lock);
+  chThdCreateStatic(waThreadControl, sizeof(waThreadControl), NORMALPRIO+1, ThreadControl, NULL);
+  chThdCreateStatic(waThreadBulk, sizeof(waThreadBulk), NORMALPRIO-1, ThreadBulk, NULL);
 
   /*
    * Creates the LED flash thread.
@@ -228,11 +386,13 @@ int main(void) {
 
   while (1) {
     chThdSleepMilliseconds(2);
+    chMtxLock(&synth_lock);
     synth_tick();
     led_tick();
+    chMtxUnlock(&synth_lock);
 
 #ifdef USE_USB
-    PExReceive();
+    PExReceive(&synth_lock);
 #endif
   }
 }
@@ -20,80 +20,111 @@
 #include "hal.h"
 
 #define BUFFERSIZE 240
-static int msg_buffer[BUFFERSIZE];
-static int msg_read = 0;
-static int msg_write = 0;
-static mutex_t msg_lock;
-static thread_t *tpMsg = NULL;
+
+typedef struct {
+  int buffer[BUFFERSIZE];
+  int read;
+  int write;
+  mutex_t lock;
+  thread_t *waiting;
+} msg_queue_t;
+
+static msg_queue_t queues[MSG_QUEUE_COUNT];
 int underruns = 0;
+int underruns_bulk = 0;
 
-int msgSend(int size, int* msg) {
-  chMtxLock(&msg_lock);
+static int queue_put(msg_queue_t* q, int size, int* msg) {
+  chMtxLock(&q->lock);
 
   int n;
-  int old_write = msg_write;
-  msg_buffer[msg_write] = size;
-  msg_write = (msg_write + 1) % BUFFERSIZE;
+  int old_write = q->write;
+  q->buffer[q->write] = size;
+  q->write = (q->write + 1) % BUFFERSIZE;
   for (n = 0; n < size; n++) {
-    if (msg_read == msg_write) {
-      //msg_read = (msg_read + msg_buffer[msg_read] + 1) % BUFFERSIZE;
-      msg_write = old_write;
-      underruns++;
-      chMtxUnlock(&msg_lock);
+    if (q->read == q->write) {
+      q->write = old_write;
+      chMtxUnlock(&q->lock);
       return 1;
     }
-    msg_buffer[msg_write] = msg[n];
-    msg_write = (msg_write + 1) % BUFFERSIZE;
+    q->buffer[q->write] = msg[n];
+    q->write = (q->write + 1) % BUFFERSIZE;
   }
 
-  chMtxUnlock(&msg_lock);
+  chMtxUnlock(&q->lock);
 
   // Wake up msgGet thread
   chSysLock();
-  if (tpMsg != NULL) {
-    chSchReadyI(tpMsg);
-    tpMsg = NULL;
+  if (q->waiting != NULL) {
+    chSchReadyI(q->waiting);
+    q->waiting = NULL;
   }
   chSysUnlock();
   return 0;
 }
 
-int msgGet(int maxsize, int* msg) {
-  chMtxLock(&msg_lock);
+/*
+ * Send a message to the control thread and the bulk writer. Returns 1 when the
+ * control queue is full, then the message is not sent at all so it can be
+ * retried. When only the bulk queue is full the message is dropped from the
+ * bulk stream and counted in underruns_bulk.
+ */
+int msgSend(int size, int* msg) {
+  if (queue_put(&queues[MSG_QUEUE_CONTROL], size, msg)) {
+    underruns++;
+    return 1;
+  }
+  if (queue_put(&queues[MSG_QUEUE_BULK], size, msg)) {
+    underruns_bulk++;
+  }
+  return 0;
+}
 
-  if (msg_read == msg_write) {
-    chMtxUnlock(&msg_lock);
-    // wait for new messages to arrive
-    chSysLock();
-    tpMsg = chThdGetSelfX();
+int msgGet(msg_queue_id_t queue, int maxsize, int* msg) {
+  msg_queue_t* q = &queues[queue];
+
+  // wait for new messages to arrive, checked with the system locked so a
+  // message sent in between can't be missed
+  chSysLock();
+  while (q->read == q->write) {
+    q->waiting = chThdGetSelfX();
     chSchGoSleepS(CH_STATE_SUSPENDED);
-    chSysUnlock();
-    chMtxLock(&msg_lock);
   }
+  chSysUnlock();
+
+  chMtxLock(&q->lock);
 
-  int size = msg_buffer[msg_read];
+  int size = q->buffer[q->read];
 
   if (size > maxsize) {
-    chMtxUnlock(&msg_lock);
+    chMtxUnlock(&q->lock);
     return -10;
   }
-  msg_read = (msg_read + 1) % BUFFERSIZE;
+  q->read = (q->read + 1) % BUFFERSIZE;
 
   int n;
   for (n = 0; n < size; n++) {
-    if (msg_read == msg_write) {
-      chMtxUnlock(&msg_lock);
+    if (q->read == q->write) {
+      chMtxUnlock(&q->lock);
       return -1;
     }
-    msg[n] = msg_buffer[msg_read];
-    msg_read = (msg_read + 1) % BUFFERSIZE;
+    msg[n] = q->buffer[q->read];
+    q->read = (q->read + 1) % BUFFERSIZE;
   }
 
-  chMtxUnlock(&msg_lock);
+  chMtxUnlock(&q->lock);
   return size;
 }
 
+/*
+ * Returns true when msgGet will return without waiting.
+ */
+bool msgPending(msg_queue_id_t queue) {
+  return queues[queue].read != queues[queue].write;
+}
+
 void MessagingInit(void) {
-  // init msg mutex
-  chMtxObjectInit(&msg_lock);
+  // init msg mutexes
+  for (int n = 0; n < MSG_QUEUE_COUNT; n++) {
+    chMtxObjectInit(&queues[n].lock);
+  }
 }
@@ -18,11 +18,22 @@
 #ifndef _MESSAGING_H_
 #define _MESSAGING_H_
 
+#include <stdbool.h>
+
+// every message is delivered to both queues
+typedef enum {
+  MSG_QUEUE_CONTROL,  // synth and MIDI, read by the control thread
+  MSG_QUEUE_BULK,     // binary protocol over usb bulk and uart, read by the bulk writer
+  MSG_QUEUE_COUNT,
+} msg_queue_id_t;
+
 void MessagingInit(void);
 
 int msgSend(int size, int* msg);
-int msgGet(int maxsize, int* msg);
+int msgGet(msg_queue_id_t queue, int maxsize, int* msg);
+bool msgPending(msg_queue_id_t queue);
 
 extern int underruns;
+extern int underruns_bulk;
 
 #endif
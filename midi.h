@@ -110,6 +110,7 @@ typedef enum
 
 void midi_init(void);
 void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t b0, uint8_t b1, uint8_t b2);
+void MidiInSysExHandler(midi_device_t dev, uint8_t port, const uint8_t* data, int len);
 
 
 void MidiSend1(midi_device_t dev, uint8_t port, uint8_t b0);
@@ -0,0 +1,197 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MIDI_ROUTE_H
+#define _MIDI_ROUTE_H
+
+/*
+ * A route maps a gesture to a MIDI message: the source value goes through a
+ * curve, then output = offset + scale * curve(source), rounded with hysteresis
+ * and clamped to the range of the destination.
+ * Several routes can take the same source or go to the same message, but
+ * routes only produce MIDI: the internal synth reads the gestures from its own
+ * zones (synth_interface) and is not a destination.
+ *
+ * In a preset a route is an 8 character setting, for example "prlc074v":
+ *   source  2 chars: pr pressure, tx key x, pb key x as pitch bend (cubed, with
+ *           the bend factor), ty key y/tilt, ve continuous velocity, rv
+ *           continuous release velocity, ax ay az acceleration (+/-2g), aa
+ *           absolute acceleration (0-2g), gx gy gz rotation, pd pedal
+ *   curve   l linear, s square, c cube, r square root, signed for x and y
+ *   dest    c CC, C 14 bit CC, p pitch bend, a channel pressure, k poly pressure
+ *   number  3 digits, the CC number
+ *   channel v the channel of the key (MPE voice), m the MIDI or MPE master
+ *           channel, or a hex digit 0-f for a fixed channel 1-16
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+typedef enum {
+  ROUTE_SRC_PRES = 0,
+  ROUTE_SRC_X,
+  ROUTE_SRC_BEND,
+  ROUTE_SRC_Y,
+  ROUTE_SRC_VELO,
+  ROUTE_SRC_RVELO,
+  // the sources above are per key, the ones below are global
+  ROUTE_SRC_ACC_X,
+  ROUTE_SRC_ACC_Y,
+  ROUTE_SRC_ACC_Z,
+  ROUTE_SRC_ACC_ABS,
+  ROUTE_SRC_ROT_X,
+  ROUTE_SRC_ROT_Y,
+  ROUTE_SRC_ROT_Z,
+  ROUTE_SRC_PEDAL,
+  ROUTE_SRC_COUNT,
+} route_source_t;
+
+#define ROUTE_KEY_SOURCES (ROUTE_SRC_RVELO + 1)
+#define ROUTE_MOTION_SOURCES 7 // ROUTE_SRC_ACC_X to ROUTE_SRC_ROT_Z
+
+typedef enum {
+  ROUTE_CURVE_LINEAR = 0,
+  ROUTE_CURVE_SQUARE,
+  ROUTE_CURVE_CUBE,
+  ROUTE_CURVE_SQRT,
+} route_curve_t;
+
+typedef enum {
+  ROUTE_DST_CC = 0,
+  ROUTE_DST_CC14,
+  ROUTE_DST_PITCH_BEND,
+  ROUTE_DST_CHANNEL_PRESSURE,
+  ROUTE_DST_POLY_PRESSURE,
+} route_dest_t;
+
+#define ROUTE_CHANNEL_KEY (-1)
+#define ROUTE_CHANNEL_MASTER (-2)
+
+typedef struct {
+  uint8_t source;
+  uint8_t curve;
+  uint8_t dest;
+  uint8_t number;   // CC number
+  int8_t channel;   // ROUTE_CHANNEL_KEY, ROUTE_CHANNEL_MASTER or 0-15
+  float scale;
+  float offset;
+} route_t;
+
+static const char route_source_names[ROUTE_SRC_COUNT][3] = {
+  "pr", "tx", "pb", "ty", "ve", "rv", "ax", "ay", "az", "aa", "gx", "gy", "gz", "pd"};
+
+// sources from -1 to 1, the others are from 0 to 1
+static inline int route_bipolar(int source) {
+  return source == ROUTE_SRC_X || source == ROUTE_SRC_BEND || source == ROUTE_SRC_Y
+    || (source >= ROUTE_SRC_ACC_X && source <= ROUTE_SRC_ROT_Z && source != ROUTE_SRC_ACC_ABS);
+}
+
+static inline int route_max(int dest) {
+  return (dest == ROUTE_DST_CC14 || dest == ROUTE_DST_PITCH_BEND) ? 0x3fff : 0x7f;
+}
+
+/*
+ * Fill in a route with the default scale and offset, the full range of the
+ * destination, centered for sources from -1 to 1.
+ */
+static inline void route_init(route_t* r, int source, int curve, int dest, int number, int channel) {
+  r->source = source;
+  r->curve = curve;
+  r->dest = dest;
+  r->number = number;
+  r->channel = channel;
+  float range = route_max(dest) + 1;
+  if (route_bipolar(source)) {
+    r->scale = range / 2;
+    r->offset = range / 2;
+  } else {
+    r->scale = range - 1;
+    r->offset = 0.0f;
+  }
+}
+
+/*
+ * Parse a route setting, returns 0 on success.
+ */
+static inline int route_parse(const char* s, route_t* r) {
+  int source = -1;
+  for (int n = 0; n < ROUTE_SRC_COUNT; n++) {
+    if (s[0] == route_source_names[n][0] && s[1] == route_source_names[n][1])
+      source = n;
+  }
+  static const char curves[] = "lscr";
+  int curve = -1;
+  for (int n = 0; n < 4; n++) {
+    if (s[2] == curves[n])
+      curve = n;
+  }
+  static const char dests[] = "cCpak";
+  int dest = -1;
+  for (int n = 0; n < 5; n++) {
+    if (s[3] == dests[n])
+      dest = n;
+  }
+  int number = 0;
+  for (int n = 4; n < 7; n++) {
+    if (s[n] < '0' || s[n] > '9')
+      return -1;
+    number = number * 10 + s[n] - '0';
+  }
+  int channel;
+  if (s[7] == 'v') {
+    channel = ROUTE_CHANNEL_KEY;
+  } else if (s[7] == 'm') {
+    channel = ROUTE_CHANNEL_MASTER;
+  } else if (s[7] >= '0' && s[7] <= '9') {
+    channel = s[7] - '0';
+  } else if (s[7] >= 'a' && s[7] <= 'f') {
+    channel = s[7] - 'a' + 10;
+  } else {
+    return -1;
+  }
+  if (source < 0 || curve < 0 || dest < 0 || number > (dest == ROUTE_DST_CC14 ? 31 : 119))
+    return -1;
+  route_init(r, source, curve, dest, number, channel);
+  return 0;
+}
+
+static inline float route_curve(int curve, float x) {
+  switch (curve) {
+    case ROUTE_CURVE_SQUARE:
+      return x * fabsf(x);
+    case ROUTE_CURVE_CUBE:
+      return x * x * x;
+    case ROUTE_CURVE_SQRT:
+      return x < 0.0f ? -sqrtf(-x) : sqrtf(x);
+    default:
+      return x;
+  }
+}
+
+/*
+ * Output value for source value x, last is the value that was sent before.
+ * It changes when x is more than 0.75 step from last.
+ */
+static inline int route_value(const route_t* r, float x, int last) {
+  float v = r->offset + r->scale * route_curve(r->curve, x);
+  float d = (last > v) * 0.5f - 0.25f; // direction for hysteresis
+  int value = v + 0.5f + d;
+  int max = route_max(r->dest);
+  return value < 0 ? 0 : value > max ? max : value;
+}
+
+#endif
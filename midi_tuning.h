@@ -0,0 +1,181 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MIDI_TUNING_H
+#define _MIDI_TUNING_H
+
+/*
+ * Parser for MIDI Tuning Standard SysEx messages, fed one byte at a time. The
+ * tuning is a table with the pitch of every MIDI key as an offset from 12tet
+ * in semitones. Supported, real-time (7F) and non-real-time (7E):
+ *   single note tuning change      F0 7x dev 08 02 tt ll [kk xx yy zz]... F7
+ *   same with bank                 F0 7x dev 08 07 bb tt ll [kk xx yy zz]... F7
+ *   scale/octave tuning, 1 byte    F0 7x dev 08 08 ff gg hh [ss]x12 F7
+ *   scale/octave tuning, 2 bytes   F0 7x dev 08 09 ff gg hh [ss tt]x12 F7
+ * kk is the key, xx the semitone and yy zz the fraction in 1/16384 semitone,
+ * 7F 7F 7F leaves the key unchanged. Scale/octave tunings set all keys of a
+ * pitch class, from C, in cents from -64 to 63 with 1 byte, or from -100 to
+ * 100 in 14 bits with 2 bytes. There is a single tuning, the device id, bank,
+ * tuning program and channel mask are ignored.
+ *
+ * Changes are collected in next and only valid when the whole message is
+ * received, so a broken message leaves the tuning unchanged.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define MTS_KEYS 128
+
+#define MTS_NONE 0
+#define MTS_NON_REALTIME 1  // complete non-real-time message in next
+#define MTS_REALTIME 2      // complete real-time message in next
+
+typedef struct {
+  int pos;          // data bytes after F0, -1 outside a tuning message
+  uint8_t realtime;
+  uint8_t format;   // sub-ID#2
+  int header;       // bytes after F0 before the tuning data
+  int count;        // announced single note changes
+  uint8_t data[3];
+  float cents[12];
+  float next[MTS_KEYS];
+} mts_parser_t;
+
+static inline void mts_init(mts_parser_t* p) {
+  p->pos = -1;
+}
+
+static inline void mts_single_note(mts_parser_t* p, int key, int semitone, int fraction) {
+  if (semitone == 0x7f && fraction == 0x3fff)
+    return;
+  p->next[key] = semitone + fraction * (1.0f / 16384) - key;
+}
+
+/*
+ * Check the data length and finish the tuning in next.
+ */
+static inline int mts_complete(mts_parser_t* p) {
+  int n = p->pos - p->header;
+  switch (p->format) {
+    case 0x02:
+    case 0x07:
+      if (n != 4 * p->count)
+        return MTS_NONE;
+      break;
+    case 0x08:
+    case 0x09:
+      if (n != (p->format == 0x08 ? 12 : 24))
+        return MTS_NONE;
+      for (int k = 0; k < MTS_KEYS; k++) {
+        p->next[k] = p->cents[k % 12] * 0.01f;
+      }
+      break;
+  }
+  return p->realtime ? MTS_REALTIME : MTS_NON_REALTIME;
+}
+
+/*
+ * Feed one byte of a MIDI stream, keys is the current tuning that changes are
+ * applied to. Returns MTS_REALTIME or MTS_NON_REALTIME when a tuning message is
+ * complete, then next holds the new tuning.
+ */
+static inline int mts_parse(mts_parser_t* p, uint8_t b, const float* keys) {
+  if (b >= 0xf8) // real-time messages can be sent in between
+    return MTS_NONE;
+  if (b == 0xf0) {
+    p->pos = 0;
+    return MTS_NONE;
+  }
+  if (p->pos < 0)
+    return MTS_NONE;
+  if (b == 0xf7) {
+    int r = p->pos >= p->header && p->header ? mts_complete(p) : MTS_NONE;
+    p->pos = -1;
+    return r;
+  }
+  if (b & 0x80) { // other status bytes end the message
+    p->pos = -1;
+    return MTS_NONE;
+  }
+
+  int n = p->pos++;
+  switch (n) {
+    case 0: // universal real-time or non-real-time
+      p->realtime = b == 0x7f;
+      p->header = 0;
+      if (b != 0x7e && b != 0x7f)
+        p->pos = -1;
+      return MTS_NONE;
+    case 1: // device id
+      return MTS_NONE;
+    case 2: // MIDI tuning standard
+      if (b != 0x08)
+        p->pos = -1;
+      return MTS_NONE;
+    case 3:
+      p->format = b;
+      if (b == 0x02) {
+        p->header = 6;
+      } else if (b == 0x07 || b == 0x08 || b == 0x09) {
+        p->header = 7;
+      } else {
+        p->pos = -1;
+        return MTS_NONE;
+      }
+      memcpy(p->next, keys, sizeof(p->next));
+      return MTS_NONE;
+  }
+  if (n < p->header) {
+    if (n == p->header - 1 && (p->format == 0x02 || p->format == 0x07))
+      p->count = b;
+    return MTS_NONE;
+  }
+
+  int k = n - p->header;
+  switch (p->format) {
+    case 0x02:
+    case 0x07:
+      if (k >= 4 * p->count) {
+        p->pos = -1;
+      } else if (k % 4 < 3) {
+        p->data[k % 4] = b;
+      } else {
+        mts_single_note(p, p->data[0], p->data[1], (p->data[2] << 7) | b);
+      }
+      break;
+    case 0x08:
+      if (k >= 12) {
+        p->pos = -1;
+      } else {
+        p->cents[k] = b - 64;
+      }
+      break;
+    case 0x09:
+      if (k >= 24) {
+        p->pos = -1;
+      } else if (k % 2 == 0) {
+        p->data[0] = b;
+      } else {
+        p->cents[k / 2] = (((p->data[0] << 7) | b) - 0x2000) * (100.0f / 0x2000);
+      }
+      break;
+  }
+  return MTS_NONE;
+}
+
+#endif
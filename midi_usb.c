@@ -568,6 +568,19 @@ void midi_usb_MidiSend3(uint8_t port, uint8_t b0, uint8_t b1, uint8_t b2) {
   _writet(&MDU1, &tx[0], 4, MIDISEND_TIMEOUT);
 }
 
+// bytes waiting to be transmitted: the bytes in the buffer being filled and
+// the posted buffers, counted as full
+int midi_usb_MidiGetOutputBufferPending(void) {
+  output_buffers_queue_t *obqp = &MDU1.obqueue;
+  chSysLock();
+  int pending = (bqSizeX(obqp) - bqSpaceI(obqp)) * MIDI_USB_BUFFERS_SIZE;
+  if (obqp->ptr != NULL) {
+    pending += obqp->ptr - (obqp->bwrptr + sizeof(size_t));
+  }
+  chSysUnlock();
+  return pending;
+}
+
 #endif /* HAL_USE_MIDI_USB */
 
 /** @} */
@@ -188,6 +188,8 @@ extern "C" {
   void midi_usb_MidiSend1(uint8_t port, uint8_t b0);
   void midi_usb_MidiSend2(uint8_t port, uint8_t b0, uint8_t b1);
   void midi_usb_MidiSend3(uint8_t port, uint8_t b0, uint8_t b1, uint8_t b2);
+
+  int  midi_usb_MidiGetOutputBufferPending(void);
 #ifdef __cplusplus
 }
 #endif
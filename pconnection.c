@@ -31,6 +31,9 @@
 #include "version.h"
 #include "ws2812.h"
 #include "button_read.h"
+#include "settings_store.h"
+#include "codec.h"
+#include "synth.h"
 
 //#define DEBUG_SERIAL 1
 
@@ -83,8 +86,71 @@ static void cmd_threads(BaseSequentialStream *chp) {
   } while (tp != NULL);
 }
 
+/*
+ * Framed binary protocol (v2). Frames are sent by the message thread and by the
+ * raw button stream, they share the sequence numbers.
+ */
+static mutex_t frame_lock;
+static int frame_seq = 0;
+static int frames_dropped = 0;
+
+// microseconds since boot, wraps after 2^28 us in the frame header
+static uint32_t frame_time(void) {
+  static uint32_t last_cycles = 0;
+  static uint32_t cycles = 0;
+  static uint32_t us = 0;
+  uint32_t now = DWT->CYCCNT;
+  cycles += now - last_cycles;
+  last_cycles = now;
+  us += cycles / (STM32_SYS_CK / 1000000);
+  cycles %= STM32_SYS_CK / 1000000;
+  return us;
+}
+
+/*
+ * Bytes that can be written to the bulk queue without waiting: the rest of the
+ * buffer being filled and the free buffers. The current buffer is counted in
+ * the free buffers until it is posted. Flushing from the SOF interrupt only
+ * adds room, so it stays valid after unlocking.
+ */
+static size_t bulk_room(void) {
+  output_buffers_queue_t* obqp = &BDU1.obqueue;
+  chSysLock();
+  size_t buffers = bqSpaceI(obqp);
+  size_t room = 0;
+  if (obqp->ptr != NULL && buffers > 0) {
+    room = obqp->top - obqp->ptr;
+    buffers--;
+  }
+  room += buffers * (obqp->bsize - sizeof(size_t));
+  chSysUnlock();
+  return room;
+}
+
+/*
+ * Finish the frame and write it to the bulk queue without waiting. It is only
+ * written when the whole frame fits, a partial frame corrupts the next one.
+ * frame_lock keeps other frames from taking the room in between.
+ */
+void PExSendFrame(striso_frame_t* frame) {
+  chMtxLock(&frame_lock);
+  int size = striso_frame_end(frame, frame_seq, frame_time());
+  frame_seq = (frame_seq + 1) & 0x7f;
+  if (bulk_room() < (size_t)size ||
+      obqWriteTimeout(&BDU1.obqueue, frame->data, size, TIME_IMMEDIATE) < (size_t)size) {
+    frames_dropped++;
+  }
+  chMtxUnlock(&frame_lock);
+}
+
+int PExFramesDropped(void) {
+  return frames_dropped;
+}
+
 void InitPConnection(void) {
 
+  chMtxObjectInit(&frame_lock);
+
   // initializes descriptor strings
   init_usb_descriptor();
 
@@ -117,7 +183,7 @@ int strlenmax(const unsigned char* s, int len) {
     return (s - s0) - 1;
 }
 
-void PExReceiveByte(unsigned char c) {
+void PExReceiveByte(unsigned char c, mutex_t* synth_lock) {
   // ws2812_write_led(0, 0,67,0);
   static char header = 0;
   static int state = 0;
@@ -160,14 +226,32 @@ void PExReceiveByte(unsigned char c) {
       }
       else if (c == 'S') { // enable binary protocol over USB Bulk
         config.send_usb_bulk = 1;
+        config.bulk_pacing = 1;
+      }
+      else if (c == 'U') { // enable binary protocol over USB Bulk without pacing
+        config.send_usb_bulk = 1;
+        config.bulk_pacing = 0;
+      }
+      else if (c == 'F') { // enable framed binary protocol (v2) over USB Bulk
+        config.send_usb_bulk = 2;
+      }
+      else if (c == 'R') { // enable raw sensor stream, uses the framed protocol
+        config.send_usb_bulk = 2;
+        buttonSetRawStream(true);
+      }
+      else if (c == 'r') { // disable raw sensor stream
+        buttonSetRawStream(false);
       }
       else if (c == 's') { // disable binary protocol over USB Bulk
         config.send_usb_bulk = 0;
+        config.bulk_pacing = 1;
         config.send_midi_monitor = 0;
+        buttonSetRawStream(false);
         chprintf((BaseSequentialStream * )&BDU1, "Stcs\r\n");
       }
       else if (c == 'M') { // enable MIDI monitor over binary protocol
-        config.send_usb_bulk = 1;
+        if (!config.send_usb_bulk)
+          config.send_usb_bulk = 1;
         config.send_midi_monitor = 1;
       }
       else if (c == 'm') { // disable MIDI monitor over binary protocol
@@ -195,30 +279,80 @@ void PExReceiveByte(unsigned char c) {
           chprintf((BaseSequentialStream *)&BDU1, "Debug: enabled\r\n");
         }
       }
+      else if (c == 'E') { // erase settings saved on the device
+        settingsStoreClear();
+        // back to the presets and tunings of the config
+        chMtxLock(synth_lock);
+        compile_presets();
+        chMtxUnlock(synth_lock);
+        chprintf((BaseSequentialStream *)&BDU1, "Stored settings cleared\r\n");
+      }
       else if (c == 'I') { // thread info
         cmd_threads((BaseSequentialStream *)&BDU1);
       }
       else if (c == 'C') { // Calibration mode
         buttonSetCalibration();
       }
+#ifdef USE_INTERNAL_SYNTH
+      else if (c == 'b') { // audio block size, in next byte
+        state = 4;
+      }
+#endif
+      else if (c == 'T') { // save the current tuning, tuning number in next byte
+        state = 5;
+      }
+      break;
+#ifdef USE_INTERNAL_SYNTH
+    case 4:
+      state = 0;
+      if (codec_set_block_size(c)) {
+        chprintf((BaseSequentialStream *)&BDU1, "Invalid block size %d\r\n", c);
+      }
+      break;
+#endif
+    case 5: {
+      state = 0;
+      chMtxLock(synth_lock);
+      int r = save_tuning(c);
+      chMtxUnlock(synth_lock);
+      if (r) {
+        chprintf((BaseSequentialStream *)&BDU1, "Invalid tuning %d\r\n", c);
+      } else {
+        chprintf((BaseSequentialStream *)&BDU1, "Tuning %d saved\r\n", c);
+      }
       break;
     }
+    }
   }
 }
 
-void PExReceive(void) {
+/*
+ * Handle commands and MIDI from the host. synth_lock is only held while the
+ * synth state changes, the replies to commands can block when the host doesn't
+ * read the bulk port.
+ */
+void PExReceive(mutex_t* synth_lock) {
   // get USB bulk bytes from host
   unsigned char received;
   while (chnReadTimeout(&BDU1, &received, 1, TIME_IMMEDIATE)) {
-    PExReceiveByte(received);
+    PExReceiveByte(received, synth_lock);
   }
 
   // get USB MIDI bytes from host
   // TODO: check if midi buffer is alligned with 4 bytes
   uint8_t r[4];
   while (chnReadTimeout(&MDU1, &r[0], 4, TIME_IMMEDIATE)) {
-    MidiInMsgHandler(MIDI_DEVICE_USB_DEVICE, ((r[0] & 0xF0) >> 4) + 1, r[1],
-                    r[2], r[3]);
+    uint8_t cin = r[0] & 0x0F;
+    chMtxLock(synth_lock);
+    if (cin >= 0x4 && cin <= 0x7) {
+      // SysEx start or continue with 3 bytes, or end with 1, 2 or 3 bytes
+      MidiInSysExHandler(MIDI_DEVICE_USB_DEVICE, ((r[0] & 0xF0) >> 4) + 1, &r[1],
+                         cin == 0x4 ? 3 : cin - 0x4);
+    } else {
+      MidiInMsgHandler(MIDI_DEVICE_USB_DEVICE, ((r[0] & 0xF0) >> 4) + 1, r[1],
+                      r[2], r[3]);
+    }
+    chMtxUnlock(synth_lock);
   }
 }
 
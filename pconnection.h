@@ -20,12 +20,17 @@
 #ifndef __PCONNECTION_H
 #define __PCONNECTION_H
 
+#include "ch.h"
+#include "striso_frame.h"
+
 void USBDMidiPoll(void);
 void PExTransmit(void);
-void PExReceive(void);
+void PExReceive(mutex_t* synth_lock);
 void InitPConnection(void);
 extern void BootLoaderInit(void);
 void LogTextMessage(const char* format, ...);
 int GetFirmwareID(void);
+void PExSendFrame(striso_frame_t* frame);
+int PExFramesDropped(void);
 
 #endif
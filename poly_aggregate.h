@@ -0,0 +1,162 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _POLY_AGGREGATE_H
+#define _POLY_AGGREGATE_H
+
+/*
+ * Running aggregates of the held buttons for single channel poly mode: the
+ * highest pressure, and bend and tilt averaged with their square as weight.
+ * A button message updates them from the difference with its previous values
+ * instead of summing all buttons again. The highest pressure is only searched
+ * again, among the held buttons, when the button that has it goes down.
+ */
+
+// exact recompute after this many updates to get rid of float rounding drift
+#define POLY_RECOMPUTE_INTERVAL 256
+
+template<int N>
+class PolyAggregate {
+    public:
+        int count;          // held buttons
+        float pres_max;
+
+        PolyAggregate() {
+            reset();
+        }
+
+        void reset(void) {
+            for (int n = 0; n < N; n++) {
+                index[n] = -1;
+            }
+            count = 0;
+            updates = 0;
+            pres_max = 0.0f;
+            max_button = -1;
+            clear_sums();
+        }
+
+        /*
+         * New values for button but, on is false when it is released.
+         */
+        void update(int but, bool on, float pres, float x, float y) {
+            if (index[but] >= 0) {
+                x3_sum -= x3[but];
+                x2_sum -= x2[but];
+                y3_sum -= y3[but];
+                y2_sum -= y2[but];
+                if (!on) {
+                    remove(but);
+                }
+            }
+            else if (on) {
+                index[but] = count;
+                held[count++] = but;
+            }
+
+            if (on) {
+                this->pres[but] = pres;
+                x2[but] = x * x;
+                x3[but] = x2[but] * x;
+                y2[but] = y * y;
+                y3[but] = y2[but] * y;
+                x3_sum += x3[but];
+                x2_sum += x2[but];
+                y3_sum += y3[but];
+                y2_sum += y2[but];
+                if (pres >= pres_max) {
+                    pres_max = pres;
+                    max_button = but;
+                }
+                else if (but == max_button) {
+                    find_max();
+                }
+            }
+            else if (but == max_button) {
+                find_max();
+            }
+
+            // after a release the sums can be left with rounding errors of
+            // larger values than the ones that remain, so recompute them then
+            if (!on || ++updates >= POLY_RECOMPUTE_INTERVAL) {
+                recompute();
+            }
+        }
+
+        float x(void) {
+            return x2_sum > 0.0000001f ? x3_sum / x2_sum : x3_sum;
+        }
+
+        float y(void) {
+            return y2_sum > 0.0000001f ? y3_sum / y2_sum : y3_sum;
+        }
+
+    private:
+        int held[N];        // held buttons, unordered
+        int index[N];       // position in held, -1 when not held
+        int max_button;
+        int updates;
+        float pres[N];
+        float x3[N];
+        float x2[N];
+        float y3[N];
+        float y2[N];
+        float x3_sum;
+        float x2_sum;
+        float y3_sum;
+        float y2_sum;
+
+        void remove(int but) {
+            int last = held[--count];
+            held[index[but]] = last;
+            index[last] = index[but];
+            index[but] = -1;
+        }
+
+        void find_max(void) {
+            pres_max = 0.0f;
+            max_button = -1;
+            for (int n = 0; n < count; n++) {
+                int b = held[n];
+                if (pres[b] > pres_max) {
+                    pres_max = pres[b];
+                    max_button = b;
+                }
+            }
+        }
+
+        void clear_sums(void) {
+            x3_sum = 0.0f;
+            x2_sum = 0.0f;
+            y3_sum = 0.0f;
+            y2_sum = 0.0f;
+        }
+
+        void recompute(void) {
+            clear_sums();
+            for (int n = 0; n < count; n++) {
+                int b = held[n];
+                x3_sum += x3[b];
+                x2_sum += x2[b];
+                y3_sum += y3[b];
+                y2_sum += y2[b];
+            }
+            updates = 0;
+        }
+};
+
+#endif
@@ -0,0 +1,397 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+#include "ccportab.h"
+
+#include "settings_store.h"
+
+#define FLASH_BANK2_START 0x08100000
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xcdef89ab
+#define FLASH_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGSERR | FLASH_SR_STRBERR | \
+                      FLASH_SR_INCERR | FLASH_SR_OPERR)
+
+#define SETTINGS_PENDING 80 // a saved tuning is 64 keys
+
+/*
+ * One record is one 256 bit flash word, the smallest unit the H7 can program.
+ * The first record of a sector is the header, it is written last when a sector
+ * is compacted so an interrupted compaction leaves the old sector active.
+ */
+typedef struct {
+  ConfigParam param;
+  uint32_t generation;
+  uint32_t reserved[2];
+  uint32_t crc;
+} settings_record_t;
+typedef char assert_settings_record_size[(sizeof(settings_record_t) == 32) ? 1 : -1];
+
+#define SECTOR_RECORDS (SETTINGS_SECTOR_SIZE / sizeof(settings_record_t))
+
+static CC_ALIGN(8) const char header_key[8] = {'S','t','r','K','V','0','0','1'};
+
+#ifdef SETTINGS_FLASH_EMULATED
+// host build, the program including this file emulates the flash access
+// functions, see utils/settings_check.c
+static settings_record_t flash_sectors[2][SECTOR_RECORDS];
+static settings_record_t* const sectors[2] = {flash_sectors[0], flash_sectors[1]};
+static bool flash_erase_sector(int s);
+static bool flash_program(settings_record_t* dst, const settings_record_t* src);
+#else
+static settings_record_t* const sectors[2] = {
+  (settings_record_t*)SETTINGS_FLASH_START,
+  (settings_record_t*)(SETTINGS_FLASH_START + SETTINGS_SECTOR_SIZE),
+};
+#endif
+static int active = -1;
+static uint32_t write_pos = 0;
+static uint32_t generation = 0;
+
+static CC_ALIGN(8) ConfigParam pending[SETTINGS_PENDING];
+static int pending_count = 0;
+static bool pending_clear = false;
+static systime_t last_change;
+static mutex_t settings_lock;
+static binary_semaphore_t settings_sem;
+
+static uint32_t crc32(const void* data, int len) {
+  const uint8_t* p = data;
+  uint32_t crc = 0xffffffff;
+  while (len--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t record_crc(const settings_record_t* r) {
+  return crc32(r, offsetof(settings_record_t, crc));
+}
+
+static bool record_erased(const settings_record_t* r) {
+  const uint32_t* w = (const uint32_t*)r;
+  for (unsigned int k = 0; k < sizeof(settings_record_t) / 4; k++) {
+    if (w[k] != 0xffffffff)
+      return false;
+  }
+  return true;
+}
+
+static bool record_valid(const settings_record_t* r) {
+  return !record_erased(r) && record_crc(r) == r->crc;
+}
+
+static bool sector_erased(int s) {
+  for (unsigned int n = 0; n < SECTOR_RECORDS; n++) {
+    if (!record_erased(&sectors[s][n]))
+      return false;
+  }
+  return true;
+}
+
+#ifndef SETTINGS_FLASH_EMULATED
+/*
+ * Flash bank 2 access. The firmware is linked into bank 1 only (flash0 in
+ * STM32H743xI_uf2.ld), so programming and erasing bank 2 does not stall code
+ * execution.
+ */
+static void flash_unlock(void) {
+  if (FLASH->CR2 & FLASH_CR_LOCK) {
+    FLASH->KEYR2 = FLASH_KEY1;
+    FLASH->KEYR2 = FLASH_KEY2;
+  }
+}
+
+static void flash_lock(void) {
+  FLASH->CR2 |= FLASH_CR_LOCK;
+}
+
+static bool flash_wait(void) {
+  while (FLASH->SR2 & FLASH_SR_QW) {
+    chThdSleep(1);
+  }
+  uint32_t err = FLASH->SR2 & FLASH_ERRORS;
+  FLASH->CCR2 = err | FLASH_CCR_CLR_EOP;
+  return err == 0;
+}
+
+static bool flash_erase_sector(int s) {
+  uint32_t snb = (SETTINGS_FLASH_START - FLASH_BANK2_START) / SETTINGS_SECTOR_SIZE + s;
+  flash_unlock();
+  FLASH->CR2 = (FLASH->CR2 & ~(FLASH_CR_SNB | FLASH_CR_PSIZE)) |
+               FLASH_CR_PSIZE_1 | FLASH_CR_SER | (snb << FLASH_CR_SNB_Pos);
+  FLASH->CR2 |= FLASH_CR_START;
+  bool ok = flash_wait();
+  FLASH->CR2 &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+  flash_lock();
+  cacheBufferInvalidate(sectors[s], SETTINGS_SECTOR_SIZE);
+  return ok;
+}
+
+static bool flash_program(settings_record_t* dst, const settings_record_t* src) {
+  volatile uint32_t* d = (volatile uint32_t*)dst;
+  const uint32_t* s = (const uint32_t*)src;
+  flash_unlock();
+  FLASH->CR2 = (FLASH->CR2 & ~FLASH_CR_PSIZE) | FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+  __ISB();
+  __DSB();
+  for (unsigned int k = 0; k < sizeof(settings_record_t) / 4; k++) {
+    d[k] = s[k];
+  }
+  __ISB();
+  __DSB();
+  bool ok = flash_wait();
+  FLASH->CR2 &= ~FLASH_CR_PG;
+  flash_lock();
+  cacheBufferInvalidate(dst, sizeof(settings_record_t));
+  return ok;
+}
+#endif
+
+/*
+ * Copy the latest value of every key to the other sector and make it active.
+ * With keep false an empty sector is activated, which clears all settings.
+ */
+static bool compact(bool keep) {
+  int dst = active < 0 ? 0 : 1 - active;
+  settings_record_t* d = sectors[dst];
+  uint32_t pos = 1;
+
+  if (!sector_erased(dst) && !flash_erase_sector(dst))
+    return false;
+
+  if (keep && active >= 0) {
+    const settings_record_t* r = sectors[active];
+    for (uint32_t n = 1; n < write_pos; n++) {
+      if (!record_valid(&r[n]))
+        continue;
+      // skip values that are overwritten later in the log
+      bool newer = false;
+      for (uint32_t m = n + 1; m < write_pos && !newer; m++) {
+        newer = cmp8(r[m].param.key, r[n].param.key) && record_valid(&r[m]);
+      }
+      if (newer)
+        continue;
+      if (!flash_program(&d[pos++], &r[n]))
+        return false;
+    }
+  }
+
+  settings_record_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.param.key, header_key, 8);
+  header.generation = generation + 1;
+  header.crc = record_crc(&header);
+  if (!flash_program(&d[0], &header))
+    return false;
+
+  chMtxLock(&settings_lock);
+  active = dst;
+  write_pos = pos;
+  generation++;
+  chMtxUnlock(&settings_lock);
+  return true;
+}
+
+static bool append(const ConfigParam* p) {
+  if (active < 0 || write_pos >= SECTOR_RECORDS) {
+    if (!compact(true) || write_pos >= SECTOR_RECORDS)
+      return false;
+  }
+
+  settings_record_t r;
+  memset(&r, 0, sizeof(r));
+  r.param = *p;
+  r.generation = generation;
+  r.crc = record_crc(&r);
+  bool ok = flash_program(&sectors[active][write_pos], &r);
+
+  // a failed write is skipped, its crc won't match
+  chMtxLock(&settings_lock);
+  write_pos++;
+  chMtxUnlock(&settings_lock);
+  return ok;
+}
+
+static const char* stored_value(const char* key) {
+  if (active < 0)
+    return NULL;
+  const settings_record_t* r = sectors[active];
+  for (uint32_t n = write_pos - 1; n >= 1; n--) {
+    if (cmp8(r[n].param.key, key) && record_valid(&r[n]))
+      return r[n].param.value;
+  }
+  return NULL;
+}
+
+/*
+ * The value including the changes that are not written yet, call with
+ * settings_lock held.
+ */
+static const char* current_value(const char* key) {
+  for (int n = 0; n < pending_count; n++) {
+    if (cmp8(pending[n].key, key))
+      return pending[n].value;
+  }
+  return pending_clear ? NULL : stored_value(key);
+}
+
+/*
+ * Write the pending settings to flash, compacting full sectors. A value stays
+ * pending until it is written, so settingsStoreGet never gets an older one.
+ */
+static void write_pending(void) {
+  if (pending_clear) {
+    compact(false);
+    chMtxLock(&settings_lock);
+    pending_clear = false;
+    chMtxUnlock(&settings_lock);
+  }
+
+  while (true) {
+    ConfigParam p;
+    chMtxLock(&settings_lock);
+    if (pending_count == 0) {
+      chMtxUnlock(&settings_lock);
+      break;
+    }
+    p = pending[pending_count - 1];
+    chMtxUnlock(&settings_lock);
+    append(&p);
+
+    // keep it if it was changed again meanwhile
+    chMtxLock(&settings_lock);
+    for (int n = 0; n < pending_count; n++) {
+      if (cmp8(pending[n].key, p.key)) {
+        if (cmp8(pending[n].value, p.value))
+          pending[n] = pending[--pending_count];
+        break;
+      }
+    }
+    chMtxUnlock(&settings_lock);
+  }
+}
+
+/*
+ * Background thread writing pending settings.
+ */
+static THD_WORKING_AREA(waSettingsThread, 512);
+static THD_FUNCTION(SettingsThread, arg) {
+  (void)arg;
+  chRegSetThreadName("settings");
+
+  while (true) {
+    chBSemWait(&settings_sem);
+
+    // wait until settings stopped changing
+    sysinterval_t since;
+    while ((since = chVTTimeElapsedSinceX(last_change)) < SETTINGS_WRITE_DELAY) {
+      chThdSleep(SETTINGS_WRITE_DELAY - since);
+    }
+
+    write_pending();
+  }
+}
+
+void settingsStoreInit(void) {
+  chMtxObjectInit(&settings_lock);
+  chBSemObjectInit(&settings_sem, true);
+
+  for (int s = 0; s < 2; s++) {
+    const settings_record_t* h = &sectors[s][0];
+    if (record_valid(h) && cmp8(h->param.key, header_key) &&
+        (active < 0 || h->generation > generation)) {
+      active = s;
+      generation = h->generation;
+    }
+  }
+
+  if (active >= 0) {
+    // the log ends after the last programmed word
+    write_pos = SECTOR_RECORDS;
+    while (write_pos > 1 && record_erased(&sectors[active][write_pos - 1])) {
+      write_pos--;
+    }
+  }
+
+  chThdCreateStatic(waSettingsThread, sizeof(waSettingsThread), LOWPRIO, SettingsThread, NULL);
+}
+
+/*
+ * Copy the stored value (8 characters) to value, returns false if the key is
+ * not in the store. Changes that are not written to flash yet are included.
+ * The copy is made under the lock, the pending values and the sectors can be
+ * rewritten by the settings thread any time after.
+ */
+bool settingsStoreGet(const char* key, char* value) {
+  chMtxLock(&settings_lock);
+  const char* v = current_value(key);
+  if (v)
+    memcpy(value, v, 8);
+  chMtxUnlock(&settings_lock);
+  return v != NULL;
+}
+
+/*
+ * Queue a value to be written to flash, unchanged values are ignored.
+ * Returns -1 when too many values are waiting to be written.
+ */
+int settingsStoreSet(const char* key, const char* value) {
+  int n;
+  chMtxLock(&settings_lock);
+  for (n = 0; n < pending_count; n++) {
+    if (cmp8(pending[n].key, key))
+      break;
+  }
+  if (n == pending_count) {
+    const char* cur = pending_clear ? NULL : stored_value(key);
+    if (cur && cmp8(cur, value)) {
+      chMtxUnlock(&settings_lock);
+      return 0;
+    }
+    if (pending_count == SETTINGS_PENDING) {
+      chMtxUnlock(&settings_lock);
+      return -1;
+    }
+    pending_count++;
+  }
+  memcpy(pending[n].key, key, 8);
+  memcpy(pending[n].value, value, 8);
+  last_change = chVTGetSystemTimeX();
+  chMtxUnlock(&settings_lock);
+  chBSemSignal(&settings_sem);
+  return 0;
+}
+
+/*
+ * Remove all stored settings, the config from flash_config is used again.
+ */
+void settingsStoreClear(void) {
+  chMtxLock(&settings_lock);
+  pending_count = 0;
+  pending_clear = true;
+  last_change = chVTGetSystemTimeX();
+  chMtxUnlock(&settings_lock);
+  chBSemSignal(&settings_sem);
+}
@@ -0,0 +1,40 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SETTINGS_STORE_H_
+#define _SETTINGS_STORE_H_
+
+#include "config_store.h"
+
+/*
+ * Log structured key/value store for settings changed on the device.
+ *
+ * Two 128k sectors in flash bank 2 are used alternately. Records are appended
+ * as single 256 bit flash words, when a sector is full the live records are
+ * compacted into the other sector by a low priority thread. Values are only
+ * written after SETTINGS_WRITE_DELAY without changes to limit flash wear.
+ */
+#define SETTINGS_FLASH_START 0x081a0000
+#define SETTINGS_SECTOR_SIZE 0x20000
+#define SETTINGS_WRITE_DELAY TIME_MS2I(2000)
+
+void settingsStoreInit(void);
+bool settingsStoreGet(const char* key, char* value);
+int settingsStoreSet(const char* key, const char* value);
+void settingsStoreClear(void);
+
+#endif
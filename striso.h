@@ -32,6 +32,23 @@ etc. up to 7 values
 Button message:
 6 values: signal[0-2], velocity[0-2]    (up to v2.0.5)
 4 values: pres, vpres, x, y             (v2.1.0 and later)
+
+Framed protocol (v2), enabled with "StcF" over the bulk port:
+
+Messages are sent in frames, a frame header followed by the messages that were
+queued since the previous frame. The header is a message from source ID_FRAME:
+byte[0]:   0b11111011, header, source ID_FRAME, 3 values
+byte[1]:   0b0nnnnnnn, 7 bit frame sequence number
+byte[2-5]: unsigned 28 bit device timestamp in microseconds, high part first
+byte[6-7]: unsigned 14 bit frame size in bytes, including the header
+
+Inside a frame raw blocks (source ID_RAW) can carry 16 bit values:
+byte[0]:   0b11110000, header, source ID_RAW
+byte[1]:   0b0ccccccc, 7 bit ID
+byte[2]:   0b0nnnnnnn, number of values
+byte[3-]:  signed 16 bit values, little endian
+Raw values can have the high bit set, so a receiver has to use the frame size
+to find the next frame. A gap in the sequence numbers means frames were lost.
 */
 
 // Striso protocol source ID's [0-15]
@@ -41,6 +58,8 @@ Button message:
 #define ID_ACCEL 3    // motion sensor
 #define ID_SYS 4      // system, status, debug
 #define ID_MIDI 5     // midi monitor
+#define ID_RAW 14     // raw 16 bit values, only inside frames
+#define ID_FRAME 15   // frame header
 
 // control numbers [0-127]
 #define IDC_PORTAMENTO 0      // length 1
@@ -64,5 +83,9 @@ Button message:
 #define ID_SYS_MSG_TOO_LONG_SYNTH 4
 #define ID_SYS_BATTERY_VOLTAGE 5
 #define ID_SYS_TEMPERATURE 6
+#define ID_SYS_DSP_LOAD 7             // length 4: average and peak load in 0.1%, missed blocks, block size
+#define ID_SYS_DROPPED 8              // length 2: messages dropped in the message queue and frames dropped in the usb queue since the last report
+#define ID_SYS_LOCK_WAIT 9            // length 1: longest wait of the control thread for the synth lock in us since the last report
+#define ID_SYS_MSG_CYCLES 10          // length 3: average and longest cycles of handling a button message, and the number of button messages, since the last report
 
 #endif
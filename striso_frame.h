@@ -0,0 +1,277 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _STRISO_FRAME_H
+#define _STRISO_FRAME_H
+
+/*
+ * Encoder and decoder for the framed Striso binary protocol (v2), see
+ * striso.h for the format. Used by the firmware and by the host utilities.
+ * The decoder also reads the v1 message stream.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "striso.h"
+
+#define STRISO_FRAME_HEADER (0x80 | ID_FRAME << 3 | 3)
+#define STRISO_RAW_HEADER (0x80 | ID_RAW << 3)
+#define STRISO_FRAME_HEADER_SIZE 8
+#define STRISO_FRAME_MAX 256  // fits in one bulk usb buffer
+#define STRISO_RAW_MAX ((STRISO_FRAME_MAX - STRISO_FRAME_HEADER_SIZE - 3) / 2)
+
+typedef struct {
+  uint8_t data[STRISO_FRAME_MAX];
+  int size;
+} striso_frame_t;
+
+static inline void striso_frame_begin(striso_frame_t* f) {
+  f->size = STRISO_FRAME_HEADER_SIZE;
+}
+
+static inline int striso_frame_empty(const striso_frame_t* f) {
+  return f->size <= STRISO_FRAME_HEADER_SIZE;
+}
+
+/*
+ * Add a message in the v1 format, msg[0] is the source, msg[1] the ID.
+ * Returns 0 when the message doesn't fit.
+ */
+static inline int striso_frame_add(striso_frame_t* f, int size, const int* msg) {
+  int len = 2 + (size - 2) * 2;
+  if (f->size + len > STRISO_FRAME_MAX)
+    return 0;
+  uint8_t* out = &f->data[f->size];
+  out[0] = 0x80 | ((uint8_t)msg[0])<<3 | ((uint8_t)(size-2));
+  out[1] = 0x7f & (uint8_t)msg[1];
+  for (int c = 2; c < size; c++) {
+    out[c*2-2] = 0x7f & (uint8_t)(msg[c]>>7);
+    out[c*2-1] = 0x7f & (uint8_t)(msg[c]);
+  }
+  f->size += len;
+  return 1;
+}
+
+/*
+ * Add a block of raw 16 bit values. Returns 0 when the block doesn't fit.
+ */
+static inline int striso_frame_add_raw(striso_frame_t* f, int id, int n, const int16_t* values) {
+  int len = 3 + n * 2;
+  if (n > STRISO_RAW_MAX || f->size + len > STRISO_FRAME_MAX)
+    return 0;
+  uint8_t* out = &f->data[f->size];
+  out[0] = STRISO_RAW_HEADER;
+  out[1] = 0x7f & (uint8_t)id;
+  out[2] = (uint8_t)n;
+  for (int c = 0; c < n; c++) {
+    out[3+c*2] = (uint8_t)values[c];
+    out[4+c*2] = (uint8_t)((uint16_t)values[c] >> 8);
+  }
+  f->size += len;
+  return 1;
+}
+
+/*
+ * Write the frame header, returns the frame size in bytes.
+ */
+static inline int striso_frame_end(striso_frame_t* f, int seq, uint32_t timestamp) {
+  uint8_t* out = f->data;
+  out[0] = STRISO_FRAME_HEADER;
+  out[1] = 0x7f & (uint8_t)seq;
+  out[2] = 0x7f & (uint8_t)(timestamp>>21);
+  out[3] = 0x7f & (uint8_t)(timestamp>>14);
+  out[4] = 0x7f & (uint8_t)(timestamp>>7);
+  out[5] = 0x7f & (uint8_t)(timestamp);
+  out[6] = 0x7f & (uint8_t)(f->size>>7);
+  out[7] = 0x7f & (uint8_t)(f->size);
+  return f->size;
+}
+
+/*
+ * Decoder, collects bytes of a stream until a frame is complete and calls back
+ * for every message in it. Raw blocks are passed as source ID_RAW with one
+ * value per 16 bit value.
+ */
+typedef void (*striso_frame_callback_t)(void* arg, uint32_t timestamp, int src, int id,
+                                        int size, const int* values);
+
+typedef struct {
+  uint8_t data[STRISO_FRAME_MAX];
+  int len;
+  int size;
+  int seq;          // expected sequence number, -1 before the first frame
+  uint32_t frames;
+  uint32_t lost_frames;
+  uint32_t lost_bytes;
+} striso_decoder_t;
+
+static inline void striso_decoder_init(striso_decoder_t* d) {
+  memset(d, 0, sizeof(*d));
+  d->seq = -1;
+}
+
+/*
+ * Parse a complete frame, returns the number of messages or -1 if it is corrupt.
+ * Messages before a corrupt one are still passed on.
+ */
+static inline int striso_frame_parse(const uint8_t* data, int size,
+                                     striso_frame_callback_t callback, void* arg) {
+  int values[STRISO_RAW_MAX];
+  uint32_t timestamp = (uint32_t)data[2]<<21 | (uint32_t)data[3]<<14 |
+                       (uint32_t)data[4]<<7 | (uint32_t)data[5];
+  int count = 0;
+  int pos = STRISO_FRAME_HEADER_SIZE;
+  while (pos < size) {
+    const uint8_t* m = &data[pos];
+    if (m[0] == STRISO_RAW_HEADER) {
+      if (pos + 3 > size)
+        return -1;
+      int n = m[2];
+      if (n > STRISO_RAW_MAX || pos + 3 + n * 2 > size)
+        return -1;
+      for (int c = 0; c < n; c++) {
+        values[c] = (int16_t)(m[3+c*2] | m[4+c*2] << 8);
+      }
+      if (callback)
+        callback(arg, timestamp, ID_RAW, m[1], n, values);
+      pos += 3 + n * 2;
+    }
+    else {
+      if (!(m[0] & 0x80))
+        return -1;
+      int n = m[0] & 0x07;
+      if (pos + 2 + n * 2 > size)
+        return -1;
+      // or all bytes together instead of a branch per byte, the compiler can vectorize this
+      uint8_t bits = 0;
+      for (int c = 1; c < 2 + n * 2; c++) {
+        bits |= m[c];
+      }
+      if (bits & 0x80)
+        return -1;
+      for (int c = 0; c < n; c++) {
+        values[c] = ( ((int)m[2+c*2])<<7 | ((int)m[3+c*2]) ) - ( (int)(m[2+c*2] & 0x40) << 8);
+      }
+      if (callback)
+        callback(arg, timestamp, (m[0] & 0x7f)>>3, m[1], n, values);
+      pos += 2 + n * 2;
+    }
+    count++;
+  }
+  return count;
+}
+
+static inline int striso_frame_done(striso_decoder_t* d, const uint8_t* data, int size,
+                                    striso_frame_callback_t callback, void* arg) {
+  int r = striso_frame_parse(data, size, callback, arg);
+  if (r < 0) {
+    d->lost_bytes += size;
+    return 0;
+  }
+  int seq = data[1];
+  if (d->seq >= 0)
+    d->lost_frames += (seq - d->seq) & 0x7f;
+  d->seq = (seq + 1) & 0x7f;
+  d->frames++;
+  return r;
+}
+
+/*
+ * Feed n bytes of the stream, returns the number of messages passed on.
+ */
+static inline int striso_decode(striso_decoder_t* d, const uint8_t* in, int n,
+                                striso_frame_callback_t callback, void* arg) {
+  int count = 0;
+  for (int k = 0; k < n; k++) {
+    uint8_t c = in[k];
+    if (d->len == 0 && c == STRISO_FRAME_HEADER && k + STRISO_FRAME_HEADER_SIZE <= n) {
+      // whole frame in the input, parse it without copying
+      int size = in[k+6]<<7 | in[k+7];
+      if (size >= STRISO_FRAME_HEADER_SIZE && size <= STRISO_FRAME_MAX && k + size <= n &&
+          !((in[k+1] | in[k+2] | in[k+3] | in[k+4] | in[k+5] | in[k+6] | in[k+7]) & 0x80)) {
+        count += striso_frame_done(d, &in[k], size, callback, arg);
+        k += size - 1;
+        continue;
+      }
+    }
+    if (d->len < STRISO_FRAME_HEADER_SIZE) {
+      // the header bytes after the first have 7 bits
+      if (d->len > 0 && (c & 0x80)) {
+        d->lost_bytes += d->len;
+        d->len = 0;
+      }
+      if (d->len == 0 && c != STRISO_FRAME_HEADER) {
+        d->lost_bytes++;
+        continue;
+      }
+    }
+    d->data[d->len++] = c;
+    if (d->len == STRISO_FRAME_HEADER_SIZE) {
+      d->size = d->data[6]<<7 | d->data[7];
+      if (d->size < STRISO_FRAME_HEADER_SIZE || d->size > STRISO_FRAME_MAX) {
+        d->lost_bytes += d->len;
+        d->len = 0;
+        continue;
+      }
+    }
+    if (d->len >= STRISO_FRAME_HEADER_SIZE && d->len == d->size) {
+      count += striso_frame_done(d, d->data, d->size, callback, arg);
+      d->len = 0;
+    }
+  }
+  return count;
+}
+
+/*
+ * Feed n bytes of a v1 message stream, returns the number of messages passed
+ * on. The timestamp is always 0.
+ */
+static inline int striso_decode_v1(striso_decoder_t* d, const uint8_t* in, int n,
+                                   striso_frame_callback_t callback, void* arg) {
+  int values[7];
+  int count = 0;
+  for (int k = 0; k < n; k++) {
+    uint8_t c = in[k];
+    if (c & 0x80) {
+      // header, an unfinished message is lost
+      d->lost_bytes += d->len;
+      d->data[0] = c;
+      d->len = 1;
+      d->size = 2 + (c & 0x07) * 2;
+      continue;
+    }
+    if (d->len == 0) {
+      d->lost_bytes++;
+      continue;
+    }
+    d->data[d->len++] = c;
+    if (d->len == d->size) {
+      int size = d->data[0] & 0x07;
+      for (int i = 0; i < size; i++) {
+        values[i] = ( ((int)d->data[2+i*2])<<7 | ((int)d->data[3+i*2]) ) - ( (int)(d->data[2+i*2] & 0x40) << 8);
+      }
+      if (callback)
+        callback(arg, 0, (d->data[0] & 0x7f)>>3, d->data[1], size, values);
+      d->len = 0;
+      count++;
+    }
+  }
+  return count;
+}
+
+#endif
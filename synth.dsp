@@ -10,7 +10,9 @@ LPF = fast.LPF;
 BPF = fast.BPF;
 note2freq = fast.note2freq;
 
-voicecount = 6;
+// number of voice instances, the generated class computes a single voice so
+// silent voices can be skipped (see faust2striso.py)
+voicecount = 15;
 
 halftime2fac(x) = 0.5^(1./(SR*x));
 halftime2fac_fast(x) = 1-0.7*(1./(SR*x));
@@ -160,6 +162,9 @@ myrandom = ffunction(int rand_hoaglin (), "fastpow.h", "");
 
 mynoise = myrandom / RANDMAX;
 
+// wrap a table index that is at most p+1 with a compare instead of a division
+wrap(i, p) = select2(i >= p, i, i - p);
+
 // offset to improve spectral shape
 o = 0;//320;//int(hslider("v:[2]config3/offset[style:knob]", 0, 0, 1<<11, 1));
 osc_white1(freq) = s1 + d * (s2 - s1)
@@ -172,7 +177,7 @@ with {
     loop = _ <: _,((_ > period) * period) :> -;
     phase = inc : (+ : loop) ~ _;
     s1 = whitetable(o + int(phase));
-    s2 = whitetable(o + ((int(phase)+1) % int(period)));
+    s2 = whitetable(o + wrap(int(phase)+1, int(period)));
     d = dotpart(phase);
 };
 
@@ -191,7 +196,7 @@ with {
     loop = _ <: _,((_ > period) * period) :> -;
     phase = inc : (+ : loop) ~ _;
     s1 = whitetable(o + int(phase));
-    s2 = whitetable(o + ((int(phase)+1) % int(period)));
+    s2 = whitetable(o + wrap(int(phase)+1, int(period)));
     jump = phase > int(period);
     d = select2(jump, dotpart(phase), dotpart(phase) / dotpart(period));
     //d = dotpart(phase) * 1.0/dotpart(period);
@@ -214,5 +219,5 @@ vmeter(x) = attach(x, envelop(x) : vbargraph("[2]level", 0, 1));
 envelop = abs : max ~ -(20.0/SR);
 
 process = hgroup("strisy",
-        sum(n, voicecount, vgroup("v%n", (note,pres,vpres,but_x,but_y)) : voice) // : vgroup("v%n", vmeter))
+        vgroup("v0", (note,pres,vpres,but_x,but_y)) : voice // : vgroup("v0", vmeter))
         * 1.37 : HPF(K_f0(80),1.31) );// : fi.dcblocker;: stereo:bodyFilter;
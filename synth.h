@@ -25,7 +25,7 @@
 #include "midi.h"
 #include "codec.h"
 
-#define VOICECOUNT 6
+#define VOICECOUNT 15
 
 typedef struct struct_synth_interface {
 	float* acc_abs;
@@ -47,12 +47,18 @@ typedef struct struct_synth_interface {
 extern synth_interface_t synth_interface;
 
 void start_synth_thread(void);
+void synth_get_load(int* avg, int* peak, int* missed);
+void synth_voice_publish(int voice);
+int synth_find_engine(const char* name);
+void synth_select_engine(int engine);
 #endif
 
 int synth_message(int size, int* msg);
 void synth_tick(void);
 void midi_config(void);
 void synth_control_init(void);
+int save_tuning(int n);
+void compile_presets(void);
 
 void clear_dead_notes(void);
 
@@ -28,6 +28,7 @@ extern "C" {
     #include "led.h"
     #include "aux_jack.h"
     #include "messaging.h"
+    #include "settings_store.h"
 }
 
 #include "config.h"
@@ -36,6 +37,11 @@ extern "C" {
 #include "midi_usb.h"
 #include "midi_serial.h"
 #include "midi.h"
+#include "poly_aggregate.h"
+#include "timer_wheel.h"
+#include "midi_route.h"
+#include "curve_lut.h"
+#include "midi_tuning.h"
 
 #ifndef USE_WS2812
 #define ws2812_write_led(n,r,g,b) led_rgb3(14*r,14*g,14*b)
@@ -47,6 +53,8 @@ extern "C" {
 #define VOL_TICK (0.0005) // (1.0 / (SAMPLINGFREQ / CHANNEL_BUFFER_SIZE) / 0.5) // decay time of estimated volume
 #define VOL_TICK_FACT (0.998) // 0.5**(1/(SAMPLINGFREQ / CHANNEL_BUFFER_SIZE)/0.1)
 #define CLEAR_TIMER TIME_MS2I(500) // interval to clear dead notes
+#define CURVE_MIN 0.5f // range of the pressure and velocity curve exponents
+#define CURVE_MAX 4.0f
 
 float volume_linear = 90.0f; // volume in range 0-127
 void set_volume(float vol) {
@@ -75,19 +83,6 @@ void MidiSend3(uint8_t b0, uint8_t b1, uint8_t b2) {
 #endif
 }
 
-// Schlick power function, approximation of power function
-float powf_schlick(const float a, const float b)
-{
-    return (a / (b - a * b + a));
-}
-
-// Derivative of schlick power function
-float powf_schlick_d(const float a, const float b)
-{
-    float t = (-a*b+a+b);
-    return b/(t*t);
-}
-
 #define pow2(x) ((x)*(x))
 #define pow3(x) ((x)*(x)*(x))
 #define max(x, y) ((x)>(y)?(x):(y))
@@ -110,7 +105,9 @@ static inline uint32_t log2i(const uint32_t x){return (31 - __builtin_clz (x));}
 
 void update_leds(void);
 void set_midi_mode(midi_mode_t mode);
+int midi_master_channel(void);
 float config_but(int but, int type, float adjust);
+void save_settings(void);
 
 typedef enum {
     STATE_OFF = 0,
@@ -120,145 +117,266 @@ typedef enum {
     STATE_TRANSPOSE = 4,
 } button_state_t;
 
+#define PRESET_ROUTES 8 // extra routes per preset
+#define MODE_ROUTES 5   // key routes from the MIDI CC settings: pressure, x, y and 2 velocities
+// the worst case, so compile() never runs out of routes
+#define MAX_KEY_ROUTES (MODE_ROUTES + PRESET_ROUTES)
+#define MAX_ROUTES (MODE_ROUTES + ROUTE_MOTION_SOURCES + 1 + PRESET_ROUTES)
+#define ROUTE_UNSENT INT16_MAX
+#define MOTION_REFRESH_TIME TIME_MS2I(1000) // resend unchanged motion CCs after this time
+#define MOTION_DEADBAND_14BIT 3 // about 3 mg or 0.4 degree/s, sensor noise
+// motion CCs wait while more than this many bytes are waiting for USB, notes
+// go first
+#define MOTION_USB_ROOM (MIDI_USB_BUFFERS_NUMBER * MIDI_USB_BUFFERS_SIZE / 2)
+
+typedef enum {
+    ROUTE_SELECT_ALL,
+    ROUTE_SELECT_POLY_PRESSURE, // per key in single channel poly mode
+    ROUTE_SELECT_CHANNEL,       // combined keys in single channel poly mode
+} route_select_t;
+
 /*
- * Send midi messages with hysteresis filtering
+ * Routes from gestures to MIDI messages (midi_route.h), compiled into one
+ * table by compile() from the MIDI settings and the routes of the loaded
+ * preset. Sending is a walk over the table, key routes first. The table is
+ * sized for all routes of the settings and a preset, so none are dropped.
  */
-class MidiParam {
+class MidiRoutes {
     public:
-        int last_value = INT32_MAX;
-        int midi_cc = CFG_DISABLE;
+        route_t routes[MAX_ROUTES];
+        int key_count = 0;  // routes with a key source
+        int count = 0;
+        const route_t* preset_routes = NULL;
+        int preset_count = 0;
+        // value as last sent by the key routes per key, the last one for
+        // channel wide values, and by the global routes
+        int16_t last_key_value[MAX_KEY_ROUTES][BUTTONCOUNT + 1];
+        int last_value[MAX_ROUTES];
+        systime_t last_time[MAX_ROUTES];
+
+        /*
+         * Call after changing the MIDI mode or the MIDI CC settings.
+         */
+        void compile(void) {
+            count = 0;
+            if (config.midi_mode == MIDI_MODE_POLY) {
+                add_pressure(config.midi_pres);
+                if (config.midi_x == CFG_PITCH_BEND) {
+                    add(ROUTE_SRC_BEND, ROUTE_DST_PITCH_BEND, 0, ROUTE_CHANNEL_KEY);
+                } else if (config.midi_x < 120) {
+                    add(ROUTE_SRC_X, ROUTE_DST_CC, config.midi_x, ROUTE_CHANNEL_KEY);
+                }
+                if (config.midi_y < 120) {
+                    add(ROUTE_SRC_Y, ROUTE_DST_CC, config.midi_y, ROUTE_CHANNEL_KEY);
+                }
+            } else {
+                // pitch bend is always sent in MPE and mono mode, for the pitch
+                add_pressure(config.mpe_pres);
+                if (config.mpe_x < 120) {
+                    add(ROUTE_SRC_X, ROUTE_DST_CC, config.mpe_x, ROUTE_CHANNEL_KEY);
+                }
+                if (config.mpe_y < 120) {
+                    add(ROUTE_SRC_Y, ROUTE_DST_CC, config.mpe_y, ROUTE_CHANNEL_KEY);
+                }
+                if (config.mpe_contvelo < 120) {
+                    add(ROUTE_SRC_VELO, ROUTE_DST_CC, 73, ROUTE_CHANNEL_KEY)->scale = 256.0f;
+                    add(ROUTE_SRC_RVELO, ROUTE_DST_CC, 72, ROUTE_CHANNEL_KEY)->scale = 256.0f;
+                }
+            }
+            add_preset(true);
+            key_count = count;
+
+            // motion sensor on CC 16-19 and 80-82, acceleration -2g to 2g in
+            // 7 bit, -8g to 8g in 14 bit. These are sent over USB only by
+            // design, serial MIDI at 31250 baud has no room for them next to
+            // the notes, see send_motion(). Like the pedal they are always on
+            // channel 1, preset routes can use the master channel instead.
+            static const uint8_t motion_cc[ROUTE_MOTION_SOURCES] = {16, 17, 18, 19, 80, 81, 82};
+            for (int n = 0; n < ROUTE_MOTION_SOURCES; n++) {
+                int source = ROUTE_SRC_ACC_X + n;
+                route_t* r = add(source, config.send_motion_14bit ? ROUTE_DST_CC14 : ROUTE_DST_CC,
+                                 motion_cc[n], 0);
+                if (config.send_motion_14bit) {
+                    r->scale = source <= ROUTE_SRC_ACC_ABS ? 2048.0f : 4096.0f;
+                    r->offset = source == ROUTE_SRC_ACC_ABS ? 0.0f : 8192.0f;
+                } else if (source == ROUTE_SRC_ACC_ABS) {
+                    r->scale = 128.0f;
+                }
+            }
+            add(ROUTE_SRC_PEDAL, ROUTE_DST_CC, MIDI_C_DAMPER, 0);
+            add_preset(false);
 
-        MidiParam(int cc) {
-            midi_cc = cc;
+            for (int n = 0; n < key_count; n++) {
+                for (int k = 0; k <= BUTTONCOUNT; k++) {
+                    last_key_value[n][k] = ROUTE_UNSENT;
+                }
+            }
+            for (int n = 0; n < count; n++) {
+                last_value[n] = ROUTE_UNSENT;
+                last_time[n] = 0;
+            }
+        }
+
+        /*
+         * Send the key routes, src has the ROUTE_KEY_SOURCES values of a key
+         * or of the combined keys, slot is the key or BUTTONCOUNT.
+         */
+        void send_key(const float* src, int slot, int channel, int note, route_select_t select) {
+            for (int n = 0; n < key_count; n++) {
+                const route_t* r = &routes[n];
+                if (select != ROUTE_SELECT_ALL
+                    && (r->dest == ROUTE_DST_POLY_PRESSURE) != (select == ROUTE_SELECT_POLY_PRESSURE))
+                    continue;
+                int value = route_value(r, src[r->source], last_key_value[n][slot]);
+                if (value != last_key_value[n][slot]) {
+                    send(r, value, channel, note, false);
+                    last_key_value[n][slot] = value;
+                }
+            }
         }
 
         /*
-         * Send midi message if more than 0.75 different from last value
+         * Send the routes of a global source
          */
-        void send(int value_x4, int midi_channel) {
-            int d = (value_x4 < last_value*4) * 2 + 1; // calculate direction for hysteresis
-            int value = __USAT((value_x4 + d) >> 2, 7) & 0x7F;
-            if (value != last_value) {
-                if (midi_cc < 120) {
-                    MidiSend3(MIDI_CONTROL_CHANGE | midi_channel,
-                                    midi_cc, value);
-                } else if (midi_cc == CFG_CHANNEL_PRESSURE) {
-                    MidiSend2(MIDI_CHANNEL_PRESSURE | midi_channel,
-                                    value);
+        void send_global(int source, float x) {
+            for (int n = key_count; n < count; n++) {
+                const route_t* r = &routes[n];
+                if (r->source != source)
+                    continue;
+                int value = route_value(r, x, last_value[n]);
+                if (value != last_value[n]) {
+                    send(r, value, ROUTE_CHANNEL_MASTER, 0, false);
+                    last_value[n] = value;
+                }
+            }
+        }
+
+        /*
+         * Send the motion sensor routes. Only the values that changed are
+         * sent, and the ones that didn't for MOTION_REFRESH_TIME. When USB is
+         * busy the rest is left for the next message, which is compared to
+         * the values that were sent.
+         * Motion CCs go to USB only, also when the serial port is used for
+         * MIDI: at 31250 baud a 14 bit update of all axes takes 14 ms, so
+         * serial MIDI is left to the notes and isn't capped here.
+         */
+        void send_motion(const float* src) {
+            systime_t now = chVTGetSystemTime();
+            int room = MOTION_USB_ROOM - midi_usb_MidiGetOutputBufferPending();
+            for (int n = key_count; n < count; n++) {
+                const route_t* r = &routes[n];
+                if (r->source < ROUTE_SRC_ACC_X || r->source > ROUTE_SRC_ROT_Z)
+                    continue;
+                int size = r->dest == ROUTE_DST_CC14 ? 8 : 4; // bytes on USB
+                if (room < size)
+                    break;
+                int* last = &last_value[n];
+                int value = route_value(r, src[r->source - ROUTE_SRC_ACC_X], *last);
+                int change = value - *last;
+                bool changed = r->dest == ROUTE_DST_CC14
+                               ? change > MOTION_DEADBAND_14BIT || change < -MOTION_DEADBAND_14BIT
+                               : change != 0;
+                if (!changed && (systime_t)(now - last_time[n]) < MOTION_REFRESH_TIME)
+                    continue;
+                send(r, value, ROUTE_CHANNEL_MASTER, 0, true);
+                *last = value;
+                last_time[n] = now;
+                room -= size;
+            }
+        }
+
+    private:
+        route_t* add(int source, int dest, int number, int channel) {
+            route_t* r = &routes[count++];
+            route_init(r, source, ROUTE_CURVE_LINEAR, dest, number, channel);
+            return r;
+        }
+
+        void add_pressure(int cfg) {
+            if (cfg == CFG_POLY_PRESSURE) {
+                add(ROUTE_SRC_PRES, ROUTE_DST_POLY_PRESSURE, 0, ROUTE_CHANNEL_KEY);
+            } else if (cfg == CFG_CHANNEL_PRESSURE) {
+                add(ROUTE_SRC_PRES, ROUTE_DST_CHANNEL_PRESSURE, 0, ROUTE_CHANNEL_KEY);
+            } else if (cfg < 120) {
+                add(ROUTE_SRC_PRES, ROUTE_DST_CC, cfg, ROUTE_CHANNEL_KEY);
+            }
+        }
+
+        void add_preset(bool key) {
+            for (int n = 0; n < preset_count; n++) {
+                if ((preset_routes[n].source < ROUTE_KEY_SOURCES) == key) {
+                    routes[count++] = preset_routes[n];
                 }
-                last_value = value;
+            }
+        }
+
+        /*
+         * Send a route on its channel, channel is the one of the key or
+         * ROUTE_CHANNEL_MASTER for global sources. The master channel is
+         * only used by routes that ask for it.
+         */
+        void send(const route_t* r, int value, int channel, int note, bool usb_only) {
+            int ch = r->channel == ROUTE_CHANNEL_KEY ? channel : r->channel;
+            if (ch == ROUTE_CHANNEL_MASTER) {
+                ch = midi_master_channel();
+            }
+            switch (r->dest) {
+                case ROUTE_DST_CC:
+                    send3(usb_only, MIDI_CONTROL_CHANGE | ch, r->number, value);
+                    break;
+                case ROUTE_DST_CC14:
+                    send3(usb_only, MIDI_CONTROL_CHANGE | ch, r->number | MIDI_C_LSB, value & 0x7f);
+                    send3(usb_only, MIDI_CONTROL_CHANGE | ch, r->number, value >> 7);
+                    break;
+                case ROUTE_DST_PITCH_BEND:
+                    send3(usb_only, MIDI_PITCH_BEND | ch, value & 0x7f, value >> 7);
+                    break;
+                case ROUTE_DST_CHANNEL_PRESSURE:
+                    if (usb_only) {
+                        midi_usb_MidiSend2(1, MIDI_CHANNEL_PRESSURE | ch, value);
+                    } else {
+                        MidiSend2(MIDI_CHANNEL_PRESSURE | ch, value);
+                    }
+                    break;
+                case ROUTE_DST_POLY_PRESSURE:
+                    send3(usb_only, MIDI_POLY_PRESSURE | ch, note, value);
+                    break;
+            }
+        }
+
+        void send3(bool usb_only, uint8_t b0, uint8_t b1, uint8_t b2) {
+            if (usb_only) {
+                midi_usb_MidiSend3(1, b0, b1, b2);
+            } else {
+                MidiSend3(b0, b1, b2);
             }
         }
 };
 
+MidiRoutes routes;
+
 class MotionSensor {
     public:
         int send_motion_time = 0;
-        int last_acc_x = INT32_MAX;
-        int last_acc_y = INT32_MAX;
-        int last_acc_z = INT32_MAX;
-        int last_acc_abs = INT32_MAX;
-        int last_rot_x = INT32_MAX;
-        int last_rot_y = INT32_MAX;
-        int last_rot_z = INT32_MAX;
 
         MotionSensor() {}
 
         void message(int* msg) {
-            int acc_x = msg[0];
-            int acc_y = msg[1];
-            int acc_z = msg[2];
-            int acc_abs = msg[3];
-            int rot_x = msg[4];
-            int rot_y = msg[5];
-            int rot_z = msg[6];
 #ifdef USE_MIDI_OUT
             if (config.send_motion_interval && (--send_motion_time <= 0)) {
                 send_motion_time = config.send_motion_interval;
-                if (config.send_motion_14bit) {
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    16|MIDI_C_LSB, acc_x&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    16, (64+(acc_x>>7))&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    17|MIDI_C_LSB, acc_y&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    17, (64+(acc_y>>7))&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    18|MIDI_C_LSB, acc_z&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    18, (64+(acc_z>>7))&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    19|MIDI_C_LSB, acc_abs&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    19, (acc_abs>>6)&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    80|MIDI_C_LSB, rot_x&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    80, (64+(rot_x>>7))&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    81|MIDI_C_LSB, rot_y&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    81, (64+(rot_y>>7))&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    82|MIDI_C_LSB, rot_z&0x7F);
-                    midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                    82, (64+(rot_z>>7))&0x7F);
-                } else {
-                    // for binary protocol the max is +/-8g, for MIDI max 2g feels better
-                    // -(1<<3) for rounding correctly
-                    int d; // calculate direction for hysteresis
-                    d = ((((last_acc_x-64)<<6) > acc_x)<<4)-(1<<3);
-                    acc_x = __USAT(64+((acc_x+(1<<5)+d)>>5), 7)&0x7F;
-                    d = ((((last_acc_y-64)<<6) > acc_y)<<4)-(1<<3);
-                    acc_y = __USAT(64+((acc_y+(1<<5)+d)>>5), 7)&0x7F;
-                    d = ((((last_acc_z-64)<<6) > acc_z)<<4)-(1<<3);
-                    acc_z = __USAT(64+((acc_z+(1<<5)+d)>>5), 7)&0x7F;
-                    d = (((last_acc_abs<<5) > acc_abs)<<3)-(1<<2);
-                    acc_abs = __USAT((acc_abs+(1<<4)+d)>>4, 7)&0x7F;
-                    d = ((((last_rot_x-64)<<6) > rot_x)<<5)-(1<<4);
-                    rot_x = __USAT(64+((rot_x+(1<<5)+d)>>6), 7)&0x7F;
-                    d = ((((last_rot_y-64)<<6) > rot_y)<<5)-(1<<4);
-                    rot_y = __USAT(64+((rot_y+(1<<5)+d)>>6), 7)&0x7F;
-                    d = ((((last_rot_z-64)<<6) > rot_z)<<5)-(1<<4);
-                    rot_z = __USAT(64+((rot_z+(1<<5)+d)>>6), 7)&0x7F;
-                    if (acc_x != last_acc_x) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           16, acc_x);
-                        last_acc_x = acc_x;
-                    }
-                    if (acc_y != last_acc_y) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           17, acc_y);
-                        last_acc_y = acc_y;
-                    }
-                    if (acc_z != last_acc_z) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           18, acc_z);
-                        last_acc_z = acc_z;
-                    }
-                    if (acc_abs != last_acc_abs) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           19, acc_abs);
-                        last_acc_abs = acc_abs;
-                    }
-                    if (rot_x != last_rot_x) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           80, rot_x);
-                        last_rot_x = rot_x;
-                    }
-                    if (rot_y != last_rot_y) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           81, rot_y);
-                        last_rot_y = rot_y;
-                    }
-                    if (rot_z != last_rot_z) {
-                        midi_usb_MidiSend3(1, MIDI_CONTROL_CHANGE,
-                                           82, rot_z);
-                        last_rot_z = rot_z;
-                    }
+                // for binary protocol the max is +/-8g, for MIDI max 2g feels better
+                float src[ROUTE_MOTION_SOURCES];
+                for (int n = 0; n < 4; n++) {
+                    src[n] = msg[n] * (1.0f / 2048.0f);
+                }
+                for (int n = 4; n < 7; n++) {
+                    src[n] = msg[n] * (1.0f / 4096.0f);
                 }
+                routes.send_motion(src);
             }
+#else
+            (void)msg;
 #endif
         }
 };
@@ -272,13 +390,10 @@ class Button {
         int midinote_base;
         float start_note_offset;
         float tuning_note_offset = 0.0f;
+        int tuning_key = 0;         // MIDI key for the key tuning, set at note on
+        float key_tuning = 0.0f;
         float pres;
         float vpres;
-        int last_pres = INT32_MAX;
-        int last_velo = INT32_MAX;
-        int last_rvelo = INT32_MAX;
-        int last_tilt = INT32_MAX;
-        int last_bend = INT32_MAX;
         int last_pitchbend = INT32_MAX;
         float but_x;
         float but_y;
@@ -307,6 +422,69 @@ class Button {
         }
 };
 
+/*
+ * Tunings parsed from the config store at boot, so switching tuning is a table
+ * copy instead of 64 key lookups. Tuning 0 is hard coded to 12tet.
+ */
+#define TUNINGCOUNT 9
+#define TUNING_MTS (-2) // cur_tuning for a tuning received as MIDI Tuning Standard SysEx
+
+typedef struct {
+    float notegen0;
+    float notegen1;
+    float note_offset;
+    int color;
+    float offsets[61]; // per button offset in semitones, in button_number_map order
+} tuning_t;
+
+static tuning_t tunings[TUNINGCOUNT];
+
+static void compile_tuning(int n, tuning_t* t) {
+    if (n == 0) {
+        t->notegen0 = 12.0f;
+        t->notegen1 = 7.0f;
+        t->note_offset = 0.0f;
+        t->color = 0x00aa00;
+        for (int k = 0; k < 61; k++) {
+            t->offsets[k] = 0.0f;
+        }
+        return;
+    }
+    float f;
+    CC_ALIGN(8) char key[] = "fT0fifth";
+    key[2] = '0' + n;
+    f = getConfigFloat(key);
+    if (f == CONFIG_UNDEFINED) f = 700.0f;
+    t->notegen1 = f / 100;
+    strset(key, 3, "oct  ");
+    f = getConfigFloat(key);
+    if (f == CONFIG_UNDEFINED) f = 1200.0f;
+    t->notegen0 = f / 100;
+    strset(key, 3, "off  ");
+    f = getConfigFloat(key);
+    if (f == CONFIG_UNDEFINED) f = 0.0f;
+    t->note_offset = f / 100;
+    for (int k = 0; k < 61; k++) {
+        put_button_name(k, &key[3]);
+        f = getConfigFloat(key);
+        if (f == CONFIG_UNDEFINED) f = 0.0f;
+        t->offsets[k] = f / 100;
+    }
+    key[0] = 'h';
+    strset(key, 3, "color");
+    t->color = getConfigHex(key);
+}
+
+/*
+ * Pitch of every button for the current tuning, without the octave offset at
+ * note on and the fine tuning offset note_offset, which are added per message.
+ */
+typedef struct {
+    float pitch[BUTTONCOUNT];   // tuning offset + generators
+    float key_tuning[MTS_KEYS]; // offset per MIDI key, taken at note on
+    float bend_scale;           // MIDI pitch bend per semitone
+} pitch_table_t;
+
 class Instrument {
     public:
         Button buttons[BUTTONCOUNT];
@@ -317,6 +495,7 @@ class Instrument {
         int tuning_color = 0x00aa00;
         int cur_tuning = 0;
         float tuning_note_offset = 0;
+        float key_tuning[MTS_KEYS] = {};
         float note_offset = 0;
         float start_note_offset = 62;
         float min_note_offset = 32;
@@ -327,16 +506,32 @@ class Instrument {
         int flipdir = 1;
         int last_button = 0;
         int master_button = -1;
+        PolyAggregate<BUTTONCOUNT> poly; // held buttons in single channel poly mode
         int transpose_button = -1;
         int transpose_button2 = -1;
         synth_interface_t* synth_interface;
-        int voicecount = VOICECOUNT;
+        int voicecount = MIDI_VOICECOUNT;
         int midi_channel_offset = 1;
         float midi_bend_range = 48.0;
+        // rebuilt into the inactive copy and then switched. The tables are
+        // only used with synth_lock held (control thread, main loop and
+        // PExReceive), which keeps a button message from seeing a mix of the
+        // old and the new tuning
+        pitch_table_t pitch_tables[2];
+        pitch_table_t* pitch_table = &pitch_tables[0];
+        // note handling for the MIDI mode and MIDI note mode, set by
+        // select_handler() so button_message doesn't check them every time.
+        // All handlers can be selected at run time, so all are linked in.
+        void (Instrument::*note_handler)(int but) = &Instrument::voice_message<MIDINOTE_MODE_DEFAULT>;
+        timer_wheel_t dead_notes;
+        wheel_timer_t dead_note_timers[BUTTONCOUNT];
         float bend_sensitivity = 1.0f;
         float y_sensitivity = 1.0f;
         float pres_sensitivity = 1.0f;
         float velo_sensitivity = 1.0f;
+        // response curves, shared by the internal synth and MIDI
+        curve_lut_t pres_curve;
+        curve_lut_t velo_curve;
         int midi_velo_offset = 0;
 
         Instrument(int* c0, int* c1, int n_buttons, synth_interface_t* si) {
@@ -359,7 +554,59 @@ class Instrument {
                 portamento_buttons[n] = -1;
             }
             synth_interface = si;
+            tw_init(&dead_notes, 0);
+            for (n = 0; n < BUTTONCOUNT; n++) {
+                tw_timer_init(&dead_note_timers[n], n);
+            }
             set_volume(volume_linear);
+            curve_lut_build(&pres_curve, 1.0f);
+            curve_lut_build(&velo_curve, 1.0f);
+            update_pitch_table();
+            select_handler();
+        }
+
+        /*
+         * Call after changing the generators, the per button tuning offsets,
+         * the layout or the MIDI pitch bend range.
+         */
+        void update_pitch_table(void) {
+            pitch_table_t* t = (pitch_table == &pitch_tables[0]) ? &pitch_tables[1] : &pitch_tables[0];
+            for (int n = 0; n < BUTTONCOUNT; n++) {
+                t->pitch[n] = buttons[n].tuning_note_offset +
+                              notegen0 * buttons[n].coord0 +
+                              notegen1 * buttons[n].coord1;
+            }
+            memcpy(t->key_tuning, key_tuning, sizeof(t->key_tuning));
+            t->bend_scale = 0x2000 / midi_bend_range;
+            pitch_table = t;
+        }
+
+        /*
+         * Call after changing config.midi_mode or config.midinote_mode.
+         */
+        void select_handler(void) {
+#ifdef USE_MIDI_OUT
+            if (config.midi_mode == MIDI_MODE_POLY) {
+                note_handler = &Instrument::poly_message;
+                return;
+            }
+#endif
+            switch (config.midinote_mode) {
+                case MIDINOTE_MODE_TUNING:
+                    note_handler = &Instrument::voice_message<MIDINOTE_MODE_TUNING>;
+                    break;
+                case MIDINOTE_MODE_BUTTON:
+                    note_handler = &Instrument::voice_message<MIDINOTE_MODE_BUTTON>;
+                    break;
+                default:
+                    note_handler = &Instrument::voice_message<MIDINOTE_MODE_DEFAULT>;
+                    break;
+            }
+        }
+
+        void set_bend_range(float range) {
+            midi_bend_range = range;
+            update_pitch_table();
         }
 
         void set_portamento(int p) {
@@ -426,6 +673,7 @@ class Instrument {
         void set_notegen1(float g) {
             // unset cur_tuning so the tuning will be reset on tuning switch
             cur_tuning = -1;
+            memset(key_tuning, 0, sizeof(key_tuning));
             // keep generator within syntonic continuum range
             notegen1 = clamp(g, 6.85714285714286f, 7.2f);
 
@@ -437,6 +685,7 @@ class Instrument {
             else if (notegen1 < 7.03)  {tuning_color = 0x555500;}
             else                       {tuning_color = 0xaa0000;}
 
+            update_pitch_table();
             update_leds();
         }
 
@@ -445,6 +694,7 @@ class Instrument {
                 int but = button_number_map[n];
                 buttons[but].tuning_note_offset = 0.0f;
             }
+            update_pitch_table();
         }
 
         void set_note_offsets(float* offsets, int n_buttons) {
@@ -462,6 +712,7 @@ class Instrument {
                     buttons[but].tuning_note_offset = offsets[(n + 7) % 17] / 100;
                 }
             }
+            update_pitch_table();
         }
 
         void load_tuning(int n) {
@@ -469,42 +720,64 @@ class Instrument {
                 led_rgb(tuning_color);
                 return;
             }
-            if (n == 0) {
-                // tuning 0 hard coded to 12tet
+            if (n < 0 || n >= TUNINGCOUNT) return;
+            const tuning_t* t = &tunings[n];
+            notegen0 = t->notegen0;
+            notegen1 = t->notegen1;
+            note_offset = tuning_note_offset = t->note_offset;
+            for (int k = 0; k < 61; k++) {
+                buttons[button_number_map[k]].tuning_note_offset = t->offsets[k];
+            }
+            memset(key_tuning, 0, sizeof(key_tuning));
+            update_pitch_table();
+            tuning_color = t->color;
+            if (n == 0) update_leds(); // octave leds, as set_notegen1() did for 12tet
+            led_rgb(tuning_color);
+            cur_tuning = n;
+        }
+
+        /*
+         * Tuning per MIDI key from MIDI Tuning Standard messages, on top of
+         * 12tet. Held notes keep their pitch, unless the change is real-time.
+         */
+        void set_key_tuning(const float* keys, bool realtime) {
+            if (cur_tuning != TUNING_MTS) {
                 notegen0 = 12.0f;
-                set_notegen1(7.0f);
-                reset_note_offsets();
+                notegen1 = 7.0f;
                 note_offset = tuning_note_offset = 0.0f;
-                led_rgb(tuning_color);
-                cur_tuning = n;
-                return;
+                for (int k = 0; k < 61; k++) {
+                    buttons[button_number_map[k]].tuning_note_offset = 0.0f;
+                }
+                cur_tuning = TUNING_MTS;
+                tuning_color = tunings[0].color;
+                update_leds();
             }
-            float f;
-            CC_ALIGN(8) char key[] = "fT0fifth";
-            key[2] = '0' + n;
-            f = getConfigFloat(key);
-            if (f == CONFIG_UNDEFINED) f = 700.0f;
-            notegen1 = f / 100;
-            strset(key, 3, "oct  ");
-            f = getConfigFloat(key);
-            if (f == CONFIG_UNDEFINED) f = 1200.0f;
-            notegen0 = f / 100;
-            strset(key, 3, "off  ");
-            f = getConfigFloat(key);
-            if (f == CONFIG_UNDEFINED) f = 0.0f;
-            note_offset = tuning_note_offset = f / 100;
-            for (int n = 0; n < 61; n++) {
-                put_button_name(n, &key[3]);
-                int but = button_number_map[n];
-                f = getConfigFloat(key);
-                if (f == CONFIG_UNDEFINED) f = 0.0f;
-                buttons[but].tuning_note_offset = f / 100;
+            memcpy(key_tuning, keys, sizeof(key_tuning));
+            update_pitch_table();
+            if (realtime) {
+                for (int n = 0; n < BUTTONCOUNT; n++) {
+                    buttons[n].key_tuning = key_tuning[buttons[n].tuning_key];
+                }
             }
-            key[0] = 'h';
-            strset(key, 3, "color");
-            tuning_color = getConfigHex(key);
-            led_rgb(tuning_color);
-            cur_tuning = n;
+        }
+
+        /*
+         * The current tuning with the key tuning as button offsets, at the
+         * current octave.
+         */
+        void get_tuning(tuning_t* t) {
+            t->notegen0 = notegen0;
+            t->notegen1 = notegen1;
+            t->note_offset = tuning_note_offset;
+            for (int k = 0; k < 61; k++) {
+                int but = button_number_map[k];
+                t->offsets[k] = buttons[but].tuning_note_offset + key_tuning[midi_key(but)];
+            }
+        }
+
+        int midi_key(int but) {
+            int key = buttons[but].midinote_base + (int)(start_note_offset + 0.5);
+            return clamp(key, 0, MTS_KEYS - 1);
         }
 
         /* Rotate the layout 180 degrees */
@@ -516,6 +789,7 @@ class Instrument {
                 // invert midi note number
                 buttons[n].midinote_base = -buttons[n].midinote_base;
             }
+            update_pitch_table();
         }
 
         void button_message(int but, float* msg) {
@@ -539,6 +813,7 @@ class Instrument {
                     old_angle = -1000.0f;
                     nudged = false;
                     if (!altmode) update_leds();
+                    save_settings();
                 }
                 // handle knob mode
                 float a = pow2(buttons[but].but_x) + pow2(buttons[but].but_y);
@@ -590,141 +865,86 @@ class Instrument {
                 return;
             }
 
-            if (config.midi_mode == MIDI_MODE_POLY) {
-                // in single channel poly mode just send out the notes on a single channel,
-                // skip the whole channel assignment stuff.
+            (this->*note_handler)(but);
+        }
+
 #ifdef USE_MIDI_OUT
-                if (buttons[but].pres > 0.0) {
-                    // Note on detection
-                    if (buttons[but].state == STATE_OFF) {
-                        buttons[but].state = STATE_ON;
-                        buttons[but].midinote = buttons[but].midinote_base + (int)(start_note_offset + 0.5);
-                        buttons[but].start_note_offset = start_note_offset;
-                        // multiply velo by 2 to cover full midi range on note on
-                        int velo = midi_velo_offset + buttons[but].vpres * velo_sensitivity * 128 * 2;
-                        velo = clamp(velo, 1, 127);
-                        MidiSend3(MIDI_NOTE_ON | midi_channel_offset,
-                                        buttons[but].midinote, velo);
-
-                        master_button = but;
-                    }
-                    if (master_button == -1) {
-                        master_button = but;
-                    }
+        /*
+         * In single channel poly mode just send out the notes on a single channel,
+         * skip the whole channel assignment stuff.
+         */
+        void poly_message(int but) {
+            if (buttons[but].pres > 0.0) {
+                // Note on detection
+                if (buttons[but].state == STATE_OFF) {
+                    buttons[but].state = STATE_ON;
+                    buttons[but].midinote = buttons[but].midinote_base + (int)(start_note_offset + 0.5);
+                    buttons[but].start_note_offset = start_note_offset;
+                    // multiply velo by 2 to cover full midi range on note on
+                    int velo = midi_velo_offset + key_velo(buttons[but].vpres) * 128 * 2;
+                    velo = clamp(velo, 1, 127);
+                    MidiSend3(MIDI_NOTE_ON | midi_channel_offset,
+                                    buttons[but].midinote, velo);
 
-                    if (config.midi_pres == CFG_POLY_PRESSURE) {
-                        float presf = buttons[but].pres * pres_sensitivity;
-                        float d; // calculate direction for hysteresis
-                        d = (buttons[but].last_pres > (presf)) * 0.5 - 0.25;
-                        int pres = presf * 127 + 0.5 + d;
-                        pres = clamp(pres, 0, 127);
-
-                        if (pres != buttons[but].last_pres) {
-                            MidiSend3(MIDI_POLY_PRESSURE | midi_channel_offset,
-                                            buttons[but].midinote, pres);
-                            buttons[but].last_pres = pres;
-                        }
-                    }
+                    master_button = but;
+                }
+                if (master_button == -1) {
+                    master_button = but;
+                }
+                poly.update(but, buttons[but].state == STATE_ON, buttons[but].pres,
+                            buttons[but].but_x, buttons[but].but_y);
 
-                    if (but == master_button) {
-                        // reduce pres, bend and tilt of all pressed buttons to single values
-                        float presf = 0.0f;
-                        float x = 0.0f;
-                        float xw = 0.0f;
-                        float y = 0.0f;
-                        float yw = 0.0f;
-                        for (int i=0; i<BUTTONCOUNT; i++) {
-                            if (buttons[i].state == STATE_ON) {
-                                if (buttons[i].pres > presf) presf = buttons[i].pres;
-                                float w = pow2(buttons[i].but_x);
-                                x += w * buttons[i].but_x;
-                                xw += w;
-                                w = pow2(buttons[i].but_y);
-                                y += w * buttons[i].but_y;
-                                yw += w;
-                            }
-                        }
-                        if (xw > 0.0000001f) x /= xw;
-                        if (yw > 0.0000001f) y /= yw;
-
-                        float d; // calculate direction for hysteresis
-
-                        if (config.midi_pres != CFG_POLY_PRESSURE) {
-                            d = (buttons[0].last_pres > (presf)) * 0.5 - 0.25;
-                            int pres = presf * 127 + 0.5 + d;
-                            pres = clamp(pres, 0, 127);
-                            if (pres != buttons[0].last_pres) {
-                                if (config.midi_pres == CFG_CHANNEL_PRESSURE) {
-                                    MidiSend2(MIDI_CHANNEL_PRESSURE | midi_channel_offset,
-                                                    pres);
-                                } else if (config.midi_pres < 120) {
-                                    MidiSend3(MIDI_CONTROL_CHANGE | midi_channel_offset,
-                                                    config.midi_pres, pres);
-                                }
-                                buttons[0].last_pres = pres;
-                            }
-                        }
-                        if (config.midi_x == CFG_PITCH_BEND) {
-                            x = pow3(x) * bend_sensitivity;
-                            d = (buttons[0].last_bend > (0x2000 + x * 0x2000)) * 0.5 - 0.25;
-                            int bend = 0x2000 + x * 0x2000 + 0.5 + d;
-                            bend = clamp(bend, 0, 0x3fff);
-                            if (bend != buttons[0].last_bend) {
-                                MidiSend3(MIDI_PITCH_BEND | midi_channel_offset,
-                                          bend & 0x7f, (bend >> 7) & 0x7f);
-                                buttons[0].last_bend = bend;
-                            }
-                        } else if (config.midi_x < 120) {
-                            d = (buttons[0].last_bend > (64 + x * 64)) * 0.5 - 0.25;
-                            int bend = 64 + x * 64 + 0.5 + d;
-                            bend = clamp(bend, 0, 127);
-                            if (bend != buttons[0].last_bend) {
-                                MidiSend3(MIDI_CONTROL_CHANGE | midi_channel_offset,
-                                                config.midi_x, bend);
-                                buttons[0].last_bend = bend;
-                            }
-                        }
-                        y = y * y_sensitivity;
-                        d = (buttons[0].last_tilt > (64 + y * 64)) * 0.5 - 0.25;
-                        int tilt = 64 + y * 64 + 0.5 + d;
-                        tilt = clamp(tilt, 0, 127);
-                        if (tilt != buttons[0].last_tilt) {
-                            if (config.midi_y < 120 && y_sensitivity != 0.0f) {
-                                MidiSend3(MIDI_CONTROL_CHANGE | midi_channel_offset,
-                                                config.midi_y, tilt);
-                            }
-                            buttons[0].last_tilt = tilt;
-                        }
-                    }
+                float src[ROUTE_KEY_SOURCES];
+                key_sources(but, src);
+                routes.send_key(src, but, midi_channel_offset, buttons[but].midinote,
+                                ROUTE_SELECT_POLY_PRESSURE);
 
-                } else { // Note off
-                    buttons[but].state = STATE_OFF;
-                    int velo = 0 - buttons[but].vpres * velo_sensitivity * 128 * 2;
-                    velo = clamp(velo, 0, 127);
-                    MidiSend3(MIDI_NOTE_OFF | midi_channel_offset,
-                                    buttons[but].midinote, velo);
-                    if (but == master_button) {
-                        master_button = -1;
-                    }
+                if (but == master_button) {
+                    // reduce pres, bend and tilt of all pressed buttons to single values
+                    float x = poly.x();
+                    src[ROUTE_SRC_PRES] = key_pres(poly.pres_max);
+                    src[ROUTE_SRC_X] = x;
+                    src[ROUTE_SRC_BEND] = pow3(x) * bend_sensitivity;
+                    src[ROUTE_SRC_Y] = clamp(poly.y() * y_sensitivity, -1.0f, 1.0f);
+                    routes.send_key(src, BUTTONCOUNT, midi_channel_offset, buttons[but].midinote,
+                                    ROUTE_SELECT_CHANNEL);
+                }
+
+            } else { // Note off
+                buttons[but].state = STATE_OFF;
+                poly.update(but, false, 0.0f, 0.0f, 0.0f);
+                int velo = 0 - key_velo(buttons[but].vpres) * 128 * 2;
+                velo = clamp(velo, 0, 127);
+                MidiSend3(MIDI_NOTE_OFF | midi_channel_offset,
+                                buttons[but].midinote, velo);
+                if (but == master_button) {
+                    master_button = -1;
                 }
-                return;
-#endif
             }
+        }
+#endif
 
+        /*
+         * Voice per MIDI channel for MPE and mono mode, and for the internal synth.
+         */
+        template<int MIDINOTE_MODE>
+        void voice_message(int but) {
             // Note on detection
             if (buttons[but].state == STATE_OFF && buttons[but].pres > 0.0) {
-                // calculate midinote only at note on
-                if (config.midinote_mode == MIDINOTE_MODE_DEFAULT) {
+                // calculate midinote only at note on, MIDINOTE_MODE is a constant
+                if (MIDINOTE_MODE == MIDINOTE_MODE_DEFAULT) {
                     buttons[but].midinote = buttons[but].midinote_base + (int)(start_note_offset + 0.5);
-                } else if (config.midinote_mode == MIDINOTE_MODE_TUNING) {
+                } else if (MIDINOTE_MODE == MIDINOTE_MODE_TUNING) {
                     buttons[but].midinote = (int)(notegen0 * buttons[but].coord0 +
                                                   notegen1 * buttons[but].coord1 +
                                                   start_note_offset +
                                                   note_offset + 0.5);
-                } else if (config.midinote_mode == MIDINOTE_MODE_BUTTON) {
+                } else if (MIDINOTE_MODE == MIDINOTE_MODE_BUTTON) {
                     buttons[but].midinote = 17 * buttons[but].coord0 + 10 * buttons[but].coord1 + 30;
                 }
                 buttons[but].start_note_offset = start_note_offset;
+                buttons[but].tuning_key = midi_key(but);
+                buttons[but].key_tuning = pitch_table->key_tuning[buttons[but].tuning_key];
 
                 if (portamento) {
                     if (master_button == -1) {
@@ -759,11 +979,12 @@ class Instrument {
 
             if (buttons[but].state) {
                 // calculate note pitch
-                buttons[but].note = buttons[but].start_note_offset + buttons[but].tuning_note_offset +
-                                    notegen0 * buttons[but].coord0 +
-                                    notegen1 * buttons[but].coord1
-                                    + note_offset;
+                buttons[but].note = buttons[but].start_note_offset + pitch_table->pitch[but]
+                                    + buttons[but].key_tuning + note_offset;
                 buttons[but].timer = chVTGetSystemTime() + CLEAR_TIMER;
+                if (!tw_pending(&dead_note_timers[but])) {
+                    tw_schedule(&dead_notes, &dead_note_timers[but], buttons[but].timer);
+                }
 
                 if (but == master_button) {
                     // calculate average of portamento buttons
@@ -897,7 +1118,7 @@ class Instrument {
                 buttons[but].state = STATE_OFF;
 
 #ifdef USE_MIDI_OUT
-                int velo = 0 - buttons[but].vpres * velo_sensitivity * 128 * 2;
+                int velo = 0 - key_velo(buttons[but].vpres) * 128 * 2;
                 velo = clamp(velo, 0, 127);
                 MidiSend3(MIDI_NOTE_OFF | (midi_channel_offset + buttons[but].voice),
                                    buttons[but].midinote, velo);
@@ -906,22 +1127,30 @@ class Instrument {
         }
 
         int get_voice(int but) {
+            // the last used voice if the button still has it, else an empty
+            // one, else the voice with minimum approximated volume
             int voice = -1;
+            int empty = -1;
             float min_vol = buttons[but].vol;// * 0.9 - 0.05; // * factor for hysteresis
+            int quietest = -1;
             for (int n = 0; n < voicecount; n++) {
-                // check if empty or last used voice is available
-                if (voices[n] == -1 || voices[n] == but)
-                {
+                if (voices[n] == but) {
                     voice = n;
                     break;
                 }
-                // else find voice with minimum approximated volume
+                if (voices[n] == -1) {
+                    if (empty < 0)
+                        empty = n;
+                    continue;
+                }
                 float vol = buttons[voices[n]].vol;
                 if (vol < min_vol) {
                     min_vol = vol;
-                    voice = n;
+                    quietest = n;
                 }
             }
+            if (voice < 0)
+                voice = empty >= 0 ? empty : quietest;
             if (voice >= 0) {
                 // take over the voice
                 if (voices[voice] >= 0) {
@@ -936,12 +1165,11 @@ class Instrument {
 
 #ifdef USE_MIDI_OUT
                 // multiply velo by 2 to cover full midi range on note on
-                int velo = midi_velo_offset + buttons[but].vpres * velo_sensitivity * 128 * 2;
+                int velo = midi_velo_offset + key_velo(buttons[but].vpres) * 128 * 2;
                 velo = clamp(velo, 1, 127);
 
                 MidiSend3(MIDI_NOTE_ON | (midi_channel_offset + buttons[but].voice),
                                    buttons[but].midinote, velo);
-                buttons[but].last_velo = velo;
 #endif
 
                 return 0;
@@ -949,10 +1177,36 @@ class Instrument {
             return -1;
         }
 
+        float key_pres(float pres) {
+            return curve_lut(&pres_curve, pres) * pres_sensitivity;
+        }
+
+        float key_velo(float vpres) {
+            return curve_lut_signed(&velo_curve, vpres) * velo_sensitivity;
+        }
+
+        /*
+         * Route sources of a button
+         */
+        void key_sources(int but, float* src) {
+            float velof = key_velo(buttons[but].vpres);
+            src[ROUTE_SRC_PRES] = key_pres(buttons[but].pres);
+            src[ROUTE_SRC_X] = buttons[but].but_x;
+            src[ROUTE_SRC_BEND] = bend_sensitivity * pow3(buttons[but].but_x);
+            src[ROUTE_SRC_Y] = clamp(buttons[but].but_y * y_sensitivity, -1.0f, 1.0f);
+            src[ROUTE_SRC_VELO] = max(velof, 0.0f);
+            src[ROUTE_SRC_RVELO] = max(-velof, 0.0f);
+        }
+
+        /*
+         * Send the state of a button to its voice. There are no MIDI mode
+         * checks here: the differences between the modes are in the route
+         * table, which only has the routes of the current mode.
+         */
         void update_voice(int but) {
             float pb = bend_sensitivity * pow3(buttons[but].but_x);
-            float presf = buttons[but].pres * pres_sensitivity;
-            float velof = buttons[but].vpres * velo_sensitivity;
+            float presf = key_pres(buttons[but].pres);
+            float velof = key_velo(buttons[but].vpres);
             float y = clamp(buttons[but].but_y * y_sensitivity, -1.0f, 1.0f);
 #ifdef USE_INTERNAL_SYNTH
             int voice = buttons[but].voice;
@@ -961,108 +1215,59 @@ class Instrument {
             *(synth_interface->vpres[voice]) = velof;
             *(synth_interface->but_x[voice]) = buttons[but].but_x;
             *(synth_interface->but_y[voice]) = y;
+            synth_voice_publish(voice);
 #endif
 
 #ifdef USE_MIDI_OUT
             float d; // calculate direction for hysteresis
-            // TODO: fix hysteresis!
-            // TODO: last_... values per midi channel instead of per button
-            d = (buttons[but].last_pres > (presf)) * 0.5 - 0.25;
-            int pres = presf * 127 + 0.5 + d;
-            pres = clamp(pres, 0, 127);
-
-            d = (buttons[but].last_tilt > (64 + y * 64)) * 0.5 - 0.25;
-            int tilt = 64 + y * 64 + 0.5 + d;
-            tilt = clamp(tilt, 0, 127);
+            float src[ROUTE_KEY_SOURCES];
+            key_sources(but, src);
+            int channel = midi_channel_offset + buttons[but].voice;
 
             pb = (pb
                 + buttons[but].note - buttons[but].midinote)
-                * (0x2000 / midi_bend_range) + 0x2000;
+                * pitch_table->bend_scale + 0x2000;
             d = (buttons[but].last_pitchbend > pb) * 0.5 - 0.25;
             int pitchbend = pb + 0.5 + d;
             pitchbend = clamp(pitchbend, 0, 0x3fff);
 
             // pitchbend is also used for tuning and glissando
             if (pitchbend != buttons[but].last_pitchbend) {
-                MidiSend3(MIDI_PITCH_BEND | (midi_channel_offset + buttons[but].voice),
+                MidiSend3(MIDI_PITCH_BEND | channel,
                                    pitchbend & 0x7f, (pitchbend >> 7) & 0x7f);
                 buttons[but].last_pitchbend = pitchbend;
             }
-            if (pres != buttons[but].last_pres) {
-                if (config.mpe_pres == CFG_CHANNEL_PRESSURE) {
-                    MidiSend2(MIDI_CHANNEL_PRESSURE | (midi_channel_offset + buttons[but].voice),
-                                    pres);
-                } else if (config.mpe_pres < 120) {
-                    MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                    config.mpe_pres, pres);
-                }
-                buttons[but].last_pres = pres;
-            }
-            if (config.mpe_x < 120) {
-                int bend = 64.5 + buttons[but].but_x * 64;
-                bend = clamp(bend, 0, 127);
-                if (bend != buttons[but].last_bend) {
-                    MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                    config.mpe_x, bend);
-                    buttons[but].last_bend = bend;
-                }
-            }
-            if (tilt != buttons[but].last_tilt) {
-                if (config.mpe_y < 120) {
-                    MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                    config.mpe_y, tilt);
-                }
-                buttons[but].last_tilt = tilt;
-            }
-            if (config.mpe_contvelo < 120) {
-                // TODO: hysteresis for continuous velocity
-                // TODO: make contvelo CC configurable
-                if (velof > 0) {
-                    int velo = 0 + velof * 256;
-                    velo = clamp(velo, 0, 127);
-                    if (velo != buttons[but].last_velo) {
-                        MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                        73, velo);
-                        buttons[but].last_velo = velo;
-                    }
-                    if (buttons[but].last_rvelo > 0) {
-                        MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                        72, 0);
-                        buttons[but].last_rvelo = 0;
-                    }
-                } else {
-                    int rvelo = 0 - velof * 256;
-                    rvelo = clamp(rvelo, 0, 127);
-                    if (rvelo != buttons[but].last_rvelo) {
-                        MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                        72, rvelo);
-                        buttons[but].last_rvelo = rvelo;
-                    }
-                    if (buttons[but].last_velo > 0) {
-                        MidiSend3(MIDI_CONTROL_CHANGE | (midi_channel_offset + buttons[but].voice),
-                                        73, 0);
-                        buttons[but].last_velo = 0;
-                    }
-                }
-            }
+            // TODO: last values per midi channel instead of per button
+            routes.send_key(src, but, channel, buttons[but].midinote, ROUTE_SELECT_ALL);
 #endif
         }
 
+        /*
+         * Release voices of buttons that didn't send a message for CLEAR_TIMER,
+         * only the dead note timers that expired are looked at.
+         */
         void clear_dead_notes(void) {
-            systime_t now = chVTGetSystemTime();
+            tw_advance(&dead_notes, chVTGetSystemTime(), dead_note, this);
+        }
 
-            for (int n = 0; n < voicecount; n++) {
-                if (voices[n] >= 0 && buttons[voices[n]].state == STATE_ON
-                    && buttons[voices[n]].timer < now)
-                {
-                    release_voice(voices[n]);
-                    #ifdef USE_INTERNAL_SYNTH
-                    *(synth_interface->pres[n])  = 0.0;
-                    *(synth_interface->vpres[n]) = 0.0;
-                    *(synth_interface->but_x[n]) = 0.0;
-                    *(synth_interface->but_y[n]) = 0.0;
-                    #endif
-                }
+        static void dead_note(void* arg, timer_wheel_t* w, wheel_timer_t* t) {
+            Instrument* in = (Instrument*)arg;
+            int but = t->id;
+            // the timer is moved here instead of on every message
+            if ((int32_t)(in->buttons[but].timer - w->now) > 0) {
+                tw_schedule(w, t, in->buttons[but].timer);
+                return;
+            }
+            int n = in->buttons[but].voice;
+            if (in->buttons[but].state == STATE_ON && n >= 0 && in->voices[n] == but) {
+                in->release_voice(but);
+                #ifdef USE_INTERNAL_SYNTH
+                *(in->synth_interface->pres[n])  = 0.0;
+                *(in->synth_interface->vpres[n]) = 0.0;
+                *(in->synth_interface->but_x[n]) = 0.0;
+                *(in->synth_interface->but_y[n]) = 0.0;
+                synth_voice_publish(n);
+                #endif
             }
         }
 
@@ -1098,7 +1303,12 @@ Instrument dis(c0_dis, c1_dis, BUTTONCOUNT, NULL);
 #endif
 MotionSensor motion;
 
-MidiParam pedal(MIDI_C_DAMPER);
+int midi_master_channel(void) {
+    if (config.midi_mode == MIDI_MODE_MPE && dis.midi_channel_offset > 0) {
+        return dis.midi_channel_offset - 1;
+    }
+    return dis.midi_channel_offset;
+}
 
 void int2float(int *msg, float *fmsg, int n) {
     int c;
@@ -1131,13 +1341,13 @@ int synth_message(int size, int* msg) {
             // Pedal
             int2float(msg, fmsg, size);
             *(dis.synth_interface->pedal) = fmsg[0];
-            pedal.send(msg[0]>>4, 0);//dis.midi_channel_offset);
+            routes.send_global(ROUTE_SRC_PEDAL, fmsg[0]);
         }
         else if (id == IDC_PEDAL_1) {
             // Switch pedal 1 (tip)
             int val = config.pedal_sw1_values[msg[0]>0];
             *(dis.synth_interface->pedal) = (float)val/127;
-            pedal.send(val*4, 0);//dis.midi_channel_offset);
+            routes.send_global(ROUTE_SRC_PEDAL, (float)val/127);
         }
         else if (id == IDC_PEDAL_2) {
             // Switch pedal 2 (ring)
@@ -1195,201 +1405,272 @@ int synth_message(int size, int* msg) {
     return 0;
 }
 
-void load_preset(int n) {
-    int i;
-    float f;
-    const char* s;
-    bool sendcfg = false;
+/*
+ * Presets parsed from the config store at boot. Fields that are not set or out
+ * of range in the config are stored as PRESET_UNSET and left untouched on load.
+ */
+#define PRESETCOUNT 8
+#define PRESET_UNSET (-1)
+#define PRESET_UNSET_F ((float)CONFIG_UNDEFINED)
+
+typedef struct {
+    uint32_t color;
+    int message_interval;
+    int send_motion_interval;
+    int midi_mode;
+    int midinote_mode;
+    int jack2_mode;
+    int engine;
+    int tuning;
+    int pres;
+    int x;
+    int y;
+    int contvelo;
+    int channel;
+    int bend_range;
+    int voicecount;
+    int velo_offset;
+    int program;
+    float note_offset;
+    float zero_offset;
+    float bend_sensitivity;
+    float pres_sensitivity;
+    float velo_sensitivity;
+    float y_sensitivity;
+    float pres_curve;
+    float velo_curve;
+    float volume;
+    route_t routes[PRESET_ROUTES];
+    int route_count;
+} preset_t;
+
+static preset_t presets[PRESETCOUNT];
+
+static int preset_int(const char* key, int low, int high) {
+    int i = getConfigInt(key);
+    return (i >= low && i <= high) ? i : PRESET_UNSET;
+}
+
+static float preset_float(const char* key, float low, float high) {
+    float f = getConfigFloat(key);
+    return (f >= low && f <= high) ? f : PRESET_UNSET_F;
+}
+
+static void compile_preset(int n, preset_t* p) {
+    char s[8];
     CC_ALIGN(8) char key[] = "hP0color";
     key[2] = '0' + n;
-    uint32_t led = getConfigHex(key);
-    led_rgb(led);
+    p->color = getConfigHex(key);
 
     key[0] = 'i';
     strset(key, 3, "Mint ");
-    i = getConfigInt(key);
-    if (i >= 1 && i <= 127) {
-        config.message_interval = i;
-    }
-
+    p->message_interval = preset_int(key, 1, 127);
     strset(key, 3, "Mmint");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
-        config.send_motion_interval = i;
-    }
+    p->send_motion_interval = preset_int(key, 0, 127);
 
     key[0] = 's';
     strset(key, 3, "Mmode");
-    s = getConfigSetting(key);
+    getConfigSetting(key, s);
+    p->midi_mode = PRESET_UNSET;
     if (cmp8(s, "mpe     ")) {
-        set_midi_mode(MIDI_MODE_MPE);
-        sendcfg = true;
+        p->midi_mode = MIDI_MODE_MPE;
     } else if (cmp8(s, "normal  ")) {
-        set_midi_mode(MIDI_MODE_POLY);
-        sendcfg = true;
+        p->midi_mode = MIDI_MODE_POLY;
     } else if (cmp8(s, "mono    ")) {
-        set_midi_mode(MIDI_MODE_MONO);
-        sendcfg = true;
+        p->midi_mode = MIDI_MODE_MONO;
     }
 
     strset(key, 3, "Mnote");
-    s = getConfigSetting(key);
+    getConfigSetting(key, s);
+    p->midinote_mode = PRESET_UNSET;
     if (cmp8(s, "default ")) {
-        config.midinote_mode = MIDINOTE_MODE_DEFAULT;
+        p->midinote_mode = MIDINOTE_MODE_DEFAULT;
     } else if (cmp8(s, "tuning  ")) {
-        config.midinote_mode = MIDINOTE_MODE_TUNING;
+        p->midinote_mode = MIDINOTE_MODE_TUNING;
     } else if (cmp8(s, "button  ")) {
-        config.midinote_mode = MIDINOTE_MODE_BUTTON;
+        p->midinote_mode = MIDINOTE_MODE_BUTTON;
     }
 
     strset(key, 3, "jack2");
-    s = getConfigSetting(key);
+    getConfigSetting(key, s);
+    p->jack2_mode = PRESET_UNSET;
     if (cmp8(s, "pedal_ex")) {
-        aux_jack_switch_mode_setting(JACK2_MODE_PEDAL_EXPRESSION);
+        p->jack2_mode = JACK2_MODE_PEDAL_EXPRESSION;
     } else if (cmp8(s, "pedal_sw")) {
-        aux_jack_switch_mode_setting(JACK2_MODE_PEDAL_SWITCH);
+        p->jack2_mode = JACK2_MODE_PEDAL_SWITCH;
     } else if (cmp8(s, "midi    ")) {
-        aux_jack_switch_mode_setting(JACK2_MODE_MIDI);
+        p->jack2_mode = JACK2_MODE_MIDI;
     } else if (cmp8(s, "linein  ")) {
-        aux_jack_switch_mode_setting(JACK2_MODE_LINEIN);
+        p->jack2_mode = JACK2_MODE_LINEIN;
     } else if (cmp8(s, "auto    ")) {
-        aux_jack_switch_mode_setting(JACK2_MODE_AUTODETECT);
+        p->jack2_mode = JACK2_MODE_AUTODETECT;
     }
 
+#ifdef USE_INTERNAL_SYNTH
+    strset(key, 3, "synth");
+    getConfigSetting(key, s);
+    p->engine = synth_find_engine(s);
+#endif
+
     key[0] = 'i';
     strset(key, 3, "tunin");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 8) {
-        dis.load_tuning(i);
-        config.message_interval = i;
-    }
+    p->tuning = preset_int(key, 0, TUNINGCOUNT - 1);
 
     key[0] = 'f';
     strset(key, 3, "Toff ");
-    f = getConfigFloat(key);
-    if (f >= -4800.0f && f <= 4800.0f) {
-        dis.note_offset = dis.tuning_note_offset + f / 100.0f;
-    }
+    p->note_offset = preset_float(key, -4800.0f, 4800.0f);
+    if (p->note_offset != PRESET_UNSET_F) p->note_offset /= 100.0f;
 
     key[0] = 'i';
     strset(key, 3, "Mpres");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
-        if (config.midi_mode == MIDI_MODE_POLY) {
-            config.midi_pres = i;
-        } else {
-            config.mpe_pres = i;
-        }
-    }
-
+    p->pres = preset_int(key, 0, 127);
     strset(key, 3, "Mx   ");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
-        if (config.midi_mode == MIDI_MODE_POLY) {
-            config.midi_x = i;
-        } else {
-            config.mpe_x = i;
-        }
-    }
-
+    p->x = preset_int(key, 0, 127);
     strset(key, 3, "My   ");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
-        if (config.midi_mode == MIDI_MODE_POLY) {
-            config.midi_y = i;
-        } else {
-            config.mpe_y = i;
-        }
-    }
-
+    p->y = preset_int(key, 0, 127);
     strset(key, 3, "Mvelo");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
-        config.mpe_contvelo = i;
-    }
-
+    p->contvelo = preset_int(key, 0, 127);
     strset(key, 3, "MChan");
-    i = getConfigInt(key);
-    if (i >= 1 && i <= 16) {
-        dis.midi_channel_offset = i - 1;
-        sendcfg = true;
-    }
-
+    p->channel = preset_int(key, 1, 16);
     strset(key, 3, "MPEpb");
-    i = getConfigInt(key);
-    if (i >= 1 && i <= 127) {
-        dis.midi_bend_range = i;
-        sendcfg = true;
-    }
-
+    p->bend_range = preset_int(key, 1, 127);
     strset(key, 3, "voice");
-    i = getConfigInt(key);
-    if (i >= 1 && i <= MAX_VOICECOUNT && config.midi_mode == MIDI_MODE_MPE) {
-        dis.voicecount = i;
-        sendcfg = true;
-    }
+    p->voicecount = preset_int(key, 1, MAX_VOICECOUNT);
 
     key[0] = 'f';
     strset(key, 3, "offse");
-    f = getConfigFloat(key);
-    if (f >= 0.0f && f <= 1.0f) {
-        config.zero_offset = f;
-    }
-
+    p->zero_offset = preset_float(key, 0.0f, 1.0f);
     strset(key, 3, "bendS");
-    f = getConfigFloat(key);
-    if (f >= -10.0f && f <= 10.0f) {
-        dis.bend_sensitivity = f * 2;
-    }
-
+    p->bend_sensitivity = preset_float(key, -10.0f, 10.0f);
     strset(key, 3, "presS");
-    f = getConfigFloat(key);
-    if (f >= 0.0f && f <= 10.0f) {
-        dis.pres_sensitivity = f;
-    }
-
+    p->pres_sensitivity = preset_float(key, 0.0f, 10.0f);
     strset(key, 3, "veloS");
-    f = getConfigFloat(key);
-    if (f >= 0.0f && f <= 10.0f) {
-        dis.velo_sensitivity = f;
-    }
-
+    p->velo_sensitivity = preset_float(key, 0.0f, 10.0f);
     strset(key, 3, "tiltS");
-    f = getConfigFloat(key);
-    if (f >= -10.0f && f <= 10.0f) {
-        dis.y_sensitivity = f;
+    p->y_sensitivity = preset_float(key, -10.0f, 10.0f);
+    strset(key, 3, "presC");
+    p->pres_curve = preset_float(key, CURVE_MIN, CURVE_MAX);
+    strset(key, 3, "veloC");
+    p->velo_curve = preset_float(key, CURVE_MIN, CURVE_MAX);
+    strset(key, 3, "volum");
+    p->volume = getConfigFloat(key);
+    if (p->volume < 0.0f || p->volume >= 255.0f) p->volume = PRESET_UNSET_F;
+
+    key[0] = 'i';
+    strset(key, 3, "veloO");
+    p->velo_offset = preset_int(key, 0, 127);
+    strset(key, 3, "Mpgm ");
+    p->program = preset_int(key, 0, 127);
+
+    // extra MIDI routes sPnrout0-7, with optional scale fPnrscl0-7 and offset fPnroff0-7
+    p->route_count = 0;
+    for (int k = 0; k < PRESET_ROUTES; k++) {
+        route_t* r = &p->routes[p->route_count];
+        key[0] = 's';
+        strset(key, 3, "rout");
+        key[7] = '0' + k;
+        getConfigSetting(key, s);
+        if (route_parse(s, r) != 0)
+            continue;
+        key[0] = 'f';
+        strset(key, 3, "rscl");
+        float f = getConfigFloat(key);
+        if (f != CONFIG_UNDEFINED) r->scale = f;
+        strset(key, 3, "roff");
+        f = getConfigFloat(key);
+        if (f != CONFIG_UNDEFINED) r->offset = f;
+        p->route_count++;
     }
+}
 
-    strset(key, 3, "volum");
-    f = getConfigFloat(key);
-    if (f >= 0.0f && f < 255.0f) {
-        set_volume(f);
+/*
+ * Call at boot and when settings they use change in the settings store.
+ */
+void compile_presets(void) {
+    for (int n = 0; n < TUNINGCOUNT; n++) {
+        compile_tuning(n, &tunings[n]);
+    }
+    for (int n = 0; n < PRESETCOUNT; n++) {
+        compile_preset(n + 1, &presets[n]);
     }
+    // load the current tuning again on the next switch
+    if (dis.cur_tuning >= 0)
+        dis.cur_tuning = -1;
+}
 
-    key[0] = 'i';
+void load_preset(int n) {
+    if (n < 1 || n > PRESETCOUNT) return;
+    const preset_t* p = &presets[n - 1];
+    bool sendcfg = false;
+    led_rgb(p->color);
 
-    strset(key, 3, "veloO");
-    i = getConfigFloat(key);
-    if (i >= 0 && i <= 127) {
-        dis.midi_velo_offset = i;
+    if (p->message_interval != PRESET_UNSET) config.message_interval = p->message_interval;
+    if (p->send_motion_interval != PRESET_UNSET) config.send_motion_interval = p->send_motion_interval;
+    if (p->midi_mode != PRESET_UNSET) {
+        set_midi_mode((midi_mode_t)p->midi_mode);
+        sendcfg = true;
+    }
+    if (p->midinote_mode != PRESET_UNSET) {
+        config.midinote_mode = (midinote_mode_t)p->midinote_mode;
+        dis.select_handler();
     }
+    if (p->jack2_mode != PRESET_UNSET) aux_jack_switch_mode_setting((jack2_mode_t)p->jack2_mode);
+#ifdef USE_INTERNAL_SYNTH
+    if (p->engine != PRESET_UNSET) synth_select_engine(p->engine);
+#endif
+    if (p->tuning != PRESET_UNSET) dis.load_tuning(p->tuning);
+    if (p->note_offset != PRESET_UNSET_F) dis.note_offset = dis.tuning_note_offset + p->note_offset;
+
+    if (config.midi_mode == MIDI_MODE_POLY) {
+        if (p->pres != PRESET_UNSET) config.midi_pres = p->pres;
+        if (p->x != PRESET_UNSET) config.midi_x = p->x;
+        if (p->y != PRESET_UNSET) config.midi_y = p->y;
+    } else {
+        if (p->pres != PRESET_UNSET) config.mpe_pres = p->pres;
+        if (p->x != PRESET_UNSET) config.mpe_x = p->x;
+        if (p->y != PRESET_UNSET) config.mpe_y = p->y;
+    }
+    if (p->contvelo != PRESET_UNSET) config.mpe_contvelo = p->contvelo;
+    if (p->channel != PRESET_UNSET) {
+        dis.midi_channel_offset = p->channel - 1;
+        sendcfg = true;
+    }
+    if (p->bend_range != PRESET_UNSET) {
+        dis.set_bend_range(p->bend_range);
+        sendcfg = true;
+    }
+    if (p->voicecount != PRESET_UNSET && config.midi_mode == MIDI_MODE_MPE) {
+        dis.voicecount = p->voicecount;
+        sendcfg = true;
+    }
+
+    if (p->zero_offset != PRESET_UNSET_F) config.zero_offset = p->zero_offset;
+    if (p->bend_sensitivity != PRESET_UNSET_F) dis.bend_sensitivity = p->bend_sensitivity * 2;
+    if (p->pres_sensitivity != PRESET_UNSET_F) dis.pres_sensitivity = p->pres_sensitivity;
+    if (p->velo_sensitivity != PRESET_UNSET_F) dis.velo_sensitivity = p->velo_sensitivity;
+    if (p->y_sensitivity != PRESET_UNSET_F) dis.y_sensitivity = p->y_sensitivity;
+    if (p->pres_curve != PRESET_UNSET_F) curve_lut_build(&dis.pres_curve, p->pres_curve);
+    if (p->velo_curve != PRESET_UNSET_F) curve_lut_build(&dis.velo_curve, p->velo_curve);
+    if (p->volume != PRESET_UNSET_F) set_volume(p->volume);
+    if (p->velo_offset != PRESET_UNSET) dis.midi_velo_offset = p->velo_offset;
+    routes.preset_routes = p->routes;
+    routes.preset_count = p->route_count;
+    routes.compile();
 
     if (sendcfg) {
         midi_config();
     }
 
-    strset(key, 3, "Mpgm ");
-    i = getConfigInt(key);
-    if (i >= 0 && i <= 127) {
+    if (p->program != PRESET_UNSET) {
         if (config.midi_mode != MIDI_MODE_POLY && dis.midi_channel_offset == 1) {
-            MidiSend2(MIDI_PROGRAM_CHANGE, i);
+            MidiSend2(MIDI_PROGRAM_CHANGE, p->program);
         }
         for (int n = 0; n < dis.voicecount; n++) {
-            MidiSend2(MIDI_PROGRAM_CHANGE | (dis.midi_channel_offset + n), i);
+            MidiSend2(MIDI_PROGRAM_CHANGE | (dis.midi_channel_offset + n), p->program);
         }
     }
 
-    led_rgb(led);
+    led_rgb(p->color);
 }
 
 #ifdef OLD_CONFIG_LAYOUT
@@ -1877,7 +2158,7 @@ float config_but(int but, int type, float adjust) {
         float rem = 0;
         if (type > 0) {
             *(dis.synth_interface->pedal) = clamp_rem(*(dis.synth_interface->pedal) + adjust * (1.0f/16.0f), 0, 1.0f, &rem);
-            pedal.send(*(dis.synth_interface->pedal) * 128 * 4, 0);
+            routes.send_global(ROUTE_SRC_PEDAL, *(dis.synth_interface->pedal));
         }
         led_updown_dial(*(dis.synth_interface->pedal) * 15 + 0.5f);
         led_rgb3(*(dis.synth_interface->pedal) * 64.0f, 0, *(dis.synth_interface->pedal) * 64.0f);
@@ -1891,7 +2172,7 @@ float config_but(int but, int type, float adjust) {
             if (type == 2) a = a / 4;
             if (a != 0) {
                 cur = clamp(cur + a, 0, 3);
-                dis.midi_bend_range = 12 << cur;
+                dis.set_bend_range(12 << cur);
                 midi_config();
             }
             if (type == 2) a = a * 4;
@@ -1993,7 +2274,7 @@ void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t status,
             case MIDI_C_NONRPN_MSB: lastNRPN_MSB = data2; lastRPN_LSB = lastRPN_MSB = 0x7f; break;
             case MIDI_C_DATA_ENTRY: {
                 if (lastRPN_LSB == 0 && lastRPN_MSB == 0) {
-                    dis.midi_bend_range = data2;
+                    dis.set_bend_range(data2);
                 } else if (lastRPN_LSB == 6 && lastRPN_MSB == 0) {
                     if (channel + data2 <= 15) {
                         set_midi_mode(MIDI_MODE_MPE);
@@ -2036,6 +2317,7 @@ void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t status,
                 } else {
                     config.midi_pres = data2;
                 }
+                routes.compile();
             } break;
             case 71: { // x
                 if (data2 == 0) data2 = CFG_DISABLE;
@@ -2044,6 +2326,7 @@ void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t status,
                 } else {
                     config.midi_x = data2;
                 }
+                routes.compile();
             } break;
             case 72: { // cont release velo
             } break;
@@ -2056,6 +2339,7 @@ void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t status,
                 } else {
                     config.midi_y = data2;
                 }
+                routes.compile();
             } break;
             case 75: { // pitch bend sensitivity, TODO: different CC?
                 dis.bend_sensitivity = (float)data2 * 0.05;
@@ -2084,13 +2368,26 @@ void MidiInMsgHandler(midi_device_t dev, uint8_t port, uint8_t status,
     }
 }
 
+static mts_parser_t mts_parser;
+
+void MidiInSysExHandler(midi_device_t dev, uint8_t port, const uint8_t* data, int len) {
+    (void) dev;
+    (void) port;
+    for (int n = 0; n < len; n++) {
+        int r = mts_parse(&mts_parser, data[n], dis.key_tuning);
+        if (r != MTS_NONE) {
+            dis.set_key_tuning(mts_parser.next, r == MTS_REALTIME);
+        }
+    }
+}
+
 void set_midi_mode(midi_mode_t mode) {
     // TODO: handle switching while buttons are pressed
     switch (mode) {
         case MIDI_MODE_MPE: {
             config.midi_mode = mode;
             dis.midi_channel_offset = 1;
-            dis.voicecount = VOICECOUNT;
+            dis.voicecount = MIDI_VOICECOUNT;
             dis.portamento = 0;
             ws2812_write_led(0, 0, 16, 0);
         } break;
@@ -2098,6 +2395,7 @@ void set_midi_mode(midi_mode_t mode) {
             config.midi_mode = mode;
             dis.midi_channel_offset = 0;
             dis.portamento = 0;
+            dis.poly.reset();
             ws2812_write_led(0, 8, 1, 0);
         } break;
         case MIDI_MODE_MONO: {
@@ -2108,6 +2406,8 @@ void set_midi_mode(midi_mode_t mode) {
             ws2812_write_led(0, 0, 1, 18);
         } break;
     }
+    dis.select_handler();
+    routes.compile();
 }
 
 void midi_config(void) {
@@ -2145,7 +2445,114 @@ void midi_config(void) {
 #endif
 }
 
+/*
+ * Settings changed with the settings button are kept in the settings store
+ * under 'L' keys and restored at boot.
+ */
+void save_settings(void) {
+    CC_ALIGN(8) char value[8];
+    itoa8(config.midi_mode, value);
+    settingsStoreSet("iLMmode ", value);
+    itoa8(dis.voicecount, value);
+    settingsStoreSet("iLvoice ", value);
+    itoa8(dis.midi_channel_offset + 1, value);
+    settingsStoreSet("iLMChan ", value);
+    itoa8(dis.midi_bend_range, value);
+    settingsStoreSet("iLMPEpb ", value);
+    itoa8(config.message_interval, value);
+    settingsStoreSet("iLMint  ", value);
+    ftoa8(dis.bend_sensitivity / 2, value);
+    settingsStoreSet("fLbendS ", value);
+    ftoa8(dis.pres_sensitivity, value);
+    settingsStoreSet("fLpresS ", value);
+    ftoa8(dis.velo_sensitivity, value);
+    settingsStoreSet("fLveloS ", value);
+    ftoa8(dis.y_sensitivity, value);
+    settingsStoreSet("fLtiltS ", value);
+    ftoa8(volume_linear, value);
+    settingsStoreSet("fLvolum ", value);
+}
+
+/*
+ * Store the current tuning, for example one received as MIDI Tuning Standard
+ * SysEx, as tuning n in the settings store and switch to it.
+ */
+int save_tuning(int n) {
+    if (n < 1 || n >= TUNINGCOUNT) return -1;
+    tuning_t* t = &tunings[n];
+    dis.get_tuning(t);
+    CC_ALIGN(8) char key[] = "fT0fifth";
+    CC_ALIGN(8) char value[8];
+    key[2] = '0' + n;
+    ftoa8(t->notegen1 * 100, value);
+    int r = settingsStoreSet(key, value);
+    strset(key, 3, "oct  ");
+    ftoa8(t->notegen0 * 100, value);
+    r |= settingsStoreSet(key, value);
+    strset(key, 3, "off  ");
+    ftoa8(t->note_offset * 100, value);
+    r |= settingsStoreSet(key, value);
+    for (int k = 0; k < 61; k++) {
+        put_button_name(k, &key[3]);
+        ftoa8(t->offsets[k] * 100, value);
+        r |= settingsStoreSet(key, value);
+    }
+    dis.cur_tuning = -1;
+    dis.load_tuning(n);
+    // -1 when the settings store is busy, then the tuning is kept until power off
+    return r;
+}
+
+static void load_settings(void) {
+    int i;
+    float f;
+    i = getConfigInt("iLMmode ");
+    if (i >= MIDI_MODE_MPE && i <= MIDI_MODE_MONO) {
+        set_midi_mode((midi_mode_t)i);
+    }
+    i = getConfigInt("iLvoice ");
+    if (i >= 1 && i <= MAX_VOICECOUNT && config.midi_mode == MIDI_MODE_MPE) {
+        dis.voicecount = i;
+    }
+    i = getConfigInt("iLMChan ");
+    if (i >= 1 && i <= 16) {
+        dis.midi_channel_offset = i - 1;
+    }
+    i = getConfigInt("iLMPEpb ");
+    if (i >= 1 && i <= 127) {
+        dis.set_bend_range(i);
+    }
+    i = getConfigInt("iLMint  ");
+    if (i >= 1 && i <= 127) {
+        config.message_interval = i;
+    }
+    f = getConfigFloat("fLbendS ");
+    if (f >= -10.0f && f <= 10.0f) {
+        dis.bend_sensitivity = f * 2;
+    }
+    f = getConfigFloat("fLpresS ");
+    if (f >= 0.0f && f <= 10.0f) {
+        dis.pres_sensitivity = f;
+    }
+    f = getConfigFloat("fLveloS ");
+    if (f >= 0.0f && f <= 10.0f) {
+        dis.velo_sensitivity = f;
+    }
+    f = getConfigFloat("fLtiltS ");
+    if (f >= -10.0f && f <= 10.0f) {
+        dis.y_sensitivity = f;
+    }
+    f = getConfigFloat("fLvolum ");
+    if (f >= 0.0f && f < 255.0f) {
+        set_volume(f);
+    }
+}
+
 void synth_control_init(void) {
+    mts_init(&mts_parser);
+    compile_presets();
+    load_settings();
+    routes.compile();
     int s = getConfigInt("iGoct   ");
     if (s >= -2 && s <= 2) {
         dis.change_note_offset(s * dis.notegen0);
@@ -2154,6 +2561,17 @@ void synth_control_init(void) {
     if (s >= 0 && s <= 127) {
         config.send_motion_interval = s;
     }
+    float f = getConfigFloat("fGpresC ");
+    if (f >= CURVE_MIN && f <= CURVE_MAX) {
+        curve_lut_build(&dis.pres_curve, f);
+    }
+    f = getConfigFloat("fGveloC ");
+    if (f >= CURVE_MIN && f <= CURVE_MAX) {
+        curve_lut_build(&dis.velo_curve, f);
+    }
+#ifdef USE_INTERNAL_SYNTH
+    codec_set_block_size(getConfigInt("iGblock "));
+#endif
 }
 
 void clear_dead_notes(void) {
@@ -2162,6 +2580,7 @@ void clear_dead_notes(void) {
 
 void synth_tick(void) {
     dis.tick();
+    dis.clear_dead_notes();
 }
 
 void update_leds(void) {
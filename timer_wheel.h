@@ -0,0 +1,136 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+/*
+ * Hashed timer wheel for timeouts in system ticks. A timer is in the slot of
+ * its expiry tick modulo the number of slots, scheduling and cancelling are a
+ * list insert and remove, and advancing only looks at the slots of the ticks
+ * that passed. Timers that expire in the same tick fire in the order they were
+ * scheduled. Not thread safe, use a wheel from a single thread.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_SLOTS 64 // power of 2
+
+typedef struct wheel_timer {
+  struct wheel_timer* next;
+  struct wheel_timer* prev;   // NULL when not scheduled
+  uint32_t expires;
+  int id;
+} wheel_timer_t;
+
+typedef struct {
+  wheel_timer_t slots[TIMER_WHEEL_SLOTS]; // list heads
+  uint32_t now;     // last tick that was handled
+  int count;        // scheduled timers
+} timer_wheel_t;
+
+typedef void (*timer_wheel_callback_t)(void* arg, timer_wheel_t* w, wheel_timer_t* t);
+
+static inline void tw_init(timer_wheel_t* w, uint32_t now) {
+  for (int n = 0; n < TIMER_WHEEL_SLOTS; n++) {
+    w->slots[n].next = &w->slots[n];
+    w->slots[n].prev = &w->slots[n];
+  }
+  w->now = now;
+  w->count = 0;
+}
+
+static inline void tw_timer_init(wheel_timer_t* t, int id) {
+  t->next = NULL;
+  t->prev = NULL;
+  t->expires = 0;
+  t->id = id;
+}
+
+static inline int tw_pending(const wheel_timer_t* t) {
+  return t->prev != NULL;
+}
+
+static inline void tw_cancel(timer_wheel_t* w, wheel_timer_t* t) {
+  if (t->prev) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+    w->count--;
+  }
+}
+
+/*
+ * Schedule or reschedule a timer, an expiry tick that already passed fires on
+ * the next advance.
+ */
+static inline void tw_schedule(timer_wheel_t* w, wheel_timer_t* t, uint32_t expires) {
+  tw_cancel(w, t);
+  if ((int32_t)(expires - w->now) <= 0)
+    expires = w->now + 1;
+  t->expires = expires;
+  wheel_timer_t* head = &w->slots[expires & (TIMER_WHEEL_SLOTS - 1)];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  w->count++;
+}
+
+/*
+ * Fire all timers that expire up to and including tick now, in order of
+ * expiry. A timer is cancelled before its callback, which may schedule it again.
+ */
+static inline void tw_advance(timer_wheel_t* w, uint32_t now,
+                              timer_wheel_callback_t callback, void* arg) {
+  while ((int32_t)(now - w->now) > 0) {
+    if (w->count == 0) {
+      w->now = now;
+      break;
+    }
+    uint32_t tick = ++w->now;
+    wheel_timer_t* head = &w->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+    // move the timers of this tick to a list of their own first, so callbacks
+    // can schedule and cancel any timer, timers a multiple of the wheel size
+    // later stay in the slot
+    wheel_timer_t expired;
+    expired.next = &expired;
+    expired.prev = &expired;
+    wheel_timer_t* t = head->next;
+    while (t != head) {
+      wheel_timer_t* next = t->next;
+      if (t->expires == tick) {
+        t->prev->next = next;
+        next->prev = t->prev;
+        t->next = &expired;
+        t->prev = expired.prev;
+        expired.prev->next = t;
+        expired.prev = t;
+      }
+      t = next;
+    }
+    while (expired.next != &expired) {
+      t = expired.next;
+      tw_cancel(w, t);
+      callback(arg, w, t);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,352 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * control_bench: host build of synth_control.cpp to profile and check the MIDI
+ * output
+ *
+ * Builds synth_control.cpp unchanged with the stubs in host/, the usb MIDI
+ * output is recorded. A button stream, a trace recorded as for synth_render or
+ * a synthetic one, is played in MPE, single channel poly and mono mode with
+ * synth_tick() every 2 ms.
+ * Per mode the cost per message, the MIDI bytes sent and a checksum of the MIDI
+ * output are reported, use -d to print the MIDI output to compare before and
+ * after a change. Then the time of a tuning and a preset switch is reported,
+ * and of parsing them from the config. For the synthetic stream without
+ * motion CCs the checksums are compared to the expected ones in modes[], and
+ * the exit status is 1 when one differs. A change of the MIDI output has to
+ * update them.
+ * With -m the motion sensor CCs are sent and the synthetic stream gets motion
+ * sensor messages every 3 ms like the MPU6050 thread: the device lying still
+ * with sensor noise, and tilted back and forth during every other chord.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../synth_control.cpp"
+#include "synth_control_stubs.h"
+
+#define TICK_MS 2 // synth_tick() interval of the firmware main loop
+#define SYNTH_CHORDS 64
+#define MOTION_MS 3 // motion sensor message interval
+
+typedef struct {
+    float time;
+    int size;
+    int msg[9]; // source, id and values, as passed to synth_message()
+} trace_msg_t;
+
+static std::vector<trace_msg_t> trace;
+
+static const char* mode_name = "";
+static bool dump = false;
+static bool record = false;
+static uint64_t midi_bytes = 0;
+static uint32_t midi_hash = 2166136261u;
+
+static void midi_out(int n, uint8_t b0, uint8_t b1, uint8_t b2) {
+    midi_bytes += n;
+    if (!record)
+        return;
+    uint8_t b[3] = {b0, b1, b2};
+    for (int k = 0; k < n; k++) {
+        midi_hash = (midi_hash ^ b[k]) * 16777619u;
+    }
+    if (dump) {
+        printf("%-4s %8.3f", mode_name, now_ms * 0.001f);
+        for (int k = 0; k < n; k++) {
+            printf(" %02x", b[k]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Button streams
+ */
+static int read_trace(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        trace_msg_t m;
+        int n = 0;
+        if (sscanf(line, "%f %d,%d%n", &m.time, &m.msg[0], &m.msg[1], &n) < 3) {
+            fprintf(stderr, "%s:%d: can't parse line\n", filename, lineno);
+            continue;
+        }
+        m.size = 2;
+        char* p = line + n;
+        while (*p == ',' && m.size < 9) {
+            m.msg[m.size++] = strtol(p + 1, &p, 10);
+        }
+        trace.push_back(m);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int rnd(unsigned int* seed, int n) {
+    *seed = *seed * 1103515245 + 12345;
+    return ((*seed >> 8) & 0xffff) * n >> 16;
+}
+
+static void add_button(float time, int but, int pres, int vpres, int x, int y) {
+    trace_msg_t m = {time, 6, {ID_DIS, but, pres, vpres, x, y}};
+    trace.push_back(m);
+}
+
+/*
+ * Chords of 1 to 10 keys held for half a second, with pressure swells,
+ * vibrato and tilt. Every held key sends a message every ms like the device.
+ */
+static void synth_trace(bool motion) {
+    unsigned int seed = 1;
+    int t = 0;
+    for (int c = 0; c < SYNTH_CHORDS; c++) {
+        int keys[10];
+        int count = 1 + c % 10;
+        for (int k = 0; k < count; k++) {
+            bool dup;
+            do {
+                keys[k] = rnd(&seed, BUTTONCOUNT);
+                dup = false;
+                for (int j = 0; j < k; j++) {
+                    dup |= keys[j] == keys[k];
+                }
+            } while (dup);
+        }
+        for (int ms = 1; ms <= 500; ms++, t++) {
+            for (int k = 0; k < count; k++) {
+                float env = ms < 100 ? ms / 100.0f : 1.0f - (ms - 100) / 500.0f;
+                int pres = 0x1fff * env * (0.5f + 0.05f * k);
+                int vpres = ms < 100 ? 0x1fff / 100 : -0x1fff / 500;
+                int x = 600 * sinf(ms * 0.03f + k);
+                int y = 40 * (ms / 10) - 2000 + 300 * k;
+                add_button(t * 0.001f, keys[k], pres, vpres, x, y);
+            }
+        }
+        for (int k = 0; k < count; k++) {
+            add_button(t * 0.001f, keys[k], 0, -0x1fff / 500, 0, 0);
+        }
+        t += 50;
+    }
+    if (!motion)
+        return;
+
+    // motion sensor in 1/1024 g and about 1/32 degree/s, like motionsensor.c
+    std::vector<trace_msg_t> m;
+    for (int ms = 0; ms < t; ms += MOTION_MS) {
+        int chord = ms / 550;
+        float tilt = chord % 2 ? 0.4f * sinf(ms * 0.004f) : 0.0f;
+        float rot = chord % 2 ? 0.4f * 0.004f * 1000.0f * cosf(ms * 0.004f) : 0.0f;
+        int acc_y = 1024 * sinf(tilt) + rnd(&seed, 9) - 4;
+        int acc_z = 1024 * cosf(tilt) + rnd(&seed, 9) - 4;
+        int acc_x = rnd(&seed, 9) - 4;
+        trace_msg_t a = {ms * 0.001f, 9, {ID_ACCEL, 8, acc_x, acc_y, acc_z,
+            (int)sqrtf(acc_x * acc_x + acc_y * acc_y + acc_z * acc_z),
+            (int)(rot * 57.3f * 32.8f) + rnd(&seed, 7) - 3, rnd(&seed, 7) - 3, rnd(&seed, 7) - 3}};
+        m.push_back(a);
+    }
+    trace.insert(trace.end(), m.begin(), m.end());
+    std::stable_sort(trace.begin(), trace.end(), [](const trace_msg_t& a, const trace_msg_t& b) {
+        return a.time < b.time;
+    });
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Play the stream, returns the time spent in synth_message() and synth_tick().
+ */
+static double play(void) {
+    systime_t start = now_ms;
+    systime_t next_tick = start;
+    double t0 = now();
+    for (size_t n = 0; n < trace.size(); n++) {
+        trace_msg_t* m = &trace[n];
+        systime_t t = start + (systime_t)(m->time * 1000.0f + 0.5f);
+        while (next_tick <= t) {
+            now_ms = next_tick;
+            synth_tick();
+            next_tick += TICK_MS;
+        }
+        now_ms = t;
+        synth_message(m->size, m->msg);
+    }
+    double time = now() - t0;
+    // release dead notes
+    now_ms += 1000;
+    clear_dead_notes();
+    return time;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-r repeat] [-d] [-m interval] [-l] [trace.txt]\n", name);
+    fprintf(stderr, "   -r      : play the stream multiple times for stable timing\n");
+    fprintf(stderr, "   -d      : print the MIDI output of the first time\n");
+    fprintf(stderr, "   -m      : send motion CCs every interval motion messages\n");
+    fprintf(stderr, "   -l      : send 14 bit motion CCs\n");
+}
+
+int main(int argc, char** argv) {
+    int repeat = 20;
+    int motion_interval = 0;
+    bool motion_14bit = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:dm:lh")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dump = true;
+            break;
+        case 'm':
+            motion_interval = atoi(optarg);
+            break;
+        case 'l':
+            motion_14bit = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc - 1 || repeat < 1 || motion_interval < 0 || motion_interval > 126) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (optind == argc - 1) {
+        if (read_trace(argv[optind]) < 0)
+            return 1;
+    } else {
+        synth_trace(motion_interval);
+    }
+
+    synth_interface_init();
+    synth_control_init();
+    if (motion_interval) {
+        config.send_motion_interval = motion_interval;
+        config.send_motion_14bit = motion_14bit;
+    }
+
+    // with the MIDI output checksum of the synthetic stream
+    static const struct {
+        midi_mode_t mode;
+        const char* name;
+        uint32_t expected;
+    } modes[] = {
+        {MIDI_MODE_MPE, "mpe", 0x5f51b22c},
+        {MIDI_MODE_POLY, "poly", 0x459306fa},
+        {MIDI_MODE_MONO, "mono", 0xde51446a},
+    };
+    const int mode_count = sizeof(modes) / sizeof(modes[0]);
+    uint64_t bytes[mode_count];
+    uint32_t hash[mode_count];
+
+    // record all modes before timing, so the output doesn't depend on -r
+    record = true;
+    for (int k = 0; k < mode_count; k++) {
+        mode_name = modes[k].name;
+        midi_bytes = 0;
+        midi_hash = 2166136261u;
+        set_midi_mode(modes[k].mode);
+        midi_config();
+        play();
+        bytes[k] = midi_bytes;
+        hash[k] = midi_hash;
+    }
+    record = false;
+
+    for (int k = 0; k < mode_count; k++) {
+        set_midi_mode(modes[k].mode);
+        double time = 0.0;
+        for (int r = 0; r < repeat; r++) {
+            time += play();
+        }
+        double messages = (double)trace.size() * repeat;
+        fprintf(dump ? stderr : stdout,
+                "%-4s %8.1f ns/message, %6.2f M messages/s, %8llu MIDI bytes from %zu messages, checksum %08x\n",
+                modes[k].name, time * 1e9 / messages, messages / time * 1e-6,
+                (unsigned long long)bytes[k], trace.size(), hash[k]);
+    }
+
+    // tuning and preset switch latency, compared to parsing them from the
+    // config, which was done at every switch before they were compiled at boot
+    const int switches = 1000;
+    tuning_t tuning;
+    preset_t preset;
+    double t0 = now();
+    for (int r = 0; r < switches; r++) {
+        dis.load_tuning(r % TUNINGCOUNT);
+    }
+    double t_tuning = now() - t0;
+    t0 = now();
+    for (int r = 0; r < switches; r++) {
+        compile_tuning(1 + r % (TUNINGCOUNT - 1), &tuning);
+    }
+    double t_tuning_parse = now() - t0;
+    t0 = now();
+    for (int r = 0; r < switches; r++) {
+        load_preset(1 + r % PRESETCOUNT);
+    }
+    double t_preset = now() - t0;
+    t0 = now();
+    for (int r = 0; r < switches; r++) {
+        compile_preset(1 + r % PRESETCOUNT, &preset);
+    }
+    double t_preset_parse = now() - t0;
+    t0 = now();
+    compile_presets();
+    double t_compile = now() - t0;
+    fprintf(dump ? stderr : stdout,
+            "switch tuning %.2f us (parse %.2f us), preset %.2f us (parse %.2f us), compile all %.1f us\n",
+            t_tuning * 1e6 / switches, t_tuning_parse * 1e6 / switches,
+            t_preset * 1e6 / switches, t_preset_parse * 1e6 / switches, t_compile * 1e6);
+
+    int errors = 0;
+    if (optind == argc && !motion_interval) {
+        for (int k = 0; k < mode_count; k++) {
+            if (hash[k] != modes[k].expected) {
+                fprintf(stderr, "%s: checksum %08x, expected %08x\n", modes[k].name, hash[k], modes[k].expected);
+                errors++;
+            }
+        }
+    }
+    return errors != 0;
+}
@@ -0,0 +1,165 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check and benchmark of the response curve tables (curve_lut.h). For the
+ * range of curve exponents the interpolated table is compared to powf: the
+ * maximum error from 0 to 1, the same from 1/16 up where the first segment
+ * doesn't count, and the error in 7 bit MIDI steps. Fails when an error is
+ * above the bound in curve_bound(). Then the cost per evaluation is compared
+ * to powf and to the Schlick approximation.
+ *
+ * usage: curve_bench [-n evaluations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "curve_lut.h"
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static const float exponents[] = {0.5f, 0.67f, 0.75f, 1.0f, 1.5f, 2.0f, 3.0f, 4.0f};
+#define EXPONENTS (int)(sizeof(exponents) / sizeof(exponents[0]))
+
+/*
+ * Error bound of linear interpolation: in the first segment, where the second
+ * derivative of x^e is unbounded for e below 2, the error is at most
+ * h^e * |1-e| * e^(e/(1-e)), elsewhere h^2/8 * max |f''|.
+ */
+static double curve_bound(double e) {
+  double h = 1.0 / CURVE_LUT_SEGMENTS;
+  if (e == 1.0)
+    return 1e-6; // float rounding
+  double first = pow(h, e) * fabs(1 - e) * pow(e, e / (1 - e));
+  double rest = h * h / 8 * e * fabs(e - 1) * (e < 2.0 ? pow(h, e - 2) : 1.0);
+  return (first > rest ? first : rest) + 1e-6;
+}
+
+static int check(void) {
+  int errors = 0;
+  curve_lut_t c;
+  printf("exponent  max error  bound      from 1/16  MIDI steps\n");
+  for (int k = 0; k < EXPONENTS; k++) {
+    float e = exponents[k];
+    curve_lut_build(&c, e);
+    double err = 0, err16 = 0;
+    int steps = 0;
+    for (int n = 0; n <= 1 << 20; n++) {
+      float x = (float)n / (1 << 20);
+      double exact = pow(x, e);
+      float y = curve_lut(&c, x);
+      double d = fabs(y - exact);
+      if (d > err) err = d;
+      if (x >= 1.0f / 16 && d > err16) err16 = d;
+      int s = abs((int)(y * 127.0 + 0.5) - (int)(exact * 127.0 + 0.5));
+      if (s > steps) steps = s;
+    }
+    // mirrored and above 1
+    if (curve_lut_signed(&c, -0.5f) != -curve_lut(&c, 0.5f)
+        || curve_lut(&c, 1.0f) != 1.0f || !(curve_lut(&c, 1.5f) > 1.0f)
+        || curve_lut(&c, -0.5f) != (e == 1.0f ? -0.5f : 0.0f)) {
+      fprintf(stderr, "exponent %.2f: wrong value outside 0 to 1\n", e);
+      errors++;
+    }
+    double bound = curve_bound(e);
+    printf("%5.2f     %.2e   %.2e   %.2e   %d\n", e, err, bound, err16, steps);
+    if (err > bound) {
+      fprintf(stderr, "exponent %.2f: error %.2e above bound %.2e\n", e, err, bound);
+      errors++;
+    }
+  }
+  printf("%s\n", errors ? "FAILED" : "ok");
+  return errors != 0;
+}
+
+static float powf_schlick(const float a, const float b) {
+  return (a / (b - a * b + a));
+}
+
+#define INPUTS 1024
+
+static void bench(int evals) {
+  static float x[INPUTS];
+  volatile float sink = 0;
+  unsigned int seed = 1;
+  for (int n = 0; n < INPUTS; n++) {
+    seed = seed * 1103515245 + 12345;
+    x[n] = ((seed >> 8) & 0xffff) / 65536.0f;
+  }
+  curve_lut_t c;
+  curve_lut_build(&c, 2.5f);
+  int rounds = evals / INPUTS;
+  if (rounds < 1) rounds = 1;
+  evals = rounds * INPUTS;
+
+  float acc = 0;
+  double t0 = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int n = 0; n < INPUTS; n++)
+      acc += powf(x[n], c.exponent);
+  }
+  double t_powf = now() - t0;
+  sink += acc;
+
+  acc = 0;
+  t0 = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int n = 0; n < INPUTS; n++)
+      acc += powf_schlick(x[n], 0.6f);
+  }
+  double t_schlick = now() - t0;
+  sink += acc;
+
+  acc = 0;
+  t0 = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int n = 0; n < INPUTS; n++)
+      acc += curve_lut(&c, x[n]);
+  }
+  double t_lut = now() - t0;
+  sink += acc;
+
+  t0 = now();
+  for (int r = 0; r < 1000; r++) {
+    curve_lut_build(&c, 2.5f + r * 1e-4f);
+  }
+  double t_build = now() - t0;
+  sink += c.y[1];
+
+  printf("powf %.2f ns, schlick %.2f ns, table %.2f ns per evaluation, build %.1f us\n",
+         t_powf * 1e9 / evals, t_schlick * 1e9 / evals, t_lut * 1e9 / evals, t_build * 1e6 / 1000);
+}
+
+int main(int argc, char** argv) {
+  int evals = 10000000;
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], "-n"))
+      evals = atoi(argv[n+1]);
+  }
+  int r = check();
+  bench(evals);
+  return r;
+}
@@ -0,0 +1,356 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * frame_bench: encode and decode speed of the framed binary protocol (v2)
+ *
+ * Encodes a synthetic stream of button messages into frames like ThreadSend
+ * does, decodes it again, checks the result and reports ns per message. The
+ * same messages are also encoded and parsed in the v1 format for comparison.
+ * Then the stream goes through the capture pipeline of striso_util -a, the
+ * ring buffer and parser thread, and with a small ring buffer that overflows
+ * to check that the dropped data shows up as lost frames.
+ *
+ * With -f a recorded stream (striso_util [-2] -p > capture.bin) is replayed
+ * through the capture pipeline instead, -1 for a v1 stream.
+ *
+ * With -w the generated v2 stream is written to a file, to replay it with
+ * stribri -v 2 -f capture.bin.
+ *
+ * usage: frame_bench [-n messages] [-b messages per frame] [-r raw values per frame]
+ *        frame_bench -f capture.bin [-1]
+ *        frame_bench [-n messages] [-b messages per frame] -w capture.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "striso_frame.h"
+#include "ring_buffer.h"
+
+#define MAX_STREAM (64 << 20)
+
+static uint8_t stream[MAX_STREAM];
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// button message like button_read.c sends: pres, vpres, x, y
+static void make_message(int k, int* msg) {
+  msg[0] = (k / 68) & 1 ? ID_BAS : ID_DIS;
+  msg[1] = k % 68;
+  msg[2] = (k * 37) & 0x1fff;
+  msg[3] = ((k * 11) & 0x3fff) - 0x2000;
+  msg[4] = ((k * 5) & 0xfff) - 0x800;
+  msg[5] = ((k * 3) & 0xfff) - 0x800;
+}
+
+typedef struct {
+  int count;
+  int raw;
+  long checksum;
+} check_t;
+
+static void check_message(void* arg, uint32_t timestamp, int src, int id, int size, const int* values) {
+  check_t* c = (check_t*)arg;
+  (void)timestamp;
+  if (src == ID_RAW) {
+    c->raw += size;
+    return;
+  }
+  c->checksum += src * 1000 + id;
+  for (int i = 0; i < size; i++) {
+    c->checksum += values[i];
+  }
+  c->count++;
+}
+
+static int encode_frames(int messages, int batch, int raw) {
+  striso_frame_t frame;
+  int16_t raw_values[STRISO_RAW_MAX];
+  int msg[6];
+  int len = 0;
+  int seq = 0;
+  for (int n = 0; n < raw; n++) {
+    raw_values[n] = (int16_t)(n * 257 - 20000);
+  }
+  striso_frame_begin(&frame);
+  if (raw)
+    striso_frame_add_raw(&frame, 0, raw, raw_values);
+  for (int k = 0; k < messages; k++) {
+    make_message(k, msg);
+    int full = !striso_frame_add(&frame, 6, msg);
+    if (full || (k + 1) % batch == 0 || k == messages - 1) {
+      int size = striso_frame_end(&frame, seq++, k * 500);
+      memcpy(&stream[len], frame.data, size);
+      len += size;
+      striso_frame_begin(&frame);
+      if (raw)
+        striso_frame_add_raw(&frame, 0, raw, raw_values);
+      if (full)
+        striso_frame_add(&frame, 6, msg);
+    }
+  }
+  return len;
+}
+
+static int encode_v1(int messages) {
+  int msg[6];
+  int len = 0;
+  for (int k = 0; k < messages; k++) {
+    make_message(k, msg);
+    uint8_t* out = &stream[len];
+    out[0] = 0x80 | ((uint8_t)msg[0])<<3 | 4;
+    out[1] = 0x7f & (uint8_t)msg[1];
+    for (int c = 2; c < 6; c++) {
+      out[c*2-2] = 0x7f & (uint8_t)(msg[c]>>7);
+      out[c*2-1] = 0x7f & (uint8_t)(msg[c]);
+    }
+    len += 10;
+  }
+  return len;
+}
+
+typedef struct {
+  ring_buffer_t ring;
+  striso_decoder_t decoder;
+  check_t check;
+  int v1;
+} pipeline_t;
+
+static void* pipeline_parse(void* arg) {
+  pipeline_t* p = (pipeline_t*)arg;
+  const uint8_t* data;
+  size_t n;
+  while ((data = ring_peek(&p->ring, &n)) != NULL) {
+    if (p->v1)
+      striso_decode_v1(&p->decoder, data, n, check_message, &p->check);
+    else
+      striso_decode(&p->decoder, data, n, check_message, &p->check);
+    ring_consume(&p->ring, n);
+  }
+  return NULL;
+}
+
+/*
+ * Feed the stream in usb transfer sized chunks of 1 to 4096 bytes, the
+ * producer waits for room instead of dropping data.
+ */
+static double pipeline_run(pipeline_t* p, const uint8_t* data, int len, size_t ring_size, int v1) {
+  pthread_t parser;
+  memset(&p->check, 0, sizeof(p->check));
+  striso_decoder_init(&p->decoder);
+  ring_init(&p->ring, ring_size);
+  p->v1 = v1;
+  double t0 = now();
+  pthread_create(&parser, NULL, pipeline_parse, p);
+  unsigned int seed = 1;
+  for (int pos = 0; pos < len; ) {
+    seed = seed * 1103515245 + 12345;
+    int n = 1 + (seed >> 16) % 4096;
+    if (n > len - pos)
+      n = len - pos;
+    while (p->ring.size - ring_fill(&p->ring) < (size_t)n) {
+      sched_yield();
+    }
+    ring_write(&p->ring, &data[pos], n);
+    pos += n;
+  }
+  ring_close(&p->ring);
+  pthread_join(parser, NULL);
+  double t = now() - t0;
+  ring_free(&p->ring);
+  return t;
+}
+
+/*
+ * Same without parser thread, the parser is skipped after every third chunk
+ * so the 4 kB ring buffer overflows.
+ */
+static void pipeline_drops(pipeline_t* p, const uint8_t* data, int len) {
+  memset(&p->check, 0, sizeof(p->check));
+  striso_decoder_init(&p->decoder);
+  ring_init(&p->ring, 1 << 12);
+  unsigned int seed = 1;
+  int chunk = 0;
+  for (int pos = 0; pos < len; ) {
+    seed = seed * 1103515245 + 12345;
+    int n = 1 + (seed >> 16) % 4096;
+    if (n > len - pos)
+      n = len - pos;
+    ring_write(&p->ring, &data[pos], n);
+    pos += n;
+    if (++chunk % 3 == 0 && pos < len)
+      continue;
+    while (ring_fill(&p->ring)) {
+      size_t k;
+      const uint8_t* d = ring_peek(&p->ring, &k);
+      striso_decode(&p->decoder, d, k, check_message, &p->check);
+      ring_consume(&p->ring, k);
+    }
+  }
+  ring_free(&p->ring);
+}
+
+static int replay(const char* filename, int v1) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return 1;
+  }
+  int len = fread(stream, 1, MAX_STREAM, f);
+  fclose(f);
+  pipeline_t p;
+  double t = pipeline_run(&p, stream, len, 1 << 20, v1);
+  printf("%s: %d bytes, %d messages, %d raw values, %u frames, lost %u frames %u bytes, %.1f ns/message\n",
+         filename, len, p.check.count, p.check.raw, p.decoder.frames,
+         p.decoder.lost_frames, p.decoder.lost_bytes, t * 1e9 / (p.check.count ? p.check.count : 1));
+  return 0;
+}
+
+static long expected_checksum(int messages) {
+  long sum = 0;
+  int msg[6];
+  for (int k = 0; k < messages; k++) {
+    make_message(k, msg);
+    sum += msg[0] * 1000 + msg[1] + msg[2] + msg[3] + msg[4] + msg[5];
+  }
+  return sum;
+}
+
+static int opt(int argc, char** argv, const char* name, int def) {
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], name))
+      return atoi(argv[n+1]);
+  }
+  return def;
+}
+
+int main(int argc, char** argv) {
+  int messages = opt(argc, argv, "-n", 2000000);
+  int batch = opt(argc, argv, "-b", 8);
+  int raw = opt(argc, argv, "-r", 0);
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], "-f"))
+      return replay(argv[n+1], argc > 3 && !strcmp(argv[argc-1], "-1"));
+  }
+  if (batch < 1) batch = 1;
+  if (raw < 0 || raw > STRISO_RAW_MAX) {
+    fprintf(stderr, "raw values per frame must be 0 to %d\n", STRISO_RAW_MAX);
+    return 1;
+  }
+  // stream size with one frame per message as upper bound
+  if ((long)messages * (10 + 8 + 3 + raw * 2) > MAX_STREAM) {
+    messages = MAX_STREAM / (10 + 8 + 3 + raw * 2);
+  }
+  long expected = expected_checksum(messages);
+
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], "-w")) {
+      int len = encode_frames(messages, batch, raw);
+      FILE* f = fopen(argv[n+1], "wb");
+      if (!f || fwrite(stream, 1, len, f) != (size_t)len) {
+        perror(argv[n+1]);
+        return 1;
+      }
+      fclose(f);
+      printf("%d messages, %d bytes written to %s\n", messages, len, argv[n+1]);
+      return 0;
+    }
+  }
+
+  double t0 = now();
+  int len = encode_frames(messages, batch, raw);
+  double t1 = now();
+  striso_decoder_t decoder;
+  striso_decoder_init(&decoder);
+  check_t c = {0, 0, 0};
+  // feed in usb sized chunks
+  for (int pos = 0; pos < len; pos += 512) {
+    striso_decode(&decoder, &stream[pos], len - pos < 512 ? len - pos : 512, check_message, &c);
+  }
+  double t2 = now();
+  if (c.count != messages || c.checksum != expected || decoder.lost_frames || decoder.lost_bytes) {
+    fprintf(stderr, "v2 decode mismatch: %d of %d messages, lost %u frames %u bytes\n",
+            c.count, messages, decoder.lost_frames, decoder.lost_bytes);
+    return 1;
+  }
+  printf("v2: %d messages in %u frames, %.2f bytes/message, encode %.1f ns/message, decode %.1f ns/message, %.0f MB/s\n",
+         messages, decoder.frames, (double)len / messages,
+         (t1 - t0) * 1e9 / messages, (t2 - t1) * 1e9 / messages, len / (t2 - t1) * 1e-6);
+  if (raw) {
+    printf("    %d raw values per frame, %d decoded\n", raw, c.raw);
+  }
+
+  t0 = now();
+  len = encode_v1(messages);
+  t1 = now();
+  check_t c1 = {0, 0, 0};
+  striso_decoder_init(&decoder);
+  striso_decode_v1(&decoder, stream, len, check_message, &c1);
+  t2 = now();
+  if (c1.count != messages || c1.checksum != expected || decoder.lost_bytes) {
+    fprintf(stderr, "v1 decode mismatch\n");
+    return 1;
+  }
+  printf("v1: %d messages, %.2f bytes/message, encode %.1f ns/message, decode %.1f ns/message, %.0f MB/s\n",
+         messages, (double)len / messages,
+         (t1 - t0) * 1e9 / messages, (t2 - t1) * 1e9 / messages, len / (t2 - t1) * 1e-6);
+
+  // corrupt the last message in every 100th frame, the decoder should resync on the next frame
+  len = encode_frames(messages, batch, raw);
+  int frame_count = 0;
+  for (int pos = 0; pos < len; ) {
+    int size = stream[pos+6]<<7 | stream[pos+7];
+    if (frame_count++ % 100 == 50)
+      stream[pos + size - 1] = 0xff;
+    pos += size;
+  }
+  striso_decoder_init(&decoder);
+  for (int pos = 0; pos < len; pos += 512) {
+    striso_decode(&decoder, &stream[pos], len - pos < 512 ? len - pos : 512, NULL, NULL);
+  }
+  printf("corrupted %d of %d frames: decoded %u, lost %u frames %u bytes\n",
+         (frame_count + 49) / 100, frame_count, decoder.frames, decoder.lost_frames, decoder.lost_bytes);
+
+  // capture pipeline, without and with drops
+  len = encode_frames(messages, batch, raw);
+  pipeline_t p;
+  double t = pipeline_run(&p, stream, len, 1 << 20, 0);
+  if (p.check.count != messages || p.check.checksum != expected || p.decoder.lost_frames || p.decoder.lost_bytes) {
+    fprintf(stderr, "pipeline mismatch: %d of %d messages, lost %u frames %u bytes\n",
+            p.check.count, messages, p.decoder.lost_frames, p.decoder.lost_bytes);
+    return 1;
+  }
+  printf("pipeline: %d messages, %.1f ns/message, %.0f MB/s, ring peak %zu kB\n",
+         messages, t * 1e9 / messages, len / t * 1e-6, p.ring.peak >> 10);
+  pipeline_drops(&p, stream, len);
+  printf("pipeline with 4 kB ring: dropped %llu bytes, decoded %d of %d messages, lost %u frames %u bytes\n",
+         (unsigned long long)p.ring.dropped, p.check.count, messages, p.decoder.lost_frames, p.decoder.lost_bytes);
+  if (p.ring.dropped && !p.decoder.lost_frames) {
+    fprintf(stderr, "dropped data not detected\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HOST_CH_H_
+#define _HOST_CH_H_
+
+/*
+ * Minimal ChibiOS stand in to build firmware sources on the host. Only what the
+ * synth, synth_control.cpp and settings_store.c use is defined, everything runs
+ * in a single thread so mutexes and semaphores do nothing. The host program provides chEvtWaitOne() and chThdShouldTerminateX(),
+ * which are called once per audio block by synthThread(), and the system time
+ * chVTGetSystemTime().
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FALSE 0
+#define TRUE 1
+
+typedef uint32_t systime_t;
+typedef uint32_t sysinterval_t;
+typedef uint32_t eventmask_t;
+typedef int32_t msg_t;
+typedef int tprio_t;
+typedef struct { int dummy; } thread_t;
+typedef struct { int dummy; } mutex_t;
+typedef struct { int dummy; } binary_semaphore_t;
+
+#define THD_WORKING_AREA(s, n) char s[n]
+#define THD_FUNCTION(tname, arg) void tname(void *arg)
+#define LOWPRIO 2
+#define NORMALPRIO 128
+
+#define TIME_MS2I(msecs) ((sysinterval_t)(msecs))
+#define TIME_I2MS(interval) ((uint32_t)(interval))
+
+eventmask_t chEvtWaitOne(eventmask_t events);
+bool chThdShouldTerminateX(void);
+systime_t chVTGetSystemTime(void);
+
+static inline systime_t chVTGetSystemTimeX(void) { return chVTGetSystemTime(); }
+static inline sysinterval_t chVTTimeElapsedSinceX(systime_t start) { return chVTGetSystemTime() - start; }
+
+static inline void chThdSleep(sysinterval_t time) { (void)time; }
+static inline void chThdSleepMilliseconds(uint32_t msecs) { (void)msecs; }
+static inline void chMtxObjectInit(mutex_t *mp) { (void)mp; }
+static inline void chMtxLock(mutex_t *mp) { (void)mp; }
+static inline void chMtxUnlock(mutex_t *mp) { (void)mp; }
+static inline void chBSemObjectInit(binary_semaphore_t *bsp, bool taken) { (void)bsp; (void)taken; }
+static inline msg_t chBSemWait(binary_semaphore_t *bsp) { (void)bsp; return 0; }
+static inline void chBSemSignal(binary_semaphore_t *bsp) { (void)bsp; }
+static inline void chRegSetThreadName(const char *name) { (void)name; }
+static inline void chEvtAddEvents(eventmask_t events) { (void)events; }
+static inline void chEvtSignalI(thread_t *tp, eventmask_t events) { (void)tp; (void)events; }
+static inline void chSysLock(void) {}
+static inline void chSysUnlock(void) {}
+static inline void chSysLockFromISR(void) {}
+static inline void chSysUnlockFromISR(void) {}
+
+static inline thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio,
+                                          void (*pf)(void *), void *arg) {
+  (void)wsp; (void)size; (void)prio; (void)pf; (void)arg;
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HOST_HAL_H_
+#define _HOST_HAL_H_
+
+/*
+ * Minimal ChibiOS HAL stand in for host builds, see ch.h.
+ */
+#include "ch.h"
+
+// cycle counter, stays 0 on the host so the synth load meter is inactive
+typedef struct {
+  volatile uint32_t CYCCNT;
+} DWT_Type;
+extern DWT_Type host_dwt;
+#define DWT (&host_dwt)
+
+// signed saturation, a single instruction on the device
+static inline int32_t __SSAT(int32_t val, uint32_t sat) {
+  int32_t max = (1 << (sat - 1)) - 1;
+  if (val > max)
+    return max;
+  if (val < -max - 1)
+    return -max - 1;
+  return val;
+}
+
+// unsigned saturation
+static inline uint32_t __USAT(int32_t val, uint32_t sat) {
+  uint32_t max = (1u << sat) - 1;
+  if (val < 0)
+    return 0;
+  if ((uint32_t)val > max)
+    return max;
+  return val;
+}
+
+static inline void NVIC_SystemReset(void) {}
+
+// memory barrier, only keeps the compiler from reordering on the host
+#define __DMB() __asm__ volatile("" ::: "memory")
+
+#define LINE_LED1 0
+#define palToggleLine(line) ((void)(line))
+#define palSetLine(line) ((void)(line))
+#define palClearLine(line) ((void)(line))
+
+// usb driver types used in midi_usb.h
+#define HAL_USE_USB TRUE
+#define BQ_BUFFER_SIZE(n, size) ((n) * (size))
+#define _base_asynchronous_channel_data
+#define _base_asynchronous_channel_methods void* dummy;
+typedef struct { int dummy; } USBDriver;
+typedef uint8_t usbep_t;
+typedef struct { int dummy; } input_buffers_queue_t;
+typedef struct { int dummy; } output_buffers_queue_t;
+
+#endif
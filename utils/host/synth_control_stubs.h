@@ -0,0 +1,130 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HOST_SYNTH_CONTROL_STUBS_H_
+#define _HOST_SYNTH_CONTROL_STUBS_H_
+
+/*
+ * Stubs for the firmware functions used by synth_control.cpp, include after
+ * it: the system time is now_ms, the usb MIDI output goes to midi_out(), the
+ * settings store is kept in memory (host/config.c has the default config, also
+ * as flash config) and synth_interface points to plain floats. Include <map>
+ * and <string> before synth_control.cpp, which defines min and max.
+ */
+#include <map>
+#include <string>
+
+static systime_t now_ms = 0;
+
+// MIDI output of the usb MIDI device, defined by the host program
+static void midi_out(int n, uint8_t b0, uint8_t b1, uint8_t b2);
+
+systime_t chVTGetSystemTime(void) {
+    return now_ms;
+}
+
+extern "C" {
+
+void midi_usb_MidiSend1(uint8_t port, uint8_t b0) {
+    (void)port;
+    midi_out(1, b0, 0, 0);
+}
+
+void midi_usb_MidiSend2(uint8_t port, uint8_t b0, uint8_t b1) {
+    (void)port;
+    midi_out(2, b0, b1, 0);
+}
+
+void midi_usb_MidiSend3(uint8_t port, uint8_t b0, uint8_t b1, uint8_t b2) {
+    (void)port;
+    midi_out(3, b0, b1, b2);
+}
+
+// USB is always ready
+int midi_usb_MidiGetOutputBufferPending(void) {
+    return 0;
+}
+
+// the same bytes as usb, only recorded once
+void serial_MidiSend1(uint8_t b0) { (void)b0; }
+void serial_MidiSend2(uint8_t b0, uint8_t b1) { (void)b0; (void)b1; }
+void serial_MidiSend3(uint8_t b0, uint8_t b1, uint8_t b2) { (void)b0; (void)b1; (void)b2; }
+
+// settings saved on the device, in memory
+static std::map<std::string, std::string> settings;
+static bool settings_full = false; // settingsStoreSet fails like with a full queue
+
+bool settingsStoreGet(const char* key, char* value) {
+    std::map<std::string, std::string>::iterator s = settings.find(std::string(key, 8));
+    if (s == settings.end())
+        return false;
+    memcpy(value, s->second.data(), 8);
+    return true;
+}
+
+int settingsStoreSet(const char* key, const char* value) {
+    if (settings_full)
+        return -1;
+    settings[std::string(key, 8)] = std::string(value, 8);
+    return 0;
+}
+
+void led_rgb(uint32_t rgb) { (void)rgb; }
+void led_rgb3(int r, int g, int b) { (void)r; (void)g; (void)b; }
+void led_rgb3_blink(int r, int g, int b, sysinterval_t time) { (void)r; (void)g; (void)b; (void)time; }
+void led_updown(uint32_t state) { (void)state; }
+void led_updown_dial(int angle) { (void)angle; }
+void aux_jack_switch_mode_setting(jack2_mode_t mode) { (void)mode; }
+int codec_set_block_size(int size) { return size; }
+
+int msgSend(int size, int* msg) {
+    (void)size;
+    (void)msg;
+    return 0;
+}
+
+// synth parameters are written to plain floats
+synth_interface_t synth_interface;
+float volume;
+static float synth_params[8 + 5 * MAX_VOICECOUNT];
+
+void synth_voice_publish(int voice) { (void)voice; }
+int synth_find_engine(const char* name) { (void)name; return -1; }
+void synth_select_engine(int engine) { (void)engine; }
+
+}
+
+static void synth_interface_init(void) {
+    float* p = synth_params;
+    synth_interface.acc_abs = p++;
+    synth_interface.acc_x = p++;
+    synth_interface.acc_y = p++;
+    synth_interface.acc_z = p++;
+    synth_interface.rot_x = p++;
+    synth_interface.rot_y = p++;
+    synth_interface.rot_z = p++;
+    synth_interface.pedal = p++;
+    for (int v = 0; v < MAX_VOICECOUNT; v++) {
+        synth_interface.note[v] = p++;
+        synth_interface.pres[v] = p++;
+        synth_interface.vpres[v] = p++;
+        synth_interface.but_x[v] = p++;
+        synth_interface.but_y[v] = p++;
+    }
+}
+
+#endif
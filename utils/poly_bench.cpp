@@ -0,0 +1,168 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the single channel poly mode aggregates (poly_aggregate.h)
+ * against summing all buttons per message like synth_control.cpp did before.
+ * Button messages go round robin over 1, 10 and 30 held keys, with a key
+ * released and pressed again now and then, and both results are compared.
+ *
+ * usage: poly_bench [-n messages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "poly_aggregate.h"
+
+#define BUTTONCOUNT 68
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+struct button {
+  bool on;
+  float pres;
+  float but_x;
+  float but_y;
+};
+
+static button buttons[BUTTONCOUNT];
+
+struct result {
+  float pres;
+  float x;
+  float y;
+};
+
+// the loop over all buttons that was in Instrument::button_message
+static result full_sum(void) {
+  float presf = 0.0f;
+  float x = 0.0f;
+  float xw = 0.0f;
+  float y = 0.0f;
+  float yw = 0.0f;
+  for (int i=0; i<BUTTONCOUNT; i++) {
+    if (buttons[i].on) {
+      if (buttons[i].pres > presf) presf = buttons[i].pres;
+      float w = buttons[i].but_x * buttons[i].but_x;
+      x += w * buttons[i].but_x;
+      xw += w;
+      w = buttons[i].but_y * buttons[i].but_y;
+      y += w * buttons[i].but_y;
+      yw += w;
+    }
+  }
+  if (xw > 0.0000001f) x /= xw;
+  if (yw > 0.0000001f) y /= yw;
+  result r = {presf, x, y};
+  return r;
+}
+
+static float rnd(unsigned int* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return ((*seed >> 8) & 0xffff) * (1.0f / 0xffff);
+}
+
+// message k for held keys: mostly new values, every 64th a release and a new press
+static void make_message(int k, int held, unsigned int* seed, int* but, button* b) {
+  *but = (k % held) * (BUTTONCOUNT / held);
+  b->on = (k / held) % 64 != 63;
+  b->pres = b->on ? rnd(seed) : 0.0f;
+  b->but_x = rnd(seed) * 2 - 1;
+  b->but_y = rnd(seed) * 2 - 1;
+}
+
+static int run(int held, int messages) {
+  unsigned int seed = 1;
+  int but;
+  button b;
+  volatile float sink = 0;
+
+  // summing all buttons
+  memset(buttons, 0, sizeof(buttons));
+  double t0 = now();
+  for (int k = 0; k < messages; k++) {
+    make_message(k, held, &seed, &but, &b);
+    buttons[but] = b;
+    result r = full_sum();
+    sink += r.pres + r.x + r.y;
+  }
+  double t_full = now() - t0;
+
+  // running aggregates, checked against the full sum
+  static PolyAggregate<BUTTONCOUNT> poly;
+  poly.reset();
+  memset(buttons, 0, sizeof(buttons));
+  seed = 1;
+  float max_err = 0;
+  for (int k = 0; k < messages; k++) {
+    make_message(k, held, &seed, &but, &b);
+    buttons[but] = b;
+    poly.update(but, b.on, b.pres, b.but_x, b.but_y);
+    if (k % 97 == 0) {
+      result r = full_sum();
+      float err = fabsf(r.pres - poly.pres_max) + fabsf(r.x - poly.x()) + fabsf(r.y - poly.y());
+      if (err > max_err) max_err = err;
+    }
+  }
+  seed = 1;
+  t0 = now();
+  for (int k = 0; k < messages; k++) {
+    make_message(k, held, &seed, &but, &b);
+    poly.update(but, b.on, b.pres, b.but_x, b.but_y);
+    sink += poly.pres_max + poly.x() + poly.y();
+  }
+  double t_poly = now() - t0;
+
+  // message generation cost, subtracted from both
+  seed = 1;
+  t0 = now();
+  for (int k = 0; k < messages; k++) {
+    make_message(k, held, &seed, &but, &b);
+    sink += b.pres;
+  }
+  double t_gen = now() - t0;
+
+  printf("%2d keys held: sum all buttons %.1f ns/message, running aggregates %.1f ns/message, max difference %.2g\n",
+         held, (t_full - t_gen) * 1e9 / messages, (t_poly - t_gen) * 1e9 / messages, max_err);
+  if (max_err > 0.001f) {
+    fprintf(stderr, "running aggregates differ from the full sum\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int messages = 2000000;
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], "-n"))
+      messages = atoi(argv[n+1]);
+  }
+  int r = 0;
+  r |= run(1, messages);
+  r |= run(10, messages);
+  r |= run(30, messages);
+  return r;
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RING_BUFFER_H
+#define _RING_BUFFER_H
+
+/*
+ * Single producer, single consumer byte ring buffer between the usb capture
+ * and the parser thread. The producer never waits, data that doesn't fit is
+ * dropped and counted.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct {
+  uint8_t* data;
+  size_t size;        // power of 2
+  size_t head;        // total bytes written, only changed by the producer
+  size_t tail;        // total bytes read, only changed by the consumer
+  size_t peak;        // highest fill level
+  uint64_t dropped;   // bytes dropped because the buffer was full
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ring_buffer_t;
+
+static inline int ring_init(ring_buffer_t* r, size_t size) {
+  memset(r, 0, sizeof(*r));
+  while (r->size < size) {
+    r->size = r->size ? r->size * 2 : 64;
+  }
+  r->data = (uint8_t*)malloc(r->size);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  return r->data ? 0 : -1;
+}
+
+static inline void ring_free(ring_buffer_t* r) {
+  free(r->data);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+}
+
+static inline size_t ring_fill(ring_buffer_t* r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Producer: copy n bytes in, returns the number of bytes written.
+ */
+static inline size_t ring_write(ring_buffer_t* r, const uint8_t* in, size_t n) {
+  size_t head = r->head;
+  size_t fill = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (n > r->size - fill) {
+    r->dropped += n - (r->size - fill);
+    n = r->size - fill;
+  }
+  size_t pos = head & (r->size - 1);
+  size_t first = n < r->size - pos ? n : r->size - pos;
+  memcpy(&r->data[pos], in, first);
+  memcpy(r->data, &in[first], n - first);
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+  if (fill + n > r->peak)
+    r->peak = fill + n;
+
+  pthread_mutex_lock(&r->lock);
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return n;
+}
+
+/*
+ * Producer: no more data will follow.
+ */
+static inline void ring_close(ring_buffer_t* r) {
+  pthread_mutex_lock(&r->lock);
+  r->closed = 1;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Consumer: wait until data is available, returns a pointer to the contiguous
+ * readable part and its length in n. Returns NULL when the buffer is closed
+ * and empty.
+ */
+static inline const uint8_t* ring_peek(ring_buffer_t* r, size_t* n) {
+  size_t fill;
+  pthread_mutex_lock(&r->lock);
+  while ((fill = ring_fill(r)) == 0 && !r->closed) {
+    pthread_cond_wait(&r->cond, &r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  if (fill == 0) {
+    *n = 0;
+    return NULL;
+  }
+  size_t pos = r->tail & (r->size - 1);
+  *n = fill < r->size - pos ? fill : r->size - pos;
+  return &r->data[pos];
+}
+
+/*
+ * Consumer: release n bytes returned by ring_peek.
+ */
+static inline void ring_consume(ring_buffer_t* r, size_t n) {
+  __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+#endif
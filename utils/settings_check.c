@@ -0,0 +1,429 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * settings_check: host build of settings_store.c on emulated flash with power
+ * loss injection.
+ *
+ * The flash behaves like the H7 bank 2: programming only clears bits, erase
+ * sets a whole sector, and programming a word that is not erased is counted as
+ * an error. For every scenario (append, first append, compact into an erased
+ * and into a used sector, clear) the power is cut at every flash operation, and
+ * the interrupted operation is left torn in several ways: a program with 0 to 8
+ * of its words written (8 is cut just after programming) or with all words half
+ * programmed, an erase not started,
+ * half done or with random bits still set. After each power loss the store is
+ * initialised from flash again, which has to give exactly the settings from
+ * before or from after the operation, the sector with the newest valid header
+ * as active sector and a write position after the last programmed word. A setting written after
+ * that has to be stored without programming a used word.
+ * Changes that are not written yet have to read back as the new value.
+ *
+ * Then append, compact and the initial scan are timed: host cpu time, plus the
+ * flash time of the operations with the program and erase times of -p and -e.
+ *
+ * usage: settings_check [-p us per flash word] [-e ms per sector erase]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#define SETTINGS_FLASH_EMULATED
+#include "../settings_store.c"
+
+#define TEST_KEYS 20
+
+systime_t chVTGetSystemTime(void) {
+  return 0;
+}
+
+/*
+ * Flash emulation
+ */
+#define PROGRAM_TEARS 11 // 0 to 8 words written, half programmed, not torn
+#define ERASE_TEARS 4    // not started, half done, bits left, not torn
+
+static int flash_ops = 0;      // program and erase operations so far
+static int fault_at = -1;      // operation cut by the power loss
+static int fault_tear = 0;     // how it is left
+static jmp_buf power_loss;
+static int overwrites = 0;     // programmed words that were not erased
+static int programs = 0;
+static int erases = 0;
+static unsigned int seed = 1;
+
+static uint32_t random_bits(void) {
+  seed = seed * 1103515245 + 12345;
+  uint32_t r = seed >> 16;
+  seed = seed * 1103515245 + 12345;
+  return (r << 16) ^ (seed >> 8);
+}
+
+static bool flash_erase_sector(int s) {
+  uint32_t* w = (uint32_t*)sectors[s];
+  int words = SETTINGS_SECTOR_SIZE / 4;
+  erases++;
+  if (flash_ops++ == fault_at) {
+    if (fault_tear == 1) {
+      memset(w, 0xff, SETTINGS_SECTOR_SIZE / 2);
+    } else if (fault_tear == 2) {
+      for (int k = 0; k < words; k++) {
+        w[k] |= random_bits();
+      }
+    }
+    if (fault_tear < ERASE_TEARS - 1)
+      longjmp(power_loss, 1);
+  }
+  memset(w, 0xff, SETTINGS_SECTOR_SIZE);
+  return true;
+}
+
+static bool flash_program(settings_record_t* dst, const settings_record_t* src) {
+  uint32_t* d = (uint32_t*)dst;
+  const uint32_t* s = (const uint32_t*)src;
+  const int words = sizeof(settings_record_t) / 4;
+  programs++;
+  if (!record_erased(dst)) {
+    overwrites++;
+  }
+  if (flash_ops++ == fault_at && fault_tear < PROGRAM_TEARS - 1) {
+    for (int k = 0; k < words; k++) {
+      if (fault_tear == PROGRAM_TEARS - 2) {
+        d[k] &= s[k] | random_bits();
+      } else if (k < fault_tear) {
+        d[k] &= s[k];
+      }
+    }
+    longjmp(power_loss, 1);
+  }
+  for (int k = 0; k < words; k++) {
+    d[k] &= s[k];
+  }
+  return true;
+}
+
+/*
+ * Power on: forget everything in RAM and initialise from flash
+ */
+static void power_on(void) {
+  active = -1;
+  write_pos = 0;
+  generation = 0;
+  pending_count = 0;
+  pending_clear = false;
+  fault_at = -1;
+  flash_ops = 0;
+  settingsStoreInit();
+}
+
+static void key_name(int n, char* key) {
+  char s[16];
+  snprintf(s, sizeof(s), "test%04d", n);
+  memcpy(key, s, 8);
+}
+
+static void set(int n, int value) {
+  char key[8], v[16];
+  key_name(n, key);
+  snprintf(v, sizeof(v), "%8d", value);
+  settingsStoreSet(key, v);
+  write_pending();
+}
+
+/*
+ * All test settings, to compare the store before and after an operation
+ */
+typedef struct {
+  char values[TEST_KEYS + 1][8];
+} store_state_t;
+
+static void get_state(store_state_t* st) {
+  memset(st, 0, sizeof(*st));
+  for (int n = 0; n <= TEST_KEYS; n++) {
+    char key[8];
+    key_name(n, key);
+    settingsStoreGet(key, st->values[n]);
+  }
+}
+
+static bool same_state(const store_state_t* a, const store_state_t* b) {
+  return !memcmp(a, b, sizeof(*a));
+}
+
+/*
+ * Scenarios, setup() writes the flash the operation op() starts from
+ */
+static int op_value = 1000;
+
+static void fill(int records) {
+  int v = 0;
+  while (active < 0 || (int)write_pos < records) {
+    set(v % TEST_KEYS, v);
+    v++;
+  }
+}
+
+static void setup_erased(void) {}
+static void setup_keys(void) { fill(TEST_KEYS + 1); }
+static void setup_full(void) { fill(SECTOR_RECORDS); }
+static void setup_full_twice(void) {
+  fill(SECTOR_RECORDS);
+  set(0, -1);
+  fill(SECTOR_RECORDS);
+}
+
+static void op_set(void) { set(TEST_KEYS, op_value); }
+static void op_clear(void) {
+  settingsStoreClear();
+  write_pending();
+}
+
+typedef struct {
+  const char* name;
+  void (*setup)(void);
+  void (*op)(void);
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+  {"first append on erased flash", setup_erased, op_set},
+  {"append", setup_keys, op_set},
+  {"compact into erased sector", setup_full, op_set},
+  {"compact into used sector", setup_full_twice, op_set},
+  {"clear", setup_keys, op_clear},
+  {"clear into used sector", setup_full_twice, op_clear},
+};
+#define SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+static settings_record_t start_flash[2][SECTOR_RECORDS];
+
+/*
+ * After a power loss the active sector has to be the one with the newest valid
+ * header, and the write position after the last programmed word with all
+ * following words erased
+ */
+static bool recovered(void) {
+  int newest = -1;
+  uint32_t gen = 0;
+  for (int s = 0; s < 2; s++) {
+    const settings_record_t* h = &sectors[s][0];
+    if (record_crc(h) == h->crc && !memcmp(h->param.key, header_key, 8) &&
+        (newest < 0 || h->generation > gen)) {
+      newest = s;
+      gen = h->generation;
+    }
+  }
+  if (active != newest)
+    return false;
+  if (active < 0)
+    return true;
+  for (uint32_t n = write_pos; n < SECTOR_RECORDS; n++) {
+    if (!record_erased(&sectors[active][n]))
+      return false;
+  }
+  return write_pos >= 1 && (write_pos == 1 || !record_erased(&sectors[active][write_pos - 1]));
+}
+
+static int check_scenario(const scenario_t* sc) {
+  store_state_t before, after, st;
+  int errors = 0, runs = 0;
+
+  memset(flash_sectors, 0xff, sizeof(flash_sectors));
+  power_on();
+  sc->setup();
+  memcpy(start_flash, flash_sectors, sizeof(start_flash));
+  power_on();
+  get_state(&before);
+
+  // without power loss
+  overwrites = 0;
+  sc->op();
+  int ops = flash_ops;
+  power_on();
+  get_state(&after);
+  if (same_state(&before, &after) || overwrites) {
+    printf("%-30s operation without effect or overwrites: FAILED\n", sc->name);
+    errors++;
+  }
+
+  for (int op = 0; op < ops; op++) {
+    for (int tear = 0; tear < PROGRAM_TEARS; tear++) {
+      memcpy(flash_sectors, start_flash, sizeof(start_flash));
+      power_on();
+      overwrites = 0;
+      fault_at = op;
+      fault_tear = tear;
+      bool lost = false;
+      if (setjmp(power_loss) == 0) {
+        sc->op();
+      } else {
+        lost = true;
+      }
+      if (!lost) // not torn, or an erase
+        continue;
+      runs++;
+
+      power_on();
+      get_state(&st);
+      bool ok = (same_state(&st, &before) || same_state(&st, &after)) && recovered();
+      // recovery: the next setting is written to erased flash
+      set(0, op_value + 1);
+      store_state_t next;
+      get_state(&next);
+      ok = ok && !overwrites && !strncmp(next.values[0], "    1001", 8) &&
+           !memcmp(next.values[1], st.values[1], sizeof(st.values) - 8);
+      if (!ok) {
+        printf("%-30s power loss at operation %d, tear %d: FAILED\n", sc->name, op, tear);
+        errors++;
+      }
+    }
+  }
+  printf("%-30s %3d flash operations, %4d power losses: %s\n",
+         sc->name, ops, runs, errors ? "FAILED" : "ok");
+  return errors;
+}
+
+/*
+ * Values that are not written yet: read back as the new value, hidden by a
+ * clear, and a value equal to the stored one is still written after a clear.
+ * A full queue is reported.
+ */
+static int check_pending(void) {
+  memset(flash_sectors, 0xff, sizeof(flash_sectors));
+  power_on();
+  char key[8], v[16];
+  key_name(1, key);
+  set(1, 11);
+  int errors = 0;
+  char r[8];
+
+  settingsStoreSet(key, "      22");
+  errors += !settingsStoreGet(key, r) || memcmp(r, "      22", 8);
+  settingsStoreClear();
+  errors += settingsStoreGet(key, r);
+  settingsStoreSet(key, "      11");
+  write_pending();
+  power_on();
+  errors += !settingsStoreGet(key, r) || memcmp(r, "      11", 8);
+
+  int full = 0;
+  for (int n = 0; n <= SETTINGS_PENDING; n++) {
+    key_name(n, key);
+    snprintf(v, sizeof(v), "%8d", n + 100);
+    full += settingsStoreSet(key, v) != 0;
+  }
+  errors += full != 1;
+  write_pending();
+
+  printf("%-30s %s\n", "pending changes", errors ? "FAILED" : "ok");
+  return errors;
+}
+
+/*
+ * Timing
+ */
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void timing(double program_us, double erase_ms) {
+  memset(flash_sectors, 0xff, sizeof(flash_sectors));
+  power_on();
+
+  // appends, without the compacts
+  int n = 0, count = 0;
+  double t = 0;
+  set(0, 0);
+  while (write_pos < SECTOR_RECORDS - 1) {
+    n++;
+    char key[8], v[16];
+    key_name(n % TEST_KEYS, key);
+    snprintf(v, sizeof(v), "%8d", n);
+    settingsStoreSet(key, v);
+    double t0 = now();
+    write_pending();
+    t += now() - t0;
+    count++;
+  }
+  printf("append: %.2f us host, 1 flash word, %.0f us flash\n", t * 1e6 / count, program_us);
+
+  double t0 = now();
+  for (int k = 0; k < 100; k++) {
+    power_on();
+  }
+  printf("init with a full sector: %.1f us host\n", (now() - t0) * 1e6 / 100);
+
+  // compact a full sector with few and with many live keys, into the sector
+  // used before so it has to be erased
+  int live[] = {TEST_KEYS, 500, 2000};
+  for (unsigned int k = 0; k < sizeof(live) / sizeof(live[0]); k++) {
+    memset(flash_sectors, 0xff, sizeof(flash_sectors));
+    power_on();
+    n = 0;
+    while (generation < 2 || write_pos < SECTOR_RECORDS) {
+      char key[8], v[16];
+      snprintf(v, sizeof(v), "key%05d", n % live[k]);
+      memcpy(key, v, 8);
+      snprintf(v, sizeof(v), "%8d", n++);
+      settingsStoreSet(key, v);
+      write_pending();
+    }
+    int p = programs, e = erases;
+    t0 = now();
+    compact(true);
+    double t = now() - t0;
+    p = programs - p;
+    e = erases - e;
+    printf("compact %4d live keys: %.2f ms host, %d flash words and %d erase, %.0f ms flash\n",
+           live[k], t * 1e3, p, e, p * program_us * 1e-3 + e * erase_ms);
+
+    t0 = now();
+    for (int r = 0; r < 100; r++) {
+      power_on();
+    }
+    printf("init after that: %.1f us host\n", (now() - t0) * 1e6 / 100);
+  }
+}
+
+int main(int argc, char** argv) {
+  double program_us = 100;
+  double erase_ms = 2000;
+  for (int n = 1; n < argc; n++) {
+    if (!strcmp(argv[n], "-p") && n + 1 < argc) {
+      program_us = atof(argv[++n]);
+    } else if (!strcmp(argv[n], "-e") && n + 1 < argc) {
+      erase_ms = atof(argv[++n]);
+    } else {
+      fprintf(stderr, "usage: %s [-p us per flash word] [-e ms per sector erase]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  int errors = 0;
+  for (int s = 0; s < SCENARIOS; s++) {
+    errors += check_scenario(&scenarios[s]);
+  }
+  errors += check_pending();
+  printf("%s\n", errors ? "FAILED" : "ok");
+
+  timing(program_us, erase_ms);
+  return errors != 0;
+}
@@ -13,12 +13,16 @@
 #include <lo.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <mutex>
 using namespace std;
 
 // Platform-dependent sleep routines.
@@ -31,6 +35,7 @@ using namespace std;
 #endif
 
 #include "striso.h"
+#include "striso_frame.h"
 
 #define SIGCOUNT 153
 
@@ -50,6 +55,9 @@ using namespace std;
 
 #define MAX_MSGSIZE 16
 
+#define RX_SIZE 4096 // bytes per read
+#define OSC_BUNDLE_MAX 256 // messages per OSC bundle, keeps bundles well below the UDP size limit
+
 #define LUT_SIZE 17
 
 #define sign(x) (x>0?1:(x<0?-1:0))
@@ -63,6 +71,9 @@ void osc_send_float(lo_address t, const char* addr, float f);
 
 int display_now = 0;
 
+// held while handling input and by the OSC receive thread
+std::mutex instr_lock;
+
 std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
     std::stringstream ss(s);
     std::string item;
@@ -78,6 +89,44 @@ std::vector<std::string> split(const std::string &s, char delim) {
     return elems;
 }
 
+// OSC messages to the synth, collected in one bundle per input frame
+class OscOut {
+    public:
+        lo_address address;
+        lo_bundle bundle = NULL;
+        int bundle_size = 0;
+        long messages = 0;
+        long bundles = 0;
+
+        OscOut(lo_address a) {
+            address = a;
+        }
+
+        // path has to stay valid until the bundle is sent
+        void send_float(const char* path, float f) {
+            if (!bundle) {
+                bundle = lo_bundle_new(LO_TT_IMMEDIATE);
+            }
+            lo_message m = lo_message_new();
+            lo_message_add_float(m, f);
+            lo_bundle_add_message(bundle, path, m);
+            messages++;
+            if (++bundle_size >= OSC_BUNDLE_MAX) {
+                flush();
+            }
+        }
+
+        void flush() {
+            if (bundle) {
+                lo_send_bundle(address, bundle);
+                lo_bundle_free_recursive(bundle);
+                bundle = NULL;
+                bundle_size = 0;
+                bundles++;
+            }
+        }
+};
+
 typedef enum {
     STATE_OFF = 0,
     STATE_ON = 1,
@@ -105,14 +154,14 @@ class MotionSensor {
             rot_z = msg[6] * 1;
         }
 
-        void send_osc(lo_address t) {
-            osc_send_float(t, (char*)"accelerometer/acc_abs", acc_abs);
-            osc_send_float(t, (char*)"accelerometer/acc_x", acc_x);
-            osc_send_float(t, (char*)"accelerometer/acc_y", acc_y);
-            osc_send_float(t, (char*)"accelerometer/acc_z", acc_z);
-            osc_send_float(t, (char*)"gyroscope/rot_x", rot_x);
-            osc_send_float(t, (char*)"gyroscope/rot_y", rot_y);
-            osc_send_float(t, (char*)"gyroscope/rot_z", rot_z);
+        void send_osc(OscOut* osc) {
+            osc->send_float("/*/accelerometer/acc_abs", acc_abs);
+            osc->send_float("/*/accelerometer/acc_x", acc_x);
+            osc->send_float("/*/accelerometer/acc_y", acc_y);
+            osc->send_float("/*/accelerometer/acc_z", acc_z);
+            osc->send_float("/*/gyroscope/rot_x", rot_x);
+            osc->send_float("/*/gyroscope/rot_y", rot_y);
+            osc->send_float("/*/gyroscope/rot_z", rot_z);
         }
 };
 
@@ -310,10 +359,22 @@ public:
 };
 */
 
+typedef enum {
+    PARAM_NOTE = 0,
+    PARAM_PRES,
+    PARAM_VPRES,
+    PARAM_BUT_X,
+    PARAM_BUT_Y,
+    PARAM_COUNT,
+} voice_param_t;
+
+const char* voice_param_names[PARAM_COUNT] = {"note", "pres", "vpres", "but_x", "but_y"};
+
 class Instrument {
     public:
-        lo_address synth_port;
+        OscOut* osc;
         char* voice_prefix;
+        char osc_paths[MAX_VOICECOUNT][PARAM_COUNT][32];
         Button buttons[BUTTONCOUNT];
         int voices[MAX_VOICECOUNT];
         int portamento_buttons[MAX_PORTAMENTO_BUTTONS];
@@ -332,10 +393,16 @@ class Instrument {
         float bend_sensitivity = 0.25;
         //directUI interface;
 
-        Instrument(lo_address p, char* vp, int* c0, int* c1, int n_buttons, int voicecount1) {
-            synth_port = p;
+        Instrument(OscOut* o, char* vp, int* c0, int* c1, int n_buttons, int voicecount1) {
+            osc = o;
             voice_prefix = vp;
             int n;
+            for (n = 0; n < MAX_VOICECOUNT; n++) {
+                for (int p = 0; p < PARAM_COUNT; p++) {
+                    snprintf(osc_paths[n][p], sizeof(osc_paths[n][p]), "/*/v%s%d/%s",
+                             voice_prefix, n, voice_param_names[p]);
+                }
+            }
             for (n = 0; n < n_buttons; n++) {
                 buttons[n].coord0 = c0[n];
                 buttons[n].coord1 = c1[n];
@@ -349,11 +416,9 @@ class Instrument {
             voicecount = voicecount1;
         }
 
-        void osc_send_float(int voice, const char* addr, float f)
+        void osc_send_float(int voice, voice_param_t param, float f)
         {
-            char msg[64];
-            sprintf(msg, "/*/v%s%d/%s", voice_prefix, voice, addr);
-            lo_send(synth_port, msg, "f", f);
+            osc->send_float(osc_paths[voice][param], f);
         }
 
         int osc_message(vector<string> oscpath, const char *types, lo_arg **argv, int argc, void* msg, void *user_data) {
@@ -605,11 +670,11 @@ class Instrument {
         void update_voice(int but) {
             float pb = bend_sensitivity * pow3(buttons[but].but_x);
 
-            osc_send_float(buttons[but].voice, (char*)"note",  buttons[but].note + pb);
-            osc_send_float(buttons[but].voice, (char*)"pres",  buttons[but].pres);
-            osc_send_float(buttons[but].voice, (char*)"vpres", buttons[but].vpres);
-            osc_send_float(buttons[but].voice, (char*)"but_x", buttons[but].but_x);
-            osc_send_float(buttons[but].voice, (char*)"but_y", buttons[but].but_y);
+            osc_send_float(buttons[but].voice, PARAM_NOTE,  buttons[but].note + pb);
+            osc_send_float(buttons[but].voice, PARAM_PRES,  buttons[but].pres);
+            osc_send_float(buttons[but].voice, PARAM_VPRES, buttons[but].vpres);
+            osc_send_float(buttons[but].voice, PARAM_BUT_X, buttons[but].but_x);
+            osc_send_float(buttons[but].voice, PARAM_BUT_Y, buttons[but].but_y);
 
 #ifdef USE_INTERNAL_SYNTH
             int voice = buttons[but].voice;
@@ -744,6 +809,7 @@ int osc_message(const char *path, const char *types, lo_arg **argv, int argc, vo
 	// process incoming osc message to configure stribri
     vector<string> oscpath = split(&path[1], '/');
     Instrument **instr = (Instrument**)user_data;
+    std::lock_guard<std::mutex> lock(instr_lock);
     int n;
     // TODO: better code
     if (!oscpath[0].compare("dis")) {
@@ -791,7 +857,8 @@ char sig2char2(float sig)
     return vischar[idx];
 }
 
-void int2float(int *msg, float *fmsg, int n) {
+
+void int2float(const int *msg, float *fmsg, int n) {
     int c;
     for (c=0; c<n; c++) {
         fmsg[c] = ((float)msg[c])/0x1fff; //8191, maximum of 14bit signed int
@@ -812,13 +879,6 @@ void osc_send_float(lo_address t, const char* addr, float f)
     lo_send(t, msg, "f", f);
 }
 
-void unpack(uint8_t *in, int *out, int n) {
-    int c;
-    for (c=0; c<n; c++) {
-        out[c] = ( ((int)in[c*2])<<7 | ((int)in[c*2+1]) ) - ( (int)(in[c*2] & 0x40) << 8);
-    }
-}
-
 const char* to_binary(int x) {
     static char b[17];
     b[0] = '\0';
@@ -837,41 +897,361 @@ double sec_since(struct timeval *t) {
     return (double)(t1.tv_sec - t->tv_sec) + (double)(t1.tv_usec - t->tv_usec)/1000000;
 }
 
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Decodes the input streams and handles the messages
+class Bridge {
+    public:
+        OscOut* osc;
+        Instrument* instrs[2];
+        MotionSensor* accel;
+        int protocol;
+        striso_decoder_t decoders[2];
+        int cur_port = 0;
+        uint32_t cur_frame = 0;
+        long messages = 0;
+        FILE* fp_debug = NULL;
+
+        // latency from read to OSC out, measured by the replay benchmark
+        int measure = 0;
+        double t_input = 0;
+        long sent_messages = 0;
+        double latency = 0;
+        double max_latency = 0;
+
+        int msgque_overflow_bb = 0;
+        int msgque_overflow_synth = 0;
+        int msg_too_short_synth = 0;
+        int msg_too_long_synth = 0;
+        int dropped_msgque = 0;
+        int dropped_frames = 0;
+        int lock_wait_max = 0;
+        int msg_cycles_avg = 0;
+        int msg_cycles_max = 0;
+        int battery_voltage = 0;
+        int dsp_load_avg = 0;
+        int dsp_load_peak = 0;
+        int dsp_missed = 0;
+        int dsp_block_size = 0;
+
+        int sld_npress = 0;
+        int sld_volume = 0;
+        int sld_tuneoff = 0;
+        int sld_tunegen = 0;
+
+        struct timeval t_disp, t_cleardeadnotes;
+
+        Bridge(OscOut* o, Instrument* dis, Instrument* bas, MotionSensor* a, int p) {
+            osc = o;
+            instrs[0] = dis;
+            instrs[1] = bas;
+            accel = a;
+            protocol = p;
+            striso_decoder_init(&decoders[0]);
+            striso_decoder_init(&decoders[1]);
+            gettimeofday(&t_disp, NULL);
+            gettimeofday(&t_cleardeadnotes, NULL);
+        }
+
+        // feed bytes read from an input port
+        void input(int port, const uint8_t* data, int n);
+
+        // send the OSC bundle for the handled messages
+        void flush() {
+            osc->flush();
+            if (measure && messages > sent_messages) {
+                double t = now() - t_input;
+                latency += t * (messages - sent_messages);
+                if (t > max_latency) max_latency = t;
+                sent_messages = messages;
+            }
+        }
+
+        void message(int src, int id, int size, const int* msg) {
+            float fmsg[MAX_MSGSIZE/2];
+            Instrument* dis = instrs[0];
+            Instrument* bas = instrs[1];
+            struct timeval t_tmp;
+
+            messages++;
+            if (src == ID_SYS) {
+                if (id == ID_SYS_MSGQUE_OVERFLOW_BB)
+                    msgque_overflow_bb = msg[0];
+                else if (id == ID_SYS_MSGQUE_OVERFLOW_SYNTH)
+                    msgque_overflow_synth = msg[0];
+                else if (id == ID_SYS_MSG_TOO_SHORT_SYNTH)
+                    msg_too_short_synth += msg[0];
+                else if (id == ID_SYS_MSG_TOO_LONG_SYNTH)
+                    msg_too_long_synth += msg[0];
+                else if (id == ID_SYS_BATTERY_VOLTAGE)
+                    battery_voltage = msg[0];
+                else if (id == ID_SYS_DSP_LOAD && size == 4) {
+                    dsp_load_avg = msg[0];
+                    dsp_load_peak = msg[1];
+                    dsp_missed += msg[2];
+                    dsp_block_size = msg[3];
+                }
+                else if (id == ID_SYS_DROPPED && size == 2) {
+                    dropped_msgque += msg[0];
+                    dropped_frames += msg[1];
+                }
+                else if (id == ID_SYS_LOCK_WAIT && size == 1) {
+                    if (msg[0] > lock_wait_max)
+                        lock_wait_max = msg[0];
+                }
+                else if (id == ID_SYS_MSG_CYCLES && size == 3) {
+                    if (msg[2] > 0)
+                        msg_cycles_avg = msg[0];
+                    if (msg[1] > msg_cycles_max)
+                        msg_cycles_max = msg[1];
+                }
+            }
+            else if (src == ID_CONTROL) {
+                if (id == IDC_ALT) {
+                    dis->set_altmode(msg[0]);
+                } else if (id == IDC_PORTAMENTO) {
+                    // Portamento button
+                    dis->set_portamento(msg[0]);
+                } else if (id == IDC_SLD_NPRESS) {
+                    sld_npress = msg[0];
+                } else if (id == IDC_SLD_SLIDE) {
+                    sld_volume += msg[0];
+                } else if (id == IDC_SLD_SLIDEZOOM) {
+                    sld_tuneoff += msg[0];
+                    sld_tunegen += msg[1];
+                } else if (msg[0]) {
+                    float dif = 12.0;
+                    if (dis->portamento) dif = 1.0;
+                    if (id == IDC_OCT_UP) {
+                        dis->change_note_offset(dif);
+                        bas->change_note_offset(dif);
+                    }
+                    if (id == IDC_OCT_DOWN) {
+                        dis->change_note_offset(-dif);
+                        bas->change_note_offset(-dif);
+                    }
+                }
+            }
+            else if (src == ID_ACCEL && size >= 7) {
+                int2float(msg, fmsg, size);
+                accel->message(fmsg);
+                accel->send_osc(osc);
+
+                if (fp_debug) {
+                    gettimeofday(&t_tmp, NULL);
+                    fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, msg[0], msg[1], msg[2], msg[3], msg[4], msg[5], msg[6]);
+                }
+            }
+            else if (src == ID_DIS || src == ID_BAS) {
+                // 6x14bit value, dis or bas button
+                if (fp_debug) {
+                    gettimeofday(&t_tmp, NULL);
+                    if (size == 6)
+                        fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, id, msg[0], msg[1], msg[2], msg[3], msg[4], msg[5]);
+                    if (size == 4)
+                        fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, id, msg[0], msg[1], msg[2], msg[3]);
+                }
+
+                int2float(msg, fmsg, size);
+
+                if (id < BUTTONCOUNT) {
+                    if (src == ID_DIS) {
+                        dis->button_message(id, fmsg, size);
+                    } else if (src == ID_BAS) {
+                        bas->button_message(id, fmsg, size);
+                    }
+                }
+            }
+            else {
+                // unknown message source
+            }
+
+            dis->tick();
+        }
+
+        // display and dead note clearing, called after input and when idle
+        void update() {
+            if (sec_since(&t_disp) > DISP_INTERVAL || display_now) {
+                display_now = 0;
+                gettimeofday(&t_disp, NULL);
+                display();
+            }
+
+            // Turn notes off when no message received since last check
+            if (sec_since(&t_cleardeadnotes) > CLEAR_INTERVAL) {
+                gettimeofday(&t_cleardeadnotes, NULL);
+                for (int n=0;n<2;n++) {
+                    for (int but = 0; but < BUTTONCOUNT; but++) {
+                        if (instrs[n]->buttons[but].state) {
+                            if (instrs[n]->buttons[but].timer == -1) {
+                                float msg[6] = {0,0,0,0,0,0};
+                                instrs[n]->button_message(but, msg, 6);
+                            }
+                            else {
+                                instrs[n]->buttons[but].timer = -1;
+                            }
+                        }
+                    }
+                }
+                osc->flush();
+            }
+        }
+
+        void display() {
+            Instrument* dis = instrs[0];
+            int n;
+            int lostbytes = decoders[0].lost_bytes + decoders[1].lost_bytes;
+            int lostframes = decoders[0].lost_frames + decoders[1].lost_frames;
+
+            #define disp_but(but) printf(" %c%c%c", sig2char(but.signals[0]), sig2char(but.signals[1]), sig2char(but.signals[2]))
+            // #define disp_but2(but) printf(" %c%c%c", sig2char(but.pres), sig2char2(but.x), sig2char2(but.y))
+            #define disp_butv(but) printf(" %3.0f", but.vpres_max * 1000)
+
+            printf("\n");
+            printf(" ges des  as  es bes  f   c   g   d   a   e   b  fis cis gis dis ais\n");
+            for (n=0;n<17;n++) disp_but(dis->buttons[n]);
+            printf("\n");
+            for (n=0;n<17;n++) disp_butv(dis->buttons[n]);
+            printf("\n");
+            for (n=17;n<34;n++) disp_but(dis->buttons[n]);
+            printf("\n");
+            for (n=17;n<34;n++) disp_butv(dis->buttons[n]);
+            printf("\n");
+            for (n=34;n<51;n++) disp_but(dis->buttons[n]);
+            printf("\n");
+            for (n=34;n<51;n++) disp_butv(dis->buttons[n]);
+            printf("\n");
+            for (n=51;n<68;n++) disp_but(dis->buttons[n]);
+            printf("\n");
+            for (n=51;n<68;n++) disp_butv(dis->buttons[n]);
+            printf("\n");
+            printf("\n");
+            //for (n=34;n<51;n++) disp_but(bas->buttons[n]);
+            //printf("\n");
+            // for (n=17;n<34;n++) disp_but(bas->buttons[n]);
+            // printf("\n");
+            // for (n=0;n<17;n++) disp_but(bas->buttons[n]);
+            // printf("\n");
+            // printf("\n");
+            for (n=0;n<dis->voicecount;n++) {
+                printf(" %2d", dis->voices[n]);
+            }
+            printf("\n");
+            printf(" accel x: % 1.2f y: % 1.2f z: % 1.2f abs:% 1.2f", accel->acc_x, accel->acc_y, accel->acc_z, accel->acc_abs);
+            printf(" gyro x: % 1.2f y: % 1.2f z: % 1.2f\n", accel->rot_x, accel->rot_y, accel->rot_z);
+            printf(" port: %d, alt: %d, note_offset: %.2f, sld_npress: %d, vol: %d, off: %d, gen: %d\n", dis->portamento, dis->altmode, dis->note_offset, sld_npress, sld_volume, sld_tuneoff, sld_tunegen);
+            printf(" overflow bb: %d, synth: %d, synth rx errors: %d, lost bytes: %d, vbat: %d\n", msgque_overflow_bb, msgque_overflow_synth, msg_too_short_synth + msg_too_long_synth, lostbytes, battery_voltage);
+            printf(" dsp load: %.1f%%, peak: %.1f%%, missed blocks: %d, block size: %d\n", dsp_load_avg * 0.1f, dsp_load_peak * 0.1f, dsp_missed, dsp_block_size);
+            if (protocol == 2) {
+                printf(" dropped messages: %d, dropped frames: device %d, lost %d, synth lock wait: %d us\n", dropped_msgque, dropped_frames, lostframes, lock_wait_max);
+                printf(" button message: %d cycles, longest %d cycles\n", msg_cycles_avg, msg_cycles_max);
+            }
+            fflush(stdout);
+        }
+};
+
+void handle_message(void* arg, uint32_t timestamp, int src, int id, int size, const int* values) {
+    Bridge* b = (Bridge*)arg;
+    (void)timestamp;
+    if (src == ID_RAW || size > MAX_MSGSIZE/2) {
+        return;
+    }
+    // the decoder counts a frame after its messages, so a changed count means
+    // this message starts a new frame
+    uint32_t frame = b->decoders[b->cur_port].frames;
+    if (frame != b->cur_frame) {
+        b->flush();
+        b->cur_frame = frame;
+    }
+    b->message(src, id, size, values);
+}
+
+void Bridge::input(int port, const uint8_t* data, int n) {
+    cur_port = port;
+    cur_frame = decoders[port].frames;
+    if (measure) {
+        t_input = now();
+    }
+    if (protocol == 2) {
+        striso_decode(&decoders[port], data, n, handle_message, this);
+    }
+    else {
+        // v1 has no frames, bundle per read
+        striso_decode_v1(&decoders[port], data, n, handle_message, this);
+    }
+    flush();
+    if (fp_debug) {
+        fflush(fp_debug);
+    }
+}
+
+/*
+ * Benchmark: feed a capture (striso_util [-2] -p > capture.bin) through the
+ * decoder, message handling and OSC output in chunks like the serial port
+ * delivers them. The latency of a message is the time from its chunk being
+ * read to the OSC bundle of its frame being sent.
+ */
+int replay(Bridge* bridge, const char* filename, int chunk) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return 1;
+    }
+    vector<uint8_t> data;
+    uint8_t buf[RX_SIZE];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + r);
+    }
+    fclose(f);
+    if (chunk < 1) chunk = 1;
+
+    bridge->measure = 1;
+    double t_start = now();
+    for (size_t pos = 0; pos < data.size(); pos += chunk) {
+        int n = min((size_t)chunk, data.size() - pos);
+        bridge->input(0, &data[pos], n);
+    }
+    double t_total = now() - t_start;
+
+    long messages = bridge->messages;
+    printf("%ld messages in %zu bytes, %.0f messages/s, %.0f MB/s\n",
+           messages, data.size(), messages / t_total, data.size() / t_total * 1e-6);
+    printf("latency per message: mean %.2f us, max %.2f us (%d byte chunks)\n",
+           messages ? bridge->latency / messages * 1e6 : 0.0, bridge->max_latency * 1e6, chunk);
+    printf("osc: %ld messages in %ld bundles, lost %u frames %u bytes\n",
+           bridge->osc->messages, bridge->osc->bundles,
+           bridge->decoders[0].lost_frames, bridge->decoders[0].lost_bytes);
+    return 0;
+}
+
 int main( int argc, char *argv[] )
 {
-    struct timeval t_disp, t_cleardeadnotes, t_tmp;
     int fp_inputports[2];
     int n;
 
-    uint8_t cmsg[MAX_MSGSIZE];
-    int msg[MAX_MSGSIZE/2];
-    float fmsg[MAX_MSGSIZE/2];
-    int msgque_overflow_bb = 0;
-    int msgque_overflow_synth = 0;
-    int msg_too_short_synth = 0;
-    int msg_too_long_synth = 0;
-    int lostbytes = 0;
-    int battery_voltage = 0;
-
-    int sld_npress = 0;
-    int sld_volume = 0;
-    int sld_tuneoff = 0;
-    int sld_tunegen = 0;
-
     int n_inputports = 1;
-    int cur_inputport = 0;
     char* inputport = lopts(argv, "-p", (char*)"/dev/ttyACM0");
     char* inputport2 = lopts(argv, "-p2", (char*)"");
     if (strcmp(inputport2, "")) {
         n_inputports = 2;
     }
 
-    FILE *fp_debug;
     char* debugfile = lopts(argv, "-o", (char*)"");
     int debugtofile = strcmp(debugfile, "");
 
     int voicecount = lopt(argv, "-n", 4);
 
+    // protocol 2 reads frames, start the stream with striso_util -2 -P
+    int protocol = lopt(argv, "-v", 1);
+
+    // replay a capture file as benchmark
+    char* replayfile = lopts(argv, "-f", (char*)"");
+
 int c0_dis[68] = {
     6, 5, 5, 4, 4, 3,  2,  2,  1,  1,  0,  0, -1, -2, -2, -3, -3,
     5, 4, 4, 3, 3, 2,  1,  1,  0,  0, -1, -1, -2, -3, -3, -4, -4,
@@ -897,17 +1277,27 @@ int c1_bas[68] = {
     -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8};
 
     lo_address lo_port = lo_address_new(NULL, "5510");
+    OscOut* osc = new OscOut(lo_port);
 
-    Instrument *dis = new Instrument(lo_port, (char*)"", c0_dis, c1_dis, BUTTONCOUNT, voicecount);
-    Instrument *bas = new Instrument(lo_port, (char*)"_bas", c0_bas, c1_bas, BUTTONCOUNT, voicecount);
+    Instrument *dis = new Instrument(osc, (char*)"", c0_dis, c1_dis, BUTTONCOUNT, voicecount);
+    Instrument *bas = new Instrument(osc, (char*)"_bas", c0_bas, c1_bas, BUTTONCOUNT, voicecount);
 
     Instrument *instrs[] = {dis, bas};
 
     MotionSensor *accel = new MotionSensor();
 
-    lo_server osc_host = lo_server_new("5555", NULL);
-    lo_server_add_method(osc_host, NULL, NULL, osc_message, instrs);
-    lo_server_recv_noblock(osc_host, 0);
+    Bridge bridge(osc, dis, bas, accel, protocol);
+
+    if (strcmp(replayfile, "")) {
+        return replay(&bridge, replayfile, lopt(argv, "-c", 512));
+    }
+
+    // OSC messages to configure stribri are received in their own thread
+    lo_server_thread osc_host = lo_server_thread_new("5555", NULL);
+    if (osc_host) {
+        lo_server_thread_add_method(osc_host, NULL, NULL, osc_message, instrs);
+        lo_server_thread_start(osc_host);
+    }
 
     SLEEP( 100 );
 
@@ -920,198 +1310,57 @@ int c1_bas[68] = {
     tio.c_cc[VMIN]=1;
     tio.c_cc[VTIME]=5;
     cfsetspeed(&tio, 500000);
-    fp_inputports[0] = open(inputport, O_RDWR | O_NOCTTY | O_NDELAY);
-    tcsetattr(fp_inputports[0], TCSANOW, &tio);
-    if (n_inputports == 2) {
-        fp_inputports[1] = open(inputport2, O_RDWR | O_NOCTTY | O_NDELAY);
-        tcsetattr(fp_inputports[1], TCSANOW, &tio);
+    char* inputports[2] = {inputport, inputport2};
+    int epfd = epoll_create1(0);
+    for (n = 0; n < n_inputports; n++) {
+        fp_inputports[n] = open(inputports[n], O_RDWR | O_NOCTTY | O_NDELAY);
+        if (fp_inputports[n] < 0) {
+            perror(inputports[n]);
+            return 1;
+        }
+        tcsetattr(fp_inputports[n], TCSANOW, &tio);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = n;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fp_inputports[n], &ev) < 0) {
+            perror(inputports[n]);
+            return 1;
+        }
     }
 
     if (debugtofile) {
-        fp_debug=fopen(debugfile, "w");
+        bridge.fp_debug = fopen(debugfile, "w");
     }
 
-    gettimeofday(&t_disp, NULL);
-    gettimeofday(&t_cleardeadnotes, NULL);
-    int rxsize, src, size, id, r;
-    while (1) {
-
-    	// Receive OSC messages
-        lo_server_recv_noblock(osc_host, 0);
-
-        // Read next message
-        cmsg[0] = 0x00;
-        while (!(cmsg[0] & 0x80)) {
-    		// Receive OSC messages
-            lo_server_recv_noblock(osc_host, 0);
-
-            cur_inputport = (cur_inputport + 1) % n_inputports;
-            r = read(fp_inputports[cur_inputport], cmsg, 1);
-            if (r>0) {
-                lostbytes += r;
-            }
-            else {
-            	SLEEP(1);
-            }
-        }
-        lostbytes--;
-
-        rxsize = ((cmsg[0] & 0x07)+1) * 2;
-        size = cmsg[0] & 0x07;
-
-        if (rxsize > MAX_MSGSIZE) { continue; }
-        for (n=1; n < rxsize; ) {
-            if (read(fp_inputports[cur_inputport], &cmsg[n], 1) == 1) {
-                if (cmsg[n] & 0x80) { break; }
-                n++;
-            }
-        }
-        if (n<rxsize) { continue; }
-
-        // message OK
-        src = (cmsg[0] & 0x7f)>>3;
-        id = cmsg[1];
-        unpack(&cmsg[2], msg, size);
-
-        if (src == ID_SYS) {
-            if (id == ID_SYS_MSGQUE_OVERFLOW_BB)
-                msgque_overflow_bb = msg[0];
-            else if (id == ID_SYS_MSGQUE_OVERFLOW_SYNTH)
-                msgque_overflow_synth = msg[0];
-            else if (id == ID_SYS_MSG_TOO_SHORT_SYNTH)
-                msg_too_short_synth += msg[0];
-            else if (id == ID_SYS_MSG_TOO_LONG_SYNTH)
-                msg_too_long_synth += msg[0];
-            else if (id == ID_SYS_BATTERY_VOLTAGE)
-                battery_voltage = msg[0];
-        }
-        else if (src == ID_CONTROL) {
-            if (id == IDC_ALT) {
-                dis->set_altmode(msg[0]);
-            } else if (id == IDC_PORTAMENTO) {
-                // Portamento button
-                dis->set_portamento(msg[0]);
-            } else if (id == IDC_SLD_NPRESS) {
-                sld_npress = msg[0];
-            } else if (id == IDC_SLD_SLIDE) {
-                sld_volume += msg[0];
-            } else if (id == IDC_SLD_SLIDEZOOM) {
-                sld_tuneoff += msg[0];
-                sld_tunegen += msg[1];
-            } else if (msg[0]) {
-                float dif = 12.0;
-                if (dis->portamento) dif = 1.0;
-                if (id == IDC_OCT_UP) {
-                    dis->change_note_offset(dif);
-                    bas->change_note_offset(dif);
-                }
-                if (id == IDC_OCT_DOWN) {
-                    dis->change_note_offset(-dif);
-                    bas->change_note_offset(-dif);
-                }
-            }
-        }
-        else if (src == ID_ACCEL) {
-            int2float(msg, fmsg, size);
-            accel->message(fmsg);
-            accel->send_osc(lo_port);
-
-            if (debugtofile) {
-                gettimeofday(&t_tmp, NULL);
-                fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, msg[0], msg[1], msg[2], msg[3], msg[4], msg[5], msg[6]);
-                fflush(fp_debug);
-            }
-        }
-        else if (src == ID_DIS || src == ID_BAS) {
-            // 6x14bit value, dis or bas button
-            if (debugtofile) {
-                gettimeofday(&t_tmp, NULL);
-                if (size == 6)
-                    fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, id, msg[0], msg[1], msg[2], msg[3], msg[4], msg[5]);
-                if (size == 4)
-                    fprintf(fp_debug, "%.4f, %d, %d, %d, %d, %d, %d\n", (double)t_tmp.tv_sec + (double)t_tmp.tv_usec/1000000, src, id, msg[0], msg[1], msg[2], msg[3]);
-                fflush(fp_debug);
-            }
-
-            int2float(msg, fmsg, size);
-
-            if (id < BUTTONCOUNT) {
-                if (src == ID_DIS) {
-                    dis->button_message(id, fmsg, size);
-                } else if (src == ID_BAS) {
-                    bas->button_message(id, fmsg, size);
+    // Wait for input, read everything that is available at once
+    uint8_t rxbuf[RX_SIZE];
+    int open_ports = n_inputports;
+    while (open_ports) {
+        struct epoll_event events[2];
+        int ne = epoll_wait(epfd, events, 2, DISP_INTERVAL * 1000);
+
+        std::lock_guard<std::mutex> lock(instr_lock);
+        for (int e = 0; e < ne; e++) {
+            int port = events[e].data.u32;
+            int r;
+            while ((r = read(fp_inputports[port], rxbuf, sizeof(rxbuf))) > 0) {
+                bridge.input(port, rxbuf, r);
+                if (r < (int)sizeof(rxbuf)) {
+                    break;
                 }
             }
-        }
-        else {
-            // unknown message source
-        }
-
-        #define disp_but(but) printf(" %c%c%c", sig2char(but.signals[0]), sig2char(but.signals[1]), sig2char(but.signals[2]))
-        // #define disp_but2(but) printf(" %c%c%c", sig2char(but.pres), sig2char2(but.x), sig2char2(but.y))
-        #define disp_butv(but) printf(" %3.0f", but.vpres_max * 1000)
-
-        // Display information
-        if (sec_since(&t_disp) > DISP_INTERVAL || display_now) {
-            display_now = 0;
-            gettimeofday(&t_disp, NULL);
-            printf("\n");
-            printf(" ges des  as  es bes  f   c   g   d   a   e   b  fis cis gis dis ais\n");
-            for (n=0;n<17;n++) disp_but(dis->buttons[n]);
-            printf("\n");
-            for (n=0;n<17;n++) disp_butv(dis->buttons[n]);
-            printf("\n");
-            for (n=17;n<34;n++) disp_but(dis->buttons[n]);
-            printf("\n");
-            for (n=17;n<34;n++) disp_butv(dis->buttons[n]);
-            printf("\n");
-            for (n=34;n<51;n++) disp_but(dis->buttons[n]);
-            printf("\n");
-            for (n=34;n<51;n++) disp_butv(dis->buttons[n]);
-            printf("\n");
-            for (n=51;n<68;n++) disp_but(dis->buttons[n]);
-            printf("\n");
-            for (n=51;n<68;n++) disp_butv(dis->buttons[n]);
-            printf("\n");
-            printf("\n");
-            //for (n=34;n<51;n++) disp_but(bas->buttons[n]);
-            //printf("\n");
-            // for (n=17;n<34;n++) disp_but(bas->buttons[n]);
-            // printf("\n");
-            // for (n=0;n<17;n++) disp_but(bas->buttons[n]);
-            // printf("\n");
-            // printf("\n");
-            for (n=0;n<dis->voicecount;n++) {
-                printf(" %2d", dis->voices[n]);
-            }
-            printf("\n");
-            printf(" accel x: % 1.2f y: % 1.2f z: % 1.2f abs:% 1.2f", accel->acc_x, accel->acc_y, accel->acc_z, accel->acc_abs);
-            printf(" gyro x: % 1.2f y: % 1.2f z: % 1.2f\n", accel->rot_x, accel->rot_y, accel->rot_z);
-            printf(" port: %d, alt: %d, note_offset: %.2f, sld_npress: %d, vol: %d, off: %d, gen: %d\n", dis->portamento, dis->altmode, dis->note_offset, sld_npress, sld_volume, sld_tuneoff, sld_tunegen);
-            printf(" overflow bb: %d, synth: %d, synth rx errors: %d, lost bytes: %d, vbat: %d\n", msgque_overflow_bb, msgque_overflow_synth, msg_too_short_synth + msg_too_long_synth, lostbytes, battery_voltage);
-            fflush(stdout);
-        }
-
-        dis->tick();
-
-        // Turn notes off when no message received since last check
-        if (sec_since(&t_cleardeadnotes) > CLEAR_INTERVAL) {
-            gettimeofday(&t_cleardeadnotes, NULL);
-            for (n=0;n<2;n++) {
-                for (int but = 0; but < BUTTONCOUNT; but++) {
-                    if (instrs[n]->buttons[but].state) {
-                        if (instrs[n]->buttons[but].timer == -1) {
-                            float msg[6] = {0,0,0,0,0,0};
-                            instrs[n]->button_message(but, msg, 6);
-                        }
-                        else {
-                            instrs[n]->buttons[but].timer = -1;
-                        }
-                    }
-                }
+            if (r == 0 || (r < 0 && errno != EAGAIN)) {
+                fprintf(stderr, "%s closed\n", inputports[port]);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fp_inputports[port], NULL);
+                close(fp_inputports[port]);
+                open_ports--;
             }
         }
+        bridge.update();
     }
 
+    if (osc_host) {
+        lo_server_thread_free(osc_host);
+    }
     return 0;
 }
@@ -0,0 +1 @@
+../striso_frame.h
\ No newline at end of file
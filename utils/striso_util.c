@@ -25,8 +25,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "libusb.h"
+#include "striso_frame.h"
+#include "ring_buffer.h"
 
 #if defined(_WIN32)
 #define msleep(msecs) Sleep(msecs)
@@ -60,6 +64,10 @@
 // Global variables
 static bool binary_dump = false;
 static bool extra_info = false;
+static bool framed = false;
+static bool async_mode = false;
+static bool unpaced = false;
+static const char* raw_file = NULL;
 static const char* binary_name = NULL;
 
 static int perr(char const *format, ...)
@@ -127,6 +135,7 @@ static enum test_type {
 	USE_GENERIC,
 	USE_PIPEBULK,
 	USE_PIPETEXT,
+	USE_PIPERAW,
 	USE_PIPESTOP,
 	USE_MIDI_MONITOR,
 	USE_VERSION,
@@ -183,11 +192,11 @@ static int pipe_bulk(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	memset(buffer, 0, sizeof(buffer));
 
 	// enable Striso binary protocol
-	printf("Enable Striso binary protocol:\n");
+	printf("Enable Striso binary protocol%s:\n", framed ? " v2" : "");
 	buffer[0] = 'S';
 	buffer[1] = 't';
 	buffer[2] = 'c';
-	buffer[3] = 'S';
+	buffer[3] = framed ? 'F' : unpaced ? 'U' : 'S';
 	CALL_CHECK(libusb_bulk_transfer(handle, endpoint_out, (unsigned char*)&buffer, 4, &size, 100));
 	//printf("   send %d bytes\n", size);
 
@@ -208,6 +217,16 @@ void unpack(uint8_t *in, int *out, int n) {
     }
 }
 
+static void print_message(void* arg, uint32_t timestamp, int src, int id, int size, const int* values)
+{
+	(void)arg;
+	fprintf(stdout, "%u,%d,%d", timestamp, src, id);
+	for (int i=0; i<size; i++) {
+		fprintf(stdout, ",%d", values[i]);
+	}
+	fprintf(stdout, "\n");
+}
+
 // Pipe data from Striso bulk device to stdout
 static int pipe_text(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out)
 {
@@ -216,11 +235,11 @@ static int pipe_text(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	memset(buffer, 0, sizeof(buffer));
 
 	// enable Striso binary protocol
-	printf("Enable Striso binary protocol:\n");
+	printf("Enable Striso binary protocol%s:\n", framed ? " v2" : "");
 	buffer[0] = 'S';
 	buffer[1] = 't';
 	buffer[2] = 'c';
-	buffer[3] = 'S';
+	buffer[3] = framed ? 'F' : unpaced ? 'U' : 'S';
 	CALL_CHECK(libusb_bulk_transfer(handle, endpoint_out, (unsigned char*)&buffer, 4, &size, 100));
 	//printf("   send %d bytes\n", size);
 
@@ -231,10 +250,22 @@ static int pipe_text(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	int done = 0;
 	int lostbytes = 0;
 	int rxsize, msgsize = 0;
+	striso_decoder_t decoder;
+	uint32_t lost_frames = 0;
+	striso_decoder_init(&decoder);
 
 	while (r == LIBUSB_SUCCESS || r == LIBUSB_ERROR_TIMEOUT) {
 		r = libusb_bulk_transfer(handle, endpoint_in, (unsigned char*)&buffer, sizeof(buffer), &size, 100);
 		//printf("   received %d bytes\n", size);
+		if (framed) {
+			// v2 frames, prefix messages with the device time in microseconds
+			striso_decode(&decoder, buffer, size, print_message, NULL);
+			if (decoder.lost_frames != lost_frames) {
+				lost_frames = decoder.lost_frames;
+				printf("lost frames: %u, lost bytes: %u\n", decoder.lost_frames, decoder.lost_bytes);
+			}
+			continue;
+		}
 		idx = -1;
 
 		while (++idx < size) {
@@ -283,6 +314,245 @@ static int pipe_text(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	return 0;
 }
 
+/*
+ * Raw sensor stream file, memory mappable with numpy:
+ *   header: char magic[8] "StrisoR1", uint32 header size, uint32 record size
+ *   records: uint64 time in us, uint16 column, uint16 number of values,
+ *            uint32 reserved, int16 values[4][4] (rows x p, s0, s1, s2)
+ * See load_raw() in striso_util.py.
+ */
+#define RAW_VALUES 16
+
+struct raw_record {
+	uint64_t time;
+	uint16_t column;
+	uint16_t count;
+	uint32_t reserved;
+	int16_t values[RAW_VALUES];
+};
+
+struct raw_writer {
+	FILE* file;
+	uint64_t time;
+	uint32_t last_timestamp;
+	uint32_t records;
+};
+
+static void write_raw(void* arg, uint32_t timestamp, int src, int id, int size, const int* values)
+{
+	struct raw_writer* w = (struct raw_writer*)arg;
+	if (src != ID_RAW || size != RAW_VALUES) {
+		return;
+	}
+	// unwrap the 28 bit device time, starts at the time since boot
+	w->time += (timestamp - w->last_timestamp) & 0x0fffffff;
+	w->last_timestamp = timestamp;
+
+	struct raw_record r;
+	memset(&r, 0, sizeof(r));
+	r.time = w->time;
+	r.column = id;
+	r.count = size;
+	for (int i=0; i<size; i++) {
+		r.values[i] = values[i];
+	}
+	fwrite(&r, sizeof(r), 1, w->file);
+	w->records++;
+}
+
+// Write raw sensor stream from Striso bulk device to a file
+static int pipe_raw(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out)
+{
+	int r, size;
+	uint8_t buffer[512];
+	memset(buffer, 0, sizeof(buffer));
+
+	struct raw_writer w;
+	memset(&w, 0, sizeof(w));
+	w.file = fopen(raw_file, "wb");
+	if (w.file == NULL) {
+		perr("  Opening %s failed.\n", raw_file);
+		return -1;
+	}
+	uint32_t header[4];
+	memcpy(header, "StrisoR1", 8);
+	header[2] = sizeof(header);
+	header[3] = sizeof(struct raw_record);
+	fwrite(header, sizeof(header), 1, w.file);
+
+	// enable raw sensor stream
+	printf("Enable Striso raw sensor stream:\n");
+	buffer[0] = 'S';
+	buffer[1] = 't';
+	buffer[2] = 'c';
+	buffer[3] = 'R';
+	CALL_CHECK(libusb_bulk_transfer(handle, endpoint_out, (unsigned char*)&buffer, 4, &size, 100));
+
+	striso_decoder_t decoder;
+	striso_decoder_init(&decoder);
+	uint32_t frames = 0;
+	do {
+		r = libusb_bulk_transfer(handle, endpoint_in, (unsigned char*)&buffer, sizeof(buffer), &size, 100);
+		striso_decode(&decoder, buffer, size, write_raw, &w);
+		fflush(w.file);
+		if (decoder.frames / 1000 != frames / 1000) {
+			printf("\rrecords: %u, frames: %u, lost frames: %u, lost bytes: %u ",
+			       w.records, decoder.frames, decoder.lost_frames, decoder.lost_bytes);
+		}
+		frames = decoder.frames;
+	} while (r == LIBUSB_SUCCESS || r == LIBUSB_ERROR_TIMEOUT);
+	fclose(w.file);
+	ERR_EXIT(r);
+
+	return 0;
+}
+
+/*
+ * Asynchronous capture: several bulk transfers are kept in flight so no data
+ * is lost between transfers when the device streams at full rate. Received
+ * data goes through a ring buffer to a separate thread that parses and
+ * outputs it, statistics are printed every second.
+ */
+#define ASYNC_TRANSFERS 8
+#define ASYNC_TRANSFER_SIZE 4096
+#define ASYNC_RING_SIZE (1 << 20)
+
+struct async_capture {
+	ring_buffer_t ring;
+	bool text;
+	volatile bool stop;
+	int active;
+	uint64_t bytes;
+	uint32_t transfers;
+	uint32_t errors;
+	striso_decoder_t decoder;
+	uint64_t messages;
+};
+
+static void LIBUSB_CALL async_callback(struct libusb_transfer *transfer)
+{
+	struct async_capture* c = (struct async_capture*)transfer->user_data;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		if (transfer->actual_length > 0) {
+			ring_write(&c->ring, transfer->buffer, transfer->actual_length);
+			c->bytes += transfer->actual_length;
+			c->transfers++;
+		}
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	default:
+		// device gone or endpoint stalled
+		c->errors++;
+		c->stop = true;
+		break;
+	}
+	if (!c->stop && libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+		return;
+	c->active--;
+}
+
+static void* async_parse(void* arg)
+{
+	struct async_capture* c = (struct async_capture*)arg;
+	const uint8_t* data;
+	size_t n;
+	while ((data = ring_peek(&c->ring, &n)) != NULL) {
+		striso_frame_callback_t callback = c->text ? print_message : NULL;
+		if (!c->text) {
+			write(1, data, n);
+		}
+		// binary output is decoded as well for the statistics
+		if (framed) {
+			c->messages += striso_decode(&c->decoder, data, n, callback, NULL);
+		} else {
+			c->messages += striso_decode_v1(&c->decoder, data, n, callback, NULL);
+		}
+		ring_consume(&c->ring, n);
+	}
+	fflush(stdout);
+	return NULL;
+}
+
+static void async_statistics(struct async_capture* c, double seconds, uint64_t bytes, uint64_t messages)
+{
+	printf("%.0f kB/s, %.0f msg/s, ring peak: %zu%%, ring dropped: %llu bytes, "
+	       "frames: %u, lost frames: %u, lost bytes: %u, usb errors: %u\n",
+	       bytes / seconds * 1e-3, messages / seconds, c->ring.peak * 100 / c->ring.size,
+	       (unsigned long long)c->ring.dropped, c->decoder.frames,
+	       c->decoder.lost_frames, c->decoder.lost_bytes, c->errors);
+}
+
+static int pipe_async(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out, bool text)
+{
+	int r, size;
+	uint8_t buffer[4];
+	static uint8_t buffers[ASYNC_TRANSFERS][ASYNC_TRANSFER_SIZE];
+	struct libusb_transfer* transfers[ASYNC_TRANSFERS];
+	struct async_capture c;
+	pthread_t parser;
+
+	// enable Striso binary protocol
+	printf("Enable Striso binary protocol%s, asynchronous capture:\n", framed ? " v2" : "");
+	buffer[0] = 'S';
+	buffer[1] = 't';
+	buffer[2] = 'c';
+	buffer[3] = framed ? 'F' : unpaced ? 'U' : 'S';
+	CALL_CHECK(libusb_bulk_transfer(handle, endpoint_out, (unsigned char*)&buffer, 4, &size, 100));
+
+	memset(&c, 0, sizeof(c));
+	c.text = text;
+	striso_decoder_init(&c.decoder);
+	if (ring_init(&c.ring, ASYNC_RING_SIZE)) {
+		perr("  Allocating ring buffer failed.\n");
+		return -1;
+	}
+	pthread_create(&parser, NULL, async_parse, &c);
+
+	for (int i=0; i<ASYNC_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, endpoint_in, buffers[i], ASYNC_TRANSFER_SIZE,
+		                          async_callback, &c, 0);
+		if (libusb_submit_transfer(transfers[i]) == LIBUSB_SUCCESS)
+			c.active++;
+	}
+
+	struct timeval tv = {0, 100000};
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	uint64_t last_bytes = 0, last_messages = 0;
+	r = LIBUSB_SUCCESS;
+	while (c.active > 0) {
+		r = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+		if (dt >= 1.0) {
+			async_statistics(&c, dt, c.bytes - last_bytes, c.messages - last_messages);
+			last_bytes = c.bytes;
+			last_messages = c.messages;
+			t0 = t1;
+		}
+	}
+
+	ring_close(&c.ring);
+	pthread_join(parser, NULL);
+	for (int i=0; i<ASYNC_TRANSFERS; i++) {
+		libusb_free_transfer(transfers[i]);
+	}
+	printf("total: %llu bytes in %u transfers, %llu messages, ring dropped: %llu bytes, lost frames: %u\n",
+	       (unsigned long long)c.bytes, c.transfers, (unsigned long long)c.messages,
+	       (unsigned long long)c.ring.dropped, c.decoder.lost_frames);
+	ring_free(&c.ring);
+	if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+		ERR_EXIT(r);
+
+	return 0;
+}
+
 // Send command to Striso bulk device
 static int striso_command(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out, uint8_t command)
 {
@@ -523,10 +793,19 @@ static int test_device(uint16_t vid, uint16_t pid)
 		striso_command(handle, endpoint_in, endpoint_out, 'B');
 		break;
 	case USE_PIPEBULK:
-		pipe_bulk(handle, endpoint_in, endpoint_out);
+		if (async_mode)
+			pipe_async(handle, endpoint_in, endpoint_out, false);
+		else
+			pipe_bulk(handle, endpoint_in, endpoint_out);
 		break;
 	case USE_PIPETEXT:
-		pipe_text(handle, endpoint_in, endpoint_out);
+		if (async_mode)
+			pipe_async(handle, endpoint_in, endpoint_out, true);
+		else
+			pipe_text(handle, endpoint_in, endpoint_out);
+		break;
+	case USE_PIPERAW:
+		pipe_raw(handle, endpoint_in, endpoint_out);
 		break;
 	case USE_PIPESTOP:
 		striso_command(handle, endpoint_in, endpoint_out, 's');
@@ -625,6 +904,23 @@ int main(int argc, char** argv)
 				case 'B':
 					test_mode = USE_BOOTLOADER;
 					break;
+				case '2':
+					framed = true;
+					break;
+				case 'a':
+					async_mode = true;
+					break;
+				case 'u':
+					unpaced = true;
+					break;
+				case 'r':
+					if (j + 1 < argc) {
+						test_mode = USE_PIPERAW;
+						raw_file = argv[++j];
+					} else {
+						show_help = true;
+					}
+					break;
 				default:
 					show_help = true;
 					break;
@@ -641,6 +937,10 @@ int main(int argc, char** argv)
 		printf("   -P      : pipe binary striso data, retry on disconnect\n");
 		printf("   -t      : pipe text striso data\n");
 		printf("   -T      : pipe text striso data, retry on disconnect\n");
+		printf("   -2      : use framed protocol v2 with -p/-P/-t/-T, text has the device time in us first\n");
+		printf("   -r file : write raw sensor stream to file, load with striso_util.py load_raw()\n");
+		printf("   -a      : asynchronous capture with -p/-P/-t/-T, shows throughput and drops on stderr\n");
+		printf("   -u      : message protocol without the Axoloti pacing of 2 messages per ms\n");
 		printf("   -s      : stop striso data stream\n");
 		printf("   -v      : request firmware version\n");
 		printf("   -d      : reboot to DFU firmware update mode\n");
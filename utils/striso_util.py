@@ -4,6 +4,8 @@ Created: 6 Nov 2019
 Author: Piers Titus van der Torren <pierstitus@striso.org>
 """
 
+import os
+
 import numpy as np
 import sh
 
@@ -37,6 +39,22 @@ def calculate(msg):
             but_y = 0.0
         return signals + [pres, vpres, but_x, but_y]
 
+raw_dtype = np.dtype([('time', '<u8'), ('column', '<u2'), ('count', '<u2'),
+                      ('reserved', '<u4'), ('values', '<i2', (4, 4))])
+
+def load_raw(filename):
+    """Load a raw sensor stream recorded with `striso_util -r filename`.
+
+    Returns a memory mapped record array with fields time [us], column and
+    values[row, signal], signals p, s0, s1, s2 as sums of 4 adc samples.
+    The button number is column + 17 * row.
+    """
+    header = np.fromfile(filename, dtype='<u4', count=4)
+    if len(header) < 4 or header[:2].tobytes() != b'StrisoR1' or header[3] != raw_dtype.itemsize:
+        raise ValueError('{} is not a Striso raw sensor stream'.format(filename))
+    count = (os.path.getsize(filename) - int(header[2])) // raw_dtype.itemsize
+    return np.memmap(filename, dtype=raw_dtype, mode='r', offset=int(header[2]), shape=(count,))
+
 class Striso(object):
     def __init__(self, update=None):
         self.layout, self.buttons = dcompose.get_default()
@@ -0,0 +1,398 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * synth_render: offline renderer and benchmark for the internal synth
+ *
+ * Builds the generated synth.cpp on the host with the stubs in host/, drives
+ * synthThread() block by block from a recorded Striso protocol trace and writes
+ * the output as wav. The trace is the text output of striso_util -t with a time
+ * in seconds in front of every line, record one with:
+ *
+ *   ./striso_util -t | ts -s '%.s' > trace.txt
+ *
+ * Button messages are mapped to voices similar to synth_control.cpp with the
+ * default 12tet layout and sensitivities, so the render sounds like the device
+ * in its default preset. Afterwards the time spent in the synth is reported.
+ *
+ * With -c the render is compared to an earlier one, to check a regenerated or
+ * changed synth.cpp against the previous version. Build a second renderer with
+ * -DSYNTH_CPP='"other.cpp"' to render another version of the synth.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <vector>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#include <pmmintrin.h>
+#endif
+
+#ifndef SYNTH_CPP
+#define SYNTH_CPP "../synth.cpp"
+#endif
+#include SYNTH_CPP
+#include "striso.h"
+
+#define BUTTONCOUNT 68
+#define TAIL_TIME 1.0f // seconds rendered after the last message
+#define BENCH_BLOCKS 4000
+
+typedef struct {
+    float time;
+    int src;
+    int id;
+    int size;
+    int msg[7];
+} trace_msg_t;
+
+// button layout, same as c0_dis and c1_dis in synth_control.cpp
+static const int c0_dis[BUTTONCOUNT] = {
+    6, 5, 5, 4, 4, 3,  2,  2,  1,  1,  0,  0, -1, -2, -2, -3, -3,
+    5, 4, 4, 3, 3, 2,  1,  1,  0,  0, -1, -1, -2, -3, -3, -4, -4,
+    4, 3, 3, 2, 2, 1,  0,  0, -1, -1, -2, -2, -3, -4, -4, -5, -5,
+    3, 2, 2, 1, 1, 0, -1, -1, -2, -2, -3, -3, -4, -5, -5, -6, -6};
+
+static const int c1_dis[BUTTONCOUNT] = {
+    -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8,
+    -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8,
+    -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8,
+    -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8};
+
+static std::vector<trace_msg_t> trace;
+static size_t trace_pos = 0;
+static int voice_button[MAX_VOICECOUNT];
+static float voice_pres[MAX_VOICECOUNT];
+
+static int block = 0;
+static int trace_block = 0; // block at which the trace started
+static int total_blocks = 0;
+static int32_t block_buf[MAX_PLAYBACK_BUFFER_SIZE];
+static std::vector<int32_t> render;
+static int active_voice_blocks = 0;
+
+static struct timespec block_time;
+static double synth_ns = 0;
+
+DWT_Type host_dwt;
+volatile int codec_block_size = CHANNEL_BUFFER_SIZE;
+
+static double elapsed_ns(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static int read_trace(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        trace_msg_t m;
+        int n = 0;
+        if (sscanf(line, "%f %d,%d%n", &m.time, &m.src, &m.id, &n) < 3) {
+            fprintf(stderr, "%s:%d: can't parse line\n", filename, lineno);
+            continue;
+        }
+        m.size = 0;
+        char* p = line + n;
+        while (*p == ',' && m.size < 7) {
+            m.msg[m.size++] = strtol(p + 1, &p, 10);
+        }
+        trace.push_back(m);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void button_message(int but, const int* msg) {
+    float pres = msg[0] / (float)0x1fff;
+    float vpres = msg[1] / (float)0x1fff;
+    float but_x = msg[2] / (float)0x1fff;
+    float but_y = msg[3] / (float)0x1fff;
+
+    int voice = -1;
+    for (int v = 0; v < VOICECOUNT; v++) {
+        if (voice_button[v] == but)
+            voice = v;
+    }
+    if (voice < 0) {
+        if (pres <= 0.0f)
+            return;
+        // take a free voice, else the one with the lowest pressure
+        float min_pres = 2.0f;
+        for (int v = 0; v < VOICECOUNT; v++) {
+            if (voice_button[v] < 0) {
+                voice = v;
+                break;
+            }
+            if (voice_pres[v] < min_pres) {
+                min_pres = voice_pres[v];
+                voice = v;
+            }
+        }
+        voice_button[voice] = but;
+    }
+
+    voice_pres[voice] = pres;
+    *synth_interface.note[voice] = 62 + 12 * c0_dis[but] + 7 * c1_dis[but] + but_x * but_x * but_x;
+    *synth_interface.pres[voice] = pres;
+    *synth_interface.vpres[voice] = vpres;
+    *synth_interface.but_x[voice] = but_x;
+    *synth_interface.but_y[voice] = min(max(but_y, -1.0f), 1.0f);
+    synth_voice_publish(voice);
+    if (pres <= 0.0f)
+        voice_button[voice] = -1;
+}
+
+static void motion_message(const int* msg) {
+    // inverse of the scaling in motionsensor.c
+    float acc_abs = sqrtf((float)msg[0] * msg[0] + (float)msg[1] * msg[1] + (float)msg[2] * msg[2]);
+    if (acc_abs > 0.0f) {
+        *synth_interface.acc_x = msg[0] / acc_abs;
+        *synth_interface.acc_y = msg[1] / acc_abs;
+        *synth_interface.acc_z = msg[2] / acc_abs;
+    }
+    *synth_interface.acc_abs = msg[3] / 1024.0f;
+    *synth_interface.rot_x = msg[4] / 8192.0f;
+    *synth_interface.rot_y = msg[5] / 8192.0f;
+    *synth_interface.rot_z = msg[6] / 8192.0f;
+}
+
+static void trace_message(const trace_msg_t* m) {
+    if ((m->src == ID_DIS || m->src == ID_BAS) && m->size == 4 && m->id >= 0 && m->id < BUTTONCOUNT) {
+        if (m->src == ID_DIS)
+            button_message(m->id, m->msg);
+    } else if (m->src == ID_ACCEL && m->size == 7) {
+        motion_message(m->msg);
+    } else if (m->src == ID_CONTROL && m->id == IDC_PEDAL_EXP && m->size >= 1) {
+        *synth_interface.pedal = m->msg[0] / (float)0x1fff;
+    }
+}
+
+/*
+ * Called by synthThread() before each block, applies the trace up to the
+ * start of the block.
+ */
+eventmask_t chEvtWaitOne(eventmask_t events) {
+    float t = (float)(block - trace_block) * codec_block_size / SAMPLINGFREQ;
+    while (trace_pos < trace.size() && trace[trace_pos].time <= t) {
+        trace_message(&trace[trace_pos++]);
+    }
+    for (int v = 0; v < VOICECOUNT; v++) {
+        if (*synth_interface.pres[v] > 0.0f || slots[cur_slot].voice_hold[v] > 0)
+            active_voice_blocks++;
+    }
+    outbuf = block_buf;
+    clock_gettime(CLOCK_MONOTONIC, &block_time);
+    return events;
+}
+
+/*
+ * Called by synthThread() after each block.
+ */
+bool chThdShouldTerminateX(void) {
+    synth_ns += elapsed_ns(&block_time);
+    render.insert(render.end(), block_buf, block_buf + codec_block_size * 2);
+    return ++block >= total_blocks;
+}
+
+static void put32(FILE* f, uint32_t v) {
+    fwrite(&v, 4, 1, f);
+}
+
+static void put16(FILE* f, uint16_t v) {
+    fwrite(&v, 2, 1, f);
+}
+
+static int write_wav(const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    uint32_t data_size = render.size() * sizeof(int32_t);
+    fwrite("RIFF", 4, 1, f);
+    put32(f, 36 + data_size);
+    fwrite("WAVEfmt ", 8, 1, f);
+    put32(f, 16);
+    put16(f, 1); // PCM
+    put16(f, 2);
+    put32(f, SAMPLINGFREQ);
+    put32(f, SAMPLINGFREQ * 2 * sizeof(int32_t));
+    put16(f, 2 * sizeof(int32_t));
+    put16(f, 32);
+    fwrite("data", 4, 1, f);
+    put32(f, data_size);
+    fwrite(render.data(), sizeof(int32_t), render.size(), f);
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Compare the render with a wav file written by write_wav(), reports the
+ * difference relative to the reference and its peak.
+ */
+static int compare_wav(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    char header[44];
+    if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, "RIFF", 4) != 0 ||
+        memcmp(header + 36, "data", 4) != 0) {
+        fprintf(stderr, "%s: not a wav file from synth_render\n", filename);
+        fclose(f);
+        return -1;
+    }
+    std::vector<int32_t> ref(render.size());
+    size_t n = fread(ref.data(), sizeof(int32_t), ref.size(), f);
+    fclose(f);
+    double ref_sum = 0.0, diff_sum = 0.0, diff_peak = 0.0;
+    for (size_t k = 0; k < n; k++) {
+        double d = (double)render[k] - ref[k];
+        ref_sum += (double)ref[k] * ref[k];
+        diff_sum += d * d;
+        diff_peak = max(diff_peak, fabs(d));
+    }
+    if (n != render.size())
+        printf("compare: length differs, %zu of %zu samples compared\n", n, render.size());
+    if (diff_sum == 0.0) {
+        printf("compare: identical\n");
+    } else {
+        printf("compare: %6.1f dB difference, peak %.1f dBFS\n",
+               10.0 * log10(diff_sum / max(ref_sum, 1.0)),
+               20.0 * log10(diff_peak / 2147483648.0));
+    }
+    return 0;
+}
+
+/*
+ * Time a single voice instance playing a held note, gives the cost of one
+ * active voice independent of the trace.
+ */
+static double bench_voice(void) {
+    *synth_interface.note[0] = 62.0f;
+    *synth_interface.pres[0] = 0.5f;
+    *synth_interface.vpres[0] = 0.0f;
+    *synth_interface.but_x[0] = 0.0f;
+    *synth_interface.but_y[0] = 0.2f;
+    synth_voice_publish(0);
+    read_voice_params();
+    dsp* voice = slots[cur_slot].voices[0];
+    voice->instanceClear();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n = 0; n < BENCH_BLOCKS; n++) {
+        voice->compute(codec_block_size, NULL, voice_output);
+    }
+    return elapsed_ns(&start) / (BENCH_BLOCKS * codec_block_size);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-o out.wav] [-c ref.wav] [-b block size] [-r repeat] trace.txt\n", name);
+    fprintf(stderr, "   -o      : write output to wav file\n");
+    fprintf(stderr, "   -c      : compare output with an earlier render\n");
+    fprintf(stderr, "   -b      : audio block size [16/32/64]\n");
+    fprintf(stderr, "   -r      : render the trace multiple times for stable timing\n");
+}
+
+int main(int argc, char** argv) {
+    const char* wav_name = NULL;
+    const char* ref_name = NULL;
+    int repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:c:b:r:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            wav_name = optarg;
+            break;
+        case 'c':
+            ref_name = optarg;
+            break;
+        case 'b':
+            codec_block_size = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || repeat < 1 ||
+        (codec_block_size != 16 && codec_block_size != 32 && codec_block_size != 64)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (read_trace(argv[optind]) < 0)
+        return 1;
+
+#if defined(__SSE__)
+    // the firmware runs with flush to zero enabled, without it denormals in
+    // decaying voices dominate the timing on x86
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+
+    float length = trace.empty() ? 0.0f : trace.back().time;
+    int trace_blocks = (length + TAIL_TIME) * SAMPLINGFREQ / codec_block_size + 1;
+    total_blocks = trace_blocks * repeat;
+    render.reserve(total_blocks * codec_block_size * 2);
+    for (int v = 0; v < MAX_VOICECOUNT; v++) {
+        voice_button[v] = -1;
+        voice_pres[v] = 0.0f;
+    }
+
+    // runs until chThdShouldTerminateX() returns true, repeats restart the trace
+    for (int r = 0; r < repeat; r++) {
+        trace_pos = 0;
+        trace_block = block;
+        total_blocks = trace_blocks * (r + 1);
+        synthThread(NULL);
+    }
+
+    int samples = block * codec_block_size;
+    double ns_per_sample = synth_ns / samples;
+    double voice_ns = bench_voice();
+    printf("rendered %d samples (%.2f s) from %zu messages\n",
+           samples, (float)samples / SAMPLINGFREQ, trace.size());
+    printf("synth:   %8.1f ns/sample, %.1f%% of real time\n",
+           ns_per_sample, ns_per_sample * SAMPLINGFREQ * 1e-7);
+    printf("voices:  %8.2f active on average of %d\n",
+           (float)active_voice_blocks / block, VOICECOUNT);
+    printf("voice:   %8.1f ns/sample per active voice\n", voice_ns);
+
+    if (wav_name && write_wav(wav_name) < 0)
+        return 1;
+    if (ref_name && compare_wav(ref_name) < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,232 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check and benchmark of the timer wheel (timer_wheel.h). Random schedules,
+ * reschedules and cancels of a timer per button are checked against a plain
+ * array of expiry times: every timer has to fire once, at its tick and in
+ * order, also when callbacks schedule or cancel timers. Then the cost per tick
+ * is compared to checking the dead note time of every button each time.
+ *
+ * usage: timer_bench [-n ticks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define BUTTONCOUNT 68
+#define CLEAR_TIMER 1000 // dead note timeout in ticks, 500 ms
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned int seed = 1;
+
+static int rnd(int n) {
+  seed = seed * 1103515245 + 12345;
+  return ((seed >> 8) & 0xffff) * n >> 16;
+}
+
+// reference, -1 when not scheduled
+static int64_t ref_expires[BUTTONCOUNT];
+static uint64_t ref_order[BUTTONCOUNT];
+static uint64_t order = 0;
+
+static wheel_timer_t timers[BUTTONCOUNT];
+static timer_wheel_t wheel;
+static int errors = 0;
+static int fired = 0;
+static uint32_t last_expires;
+static uint64_t last_order;
+
+static void schedule(int id, uint32_t expires) {
+  if ((int32_t)(expires - wheel.now) <= 0)
+    expires = wheel.now + 1;
+  tw_schedule(&wheel, &timers[id], expires);
+  ref_expires[id] = expires;
+  ref_order[id] = order++;
+}
+
+static void cancel(int id) {
+  tw_cancel(&wheel, &timers[id]);
+  ref_expires[id] = -1;
+}
+
+static void check_fired(void* arg, timer_wheel_t* w, wheel_timer_t* t) {
+  (void)arg;
+  int id = t->id;
+  if (ref_expires[id] != (int64_t)w->now || t->expires != w->now) {
+    fprintf(stderr, "timer %d fired at %u, expected %lld\n", id, w->now, (long long)ref_expires[id]);
+    errors++;
+  }
+  // in order of expiry, then in order of scheduling
+  int32_t d = t->expires - last_expires;
+  if (fired && (d < 0 || (d == 0 && ref_order[id] < last_order))) {
+    fprintf(stderr, "timer %d fired out of order at %u\n", id, w->now);
+    errors++;
+  }
+  last_expires = t->expires;
+  last_order = ref_order[id];
+  ref_expires[id] = -1;
+  fired++;
+
+  // like a note off retry, or cancel another timer
+  int r = rnd(8);
+  if (r == 0) {
+    schedule(id, w->now + 1 + rnd(3));
+  } else if (r == 1) {
+    int other = rnd(BUTTONCOUNT);
+    if (other != id)
+      cancel(other);
+  } else if (r == 2) {
+    int other = rnd(BUTTONCOUNT);
+    schedule(other, w->now + rnd(TIMER_WHEEL_SLOTS * 3));
+  }
+}
+
+static int check(int ticks) {
+  tw_init(&wheel, 0xffffff00); // wraps around during the run
+  for (int n = 0; n < BUTTONCOUNT; n++) {
+    tw_timer_init(&timers[n], n);
+    ref_expires[n] = -1;
+  }
+  uint32_t t = wheel.now;
+  int scheduled = 0;
+  while (ticks > 0) {
+    // some button messages
+    int messages = rnd(20);
+    for (int k = 0; k < messages; k++) {
+      int id = rnd(BUTTONCOUNT);
+      int r = rnd(16);
+      if (r == 0) {
+        cancel(id);
+      } else {
+        schedule(id, t + (r == 1 ? rnd(5 * TIMER_WHEEL_SLOTS) : rnd(10)));
+        scheduled++;
+      }
+    }
+    int step = 1 + rnd(8);
+    t += step;
+    ticks -= step;
+    fired = 0;
+    tw_advance(&wheel, t, check_fired, NULL);
+    // everything up to now has fired
+    int pending = 0;
+    for (int n = 0; n < BUTTONCOUNT; n++) {
+      if (ref_expires[n] >= 0) {
+        pending++;
+        if (!tw_pending(&timers[n]) || (int32_t)((uint32_t)ref_expires[n] - t) <= 0) {
+          fprintf(stderr, "timer %d didn't fire at %lld\n", n, (long long)ref_expires[n]);
+          errors++;
+          ref_expires[n] = -1;
+        }
+      } else if (tw_pending(&timers[n])) {
+        fprintf(stderr, "timer %d is pending after it fired or was cancelled\n", n);
+        errors++;
+      }
+    }
+    if (pending != wheel.count) {
+      fprintf(stderr, "wheel counts %d timers, expected %d\n", wheel.count, pending);
+      errors++;
+      return 1;
+    }
+    if (errors > 10)
+      break;
+  }
+  printf("checked %d schedules, %s\n", scheduled, errors ? "FAILED" : "ok");
+  return errors != 0;
+}
+
+static uint32_t expires[BUTTONCOUNT];
+
+// the timer is only moved when it fires, not on every message
+static void dead_note(void* arg, timer_wheel_t* w, wheel_timer_t* t) {
+  if ((int32_t)(expires[t->id] - w->now) > 0) {
+    tw_schedule(w, t, expires[t->id]);
+  } else {
+    expires[t->id] = 0;
+    (*(int*)arg)++;
+  }
+}
+
+/*
+ * Held notes set their dead note time on every message, a message per button
+ * every tick, and the timers are handled every 4 ticks like synth_tick().
+ */
+static void bench(int held, int ticks) {
+  volatile int sink = 0;
+  int count = 0;
+
+  tw_init(&wheel, 0);
+  for (int n = 0; n < BUTTONCOUNT; n++) {
+    tw_timer_init(&timers[n], n);
+  }
+  memset(expires, 0, sizeof(expires));
+  double t0 = now();
+  for (uint32_t t = 1; t <= (uint32_t)ticks; t++) {
+    for (int n = 0; n < held; n++) {
+      expires[n] = t + CLEAR_TIMER;
+      if (!tw_pending(&timers[n]))
+        tw_schedule(&wheel, &timers[n], expires[n]);
+    }
+    if (t % 4 == 0)
+      tw_advance(&wheel, t, dead_note, &count);
+  }
+  double t_wheel = now() - t0;
+
+  memset(expires, 0, sizeof(expires));
+  t0 = now();
+  for (uint32_t t = 1; t <= (uint32_t)ticks; t++) {
+    for (int n = 0; n < held; n++) {
+      expires[n] = t + CLEAR_TIMER;
+    }
+    if (t % 4 == 0) {
+      for (int n = 0; n < BUTTONCOUNT; n++) {
+        if (expires[n] && expires[n] < t) {
+          expires[n] = 0;
+          count++;
+        }
+      }
+    }
+  }
+  double t_scan = now() - t0;
+  sink += count;
+
+  printf("%2d keys held: timer wheel %.1f ns/tick, scan all buttons %.1f ns/tick\n",
+         held, t_wheel * 1e9 / ticks, t_scan * 1e9 / ticks);
+}
+
+int main(int argc, char** argv) {
+  int ticks = 1000000;
+  for (int n = 1; n < argc - 1; n++) {
+    if (!strcmp(argv[n], "-n"))
+      ticks = atoi(argv[n+1]);
+  }
+  int r = check(ticks);
+  bench(0, ticks);
+  bench(1, ticks);
+  bench(10, ticks);
+  return r;
+}
@@ -0,0 +1,255 @@
+/**
+ * Copyright (C) 2019 Piers Titus van der Torren
+ *
+ * This file is part of Striso Control.
+ *
+ * Striso Control is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Striso Control is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Striso Control. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tuning_check: host build of synth_control.cpp that checks MIDI Tuning
+ * Standard retuning (midi_tuning.h)
+ *
+ * SysEx messages are fed as usb MIDI packets of up to 3 bytes, then keys are
+ * played in MPE mode and the pitch of the key, the note of the internal synth
+ * voice and the MPE pitch bend sent on its channel are compared to the
+ * expected tuning. Covers single note and scale/octave tunings, real-time
+ * changes of held notes, broken messages and saving the tuning with
+ * save_tuning(), also when the settings store is full.
+ *
+ * usage: tuning_check [-d]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../synth_control.cpp"
+#include "synth_control_stubs.h"
+
+static bool dump = false;
+static int errors = 0;
+static int checks = 0;
+static int last_bend[16];
+
+static void midi_out(int n, uint8_t b0, uint8_t b1, uint8_t b2) {
+    if ((b0 & 0xf0) == MIDI_PITCH_BEND && n == 3) {
+        last_bend[b0 & 0x0f] = (b2 << 7) | b1;
+    }
+    if (dump) {
+        printf("out %8.3f", now_ms * 0.001f);
+        uint8_t b[3] = {b0, b1, b2};
+        for (int k = 0; k < n; k++) {
+            printf(" %02x", b[k]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Send a SysEx message as usb MIDI packets
+ */
+static void sysex(const std::vector<uint8_t>& m) {
+    if (dump) {
+        printf("in  %8.3f", now_ms * 0.001f);
+        for (size_t k = 0; k < m.size(); k++) {
+            printf(" %02x", m[k]);
+        }
+        printf("\n");
+    }
+    for (size_t n = 0; n < m.size(); n += 3) {
+        int len = m.size() - n < 3 ? m.size() - n : 3;
+        MidiInSysExHandler(MIDI_DEVICE_USB_DEVICE, 1, &m[n], len);
+    }
+}
+
+static std::vector<uint8_t> single_note(bool realtime, int key, float pitch) {
+    int fraction = (pitch - (int)pitch) * 16384 + 0.5f;
+    std::vector<uint8_t> m = {0xf0, (uint8_t)(realtime ? 0x7f : 0x7e), 0x7f, 0x08, 0x07, 0x00, 0x00, 0x01,
+        (uint8_t)key, (uint8_t)(int)pitch, (uint8_t)(fraction >> 7), (uint8_t)(fraction & 0x7f), 0xf7};
+    return m;
+}
+
+// scale/octave tuning with 14 bit cents per pitch class
+static std::vector<uint8_t> scale_octave(bool realtime, const float* cents) {
+    std::vector<uint8_t> m = {0xf0, (uint8_t)(realtime ? 0x7f : 0x7e), 0x7f, 0x08, 0x09, 0x03, 0x7f, 0x7f};
+    for (int k = 0; k < 12; k++) {
+        int v = 0x2000 + (int)lrintf(cents[k] * (0x2000 / 100.0f));
+        if (v > 0x3fff) v = 0x3fff;
+        m.push_back(v >> 7);
+        m.push_back(v & 0x7f);
+    }
+    m.push_back(0xf7);
+    return m;
+}
+
+static void key(int but, int pres) {
+    int msg[6] = {ID_DIS, but, pres, 0, 0, 0};
+    now_ms++;
+    synth_message(6, msg);
+}
+
+/*
+ * The note button that plays MIDI key k at the default octave
+ */
+static int button(int k) {
+    for (int n = 0; n < 61; n++) {
+        int but = button_number_map[n];
+        if (dis.buttons[but].midinote_base + (int)(dis.start_note_offset + 0.5f) == k)
+            return but;
+    }
+    fprintf(stderr, "no button for key %d\n", k);
+    exit(1);
+}
+
+static void check(const char* what, int but, float pitch) {
+    const Button* b = &dis.buttons[but];
+    int channel = dis.midi_channel_offset + b->voice;
+    float bend = 0x2000 + (pitch - b->midinote) * dis.pitch_table->bend_scale;
+    float synth_note = *(synth_interface.note[b->voice]);
+    bool ok = fabsf(b->note - pitch) < 1e-4f && fabsf(synth_note - pitch) < 1e-4f
+              && fabsf(last_bend[channel] - bend) <= 1.0f;
+    printf("%-44s key %3d: pitch %8.4f, synth %8.4f, pitch bend %5d, expected %8.4f and %5.0f: %s\n",
+           what, b->midinote, b->note, synth_note, last_bend[channel], pitch, bend, ok ? "ok" : "FAILED");
+    checks++;
+    errors += !ok;
+}
+
+// play a key and check its pitch
+static void play(const char* what, int but, float pitch) {
+    key(but, 0x1000);
+    key(but, 0x1000);
+    check(what, but, pitch);
+    key(but, 0);
+}
+
+static void check_setting(const char* k, const char* value) {
+    char v[8];
+    bool found = settingsStoreGet(k, v);
+    bool ok = found && !strncmp(v, value, 8);
+    printf("%-44s %.8s = %.8s: %s\n", "saved setting", k, found ? v : "(none)", ok ? "ok" : "FAILED");
+    checks++;
+    errors += !ok;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "dh")) != -1) {
+        switch (opt) {
+        case 'd':
+            dump = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d]\n", argv[0]);
+            fprintf(stderr, "   -d      : print the SysEx input and MIDI output\n");
+            return 1;
+        }
+    }
+
+    synth_interface_init();
+    synth_control_init();
+    set_midi_mode(MIDI_MODE_MPE);
+    midi_config();
+    int d4 = button(62), e4 = button(64), a4 = button(69), cs4 = button(61);
+
+    play("12tet", d4, 62.0f);
+
+    // real-time single note change without bank, two keys
+    sysex({0xf0, 0x7f, 0x7f, 0x08, 0x02, 0x00, 0x02,
+           62, 62, 0x40, 0x00,   // 62.5
+           69, 68, 0x60, 0x00,   // 68.75
+           0xf7});
+    play("single note, real-time", d4, 62.5f);
+    play("single note, real-time, second key", a4, 68.75f);
+
+    // non-real-time changes are for the next notes
+    key(d4, 0x1000);
+    sysex(single_note(false, 62, 62.25f));
+    key(d4, 0x1000);
+    check("non-real-time while held", d4, 62.5f);
+    key(d4, 0);
+    play("non-real-time, next note", d4, 62.25f);
+
+    // real-time changes also retune held notes
+    key(d4, 0x1000);
+    sysex(single_note(true, 62, 61.9f));
+    key(d4, 0x1000);
+    check("real-time while held", d4, 61.9f);
+    key(d4, 0);
+
+    // 7F 7F 7F is no change
+    sysex({0xf0, 0x7f, 0x7f, 0x08, 0x02, 0x00, 0x01, 62, 0x7f, 0x7f, 0x7f, 0xf7});
+    play("no change", d4, 61.9f);
+
+    // broken messages are ignored
+    sysex({0xf0, 0x7f, 0x7f, 0x08, 0x02, 0x00, 0x02, 62, 62, 0x00, 0x00, 0xf7});
+    play("fewer changes than announced", d4, 61.9f);
+    sysex({0xf0, 0x7f, 0x7f, 0x08, 0x02, 0x00, 0x01, 62, 62, 0x00, 0x90, 0x40, 0x40});
+    play("interrupted by a note on", d4, 61.9f);
+    sysex({0xf0, 0x7e, 0x7f, 0x08, 0x08, 0x03, 0x7f, 0x7f, 64, 64, 0xf7});
+    play("short scale/octave", d4, 61.9f);
+
+    // scale/octave with 1 byte, replaces the single note changes
+    sysex({0xf0, 0x7e, 0x7f, 0x08, 0x08, 0x03, 0x7f, 0x7f,
+           64, 54, 74, 64, 64, 64, 64, 64, 64, 64, 64, 64, 0xf7});
+    play("scale/octave 1 byte", d4, 62.1f);
+    play("scale/octave 1 byte, other pitch class", cs4, 60.9f);
+    play("scale/octave 1 byte, unchanged key", a4, 69.0f);
+
+    // scale/octave with 2 bytes, real-time
+    float cents[12] = {0, 0, -50, 0, 100, 0, 0, 0, 0, -13.686f, 0, 0};
+    key(d4, 0x1000);
+    sysex(scale_octave(true, cents));
+    key(d4, 0x1000);
+    check("scale/octave 2 bytes, real-time while held", d4, 61.5f);
+    key(d4, 0);
+    play("scale/octave 2 bytes, +100 cents", e4, 64.0f + 0x1fff / 8192.0f);
+    play("scale/octave 2 bytes, fraction", a4, 69.0f - 0.13684f);
+
+    // a full settings store is reported
+    settings_full = true;
+    int r = save_tuning(2);
+    settings_full = false;
+    printf("%-44s %s\n", "save with a full settings store", r ? "ok" : "FAILED");
+    checks++;
+    errors += !r;
+    play("not saved, keeps the pitch", d4, 61.5f);
+
+    // save as tuning 1, keeps the pitch
+    r = save_tuning(1);
+    printf("%-44s %s\n", "save tuning 1", r ? "FAILED" : "ok");
+    checks++;
+    errors += r != 0;
+    play("saved as tuning 1", d4, 61.5f);
+    check_setting("fT1oct  ", "1200.000");
+    check_setting("fT1fifth", "700.000 ");
+    dis.load_tuning(0);
+    play("tuning 0 after saving", d4, 62.0f);
+    // read back from the settings store
+    compile_presets();
+    dis.load_tuning(1);
+    play("tuning 1 from the settings store", d4, 61.5f);
+    play("tuning 1 from the settings store", a4, 69.0f - 0.13684f);
+
+    // a new MTS tuning starts from 12tet again
+    sysex(single_note(true, 69, 69.5f));
+    play("single note after a stored tuning", d4, 62.0f);
+    play("single note after a stored tuning", a4, 69.5f);
+
+    printf("%d checks, %s\n", checks, errors ? "FAILED" : "ok");
+    return errors != 0;
+}